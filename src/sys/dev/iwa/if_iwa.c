@@ -75,14 +75,28 @@ __FBSDID("$FreeBSD$");
 #include <dev/iwa/iwl/iwl-config.h>
 #include <dev/iwa/iwl/iwl-csr.h>
 #include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
 
 #include <dev/iwa/if_iwa_firmware.h>
 #include <dev/iwa/if_iwa_trans.h>
 #include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
 #include <dev/iwa/if_iwavar.h>
 #include <dev/iwa/if_iwareg.h>
 
 #include <dev/iwa/if_iwa_rx.h>
+#include <dev/iwa/if_iwa_fwlog.h>
+#include <dev/iwa/if_iwa_crash.h>
+#include <dev/iwa/if_iwa_journal.h>
+#include <dev/iwa/if_iwa_notif.h>
 
 
 /*
@@ -112,6 +126,8 @@ iwa_populate_hw_id(struct iwa_softc *sc)
 static int
 iwa_run_init_mvm_ucode(struct iwa_softc *sc, bool justnvm)
 {
+	static const uint16_t init_complete[] = { INIT_COMPLETE_NOTIF };
+	struct iwa_notif_wait calib_wait;
 	int error;
 
 	IWA_LOCK_ASSERT(sc);
@@ -124,11 +140,23 @@ iwa_run_init_mvm_ucode(struct iwa_softc *sc, bool justnvm)
 		return (EPERM);
 	}
 
+	/*
+	 * The results of an earlier INIT calibration run are still
+	 * good; the REGULAR ucode gets them via iwa_phy_db_send().
+	 */
+	if (!justnvm && sc->sc_phy_db.pd_valid)
+		return (0);
+
+	/* Likewise the NVM; it can't have changed since it was read */
+	if (justnvm && iwa_nvm_cached(sc)) {
+		sc->sc_nvm_cache.nc_hits++;
+		return (0);
+	}
+
 	/*
 	 * Note: the firmware must be loaded by the caller.
 	 */
 
-	sc->sc_init_complete = false;
 	if ((error = iwa_mvm_load_ucode_wait_alive(sc,
 	    IWL_UCODE_INIT)) != 0)
 		return (error);
@@ -155,37 +183,58 @@ iwa_run_init_mvm_ucode(struct iwa_softc *sc, bool justnvm)
                 return 0;
         }
 
-#if 0
-        /* Send TX valid antennas before triggering calibrations */
-        if ((error = iwa_send_tx_ant_cfg(sc, IWM_FW_VALID_TX_ANT(sc))) != 0)
-                return error;
-
-        /*
-        * Send phy configurations command to init uCode
-        * to start the 16.0 uCode init image internal calibrations.
-        */
-        if ((error = iwa_send_phy_cfg_cmd(sc)) != 0 ) {
-                device_printf(sc->sc_dev, "Failed to run INIT "
-                    "calibrations: %d\n", error);
-                return error;
-        }
+	/* Start over; stale sections mustn't mix with fresh ones */
+	iwa_phy_db_free(sc);
+	sc->sc_phy_db.pd_init_runs++;
 
-        /*
-         * Nothing to do but wait for the init complete notification
-         * from the firmware
-         */
-        while (!sc->sc_init_complete)
-                if ((error = tsleep(&sc->sc_init_complete,
-                    0, "iwminit", 2*hz)) != 0)
-                        break;
+	/* The calibration results arrive before INIT_COMPLETE */
+	iwa_init_notif_wait(sc, &calib_wait, init_complete,
+	    nitems(init_complete), NULL, NULL);
 
-        return error;
-#endif
-        return (EINVAL);
+	/* Send TX valid antennas before triggering calibrations */
+	if ((error = iwa_send_tx_ant_cfg(sc, IWM_FW_VALID_TX_ANT(sc))) != 0) {
+		iwa_remove_notif_wait(sc, &calib_wait);
+		return (error);
+	}
+
+	/*
+	 * Send phy configurations command to init uCode
+	 * to start the 16.0 uCode init image internal calibrations.
+	 */
+	if ((error = iwa_send_phy_cfg_cmd(sc)) != 0) {
+		device_printf(sc->sc_dev, "Failed to run INIT "
+		    "calibrations: %d\n", error);
+		iwa_remove_notif_wait(sc, &calib_wait);
+		return (error);
+	}
+
+	/*
+	 * Nothing to do but wait for the init complete notification
+	 * from the firmware.
+	 */
+	if ((error = iwa_wait_notif(sc, &calib_wait, 2*hz)) != 0) {
+		device_printf(sc->sc_dev, "INIT calibrations didn't "
+		    "complete: %d\n", error);
+		return (error);
+	}
+
+	/* Without these the REGULAR ucode can't use any of it */
+	if (sc->sc_phy_db.pd_cfg.size == 0 ||
+	    sc->sc_phy_db.pd_calib_nch.size == 0) {
+		device_printf(sc->sc_dev,
+		    "INIT calibrations incomplete; will rerun\n");
+		return (EIO);
+	}
+	sc->sc_phy_db.pd_valid = true;
+	sc->sc_phy_db.pd_ticks = ticks;
+	return (0);
 }
 
 /*
- * Pre-initialise the hardware.
+ * Pre-initialise the hardware: read the NVM, then run the INIT
+ * calibrations whose results the REGULAR ucode is given by
+ * iwa_phy_db_send().  Both are skipped if an earlier run's results
+ * are still held.
  *
  * The firmware must already have been loaded.
  */
@@ -207,7 +256,20 @@ iwa_preinit(struct iwa_softc *sc)
 	}
 
 	iwa_stop_device(sc);
-	return 0;
+
+	/*
+	 * iwlwifi: iwl_mvm_up(); the calibrations want a freshly
+	 * started INIT image.  With rfkill on they can't run; leave
+	 * them for the next bring-up.
+	 */
+	if (sc->sc_phy_db.pd_valid || (sc->sc_flags & IWM_FLAG_RFKILL))
+		return 0;
+
+	if ((error = iwa_start_hw(sc)) != 0)
+		return error;
+	error = iwa_run_init_mvm_ucode(sc, false);
+	iwa_stop_device(sc);
+	return error;
 }
 
 static void
@@ -234,7 +296,171 @@ iwa_stop_locked(struct iwa_softc *sc, int disable)
 
         ifp->if_timer = sc->sc_tx_timer = 0;
 #endif
+	iwa_tx_watchdog_stop(sc);
+
+	/* Toss any partially built A-MSDU and anything queued */
+	iwa_amsdu_drain(sc);
+	iwa_sched_flush(sc);
+
+	/* The firmware forgets its BA sessions; so do we, and the peers */
+	iwa_rxba_teardown(sc);
+	iwa_fwlog_stop(sc);
+
 	iwa_stop_device(sc);
+
+	/* Anyone waiting on the firmware won't hear back now */
+	iwa_notif_wait_abort(sc);
+}
+
+/*
+ * Restart the firmware after it has died or the TX watchdog has
+ * given up on a stuck queue.
+ *
+ * If the configuration journal is intact the REGULAR firmware is
+ * brought back up with the journal replayed into it; otherwise fall
+ * back to a full reinit.
+ */
+static void
+iwa_restart_task(void *arg, int npending)
+{
+	struct iwa_softc *sc = arg;
+	int error;
+
+	IWA_LOCK(sc);
+	if (sc->sc_inactive) {
+		IWA_UNLOCK(sc);
+		return;
+	}
+
+	device_printf(sc->sc_dev, "%s: restarting firmware\n", __func__);
+
+	iwa_stop_locked(sc, 0);
+	if (iwa_journal_can_restart(sc)) {
+		if ((error = iwa_journal_restart(sc)) == 0) {
+			iwa_tx_watchdog_start(sc);
+			IWA_UNLOCK(sc);
+			return;
+		}
+		device_printf(sc->sc_dev, "%s: journal replay failed: %d\n",
+		    __func__, error);
+		iwa_stop_locked(sc, 0);
+	}
+
+	/* Whatever was configured is gone now */
+	iwa_journal_reset(sc);
+	if ((error = iwa_preinit(sc)) != 0) {
+		device_printf(sc->sc_dev, "%s: restart failed: %d\n",
+		    __func__, error);
+		IWA_UNLOCK(sc);
+		return;
+	}
+	iwa_tx_watchdog_start(sc);
+	IWA_UNLOCK(sc);
+}
+
+/*
+ * Number of RX ring slots currently owned by the hardware.
+ */
+static int
+iwa_sysctl_rx_occupancy(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	int val;
+
+	IWA_LOCK(sc);
+	val = (sc->rxq.wptr - sc->rxq.cur + IWA_RX_RING_COUNT) %
+	    IWA_RX_RING_COUNT;
+	IWA_UNLOCK(sc);
+
+	return (sysctl_handle_int(oidp, &val, 0, req));
+}
+
+static void
+iwa_sysctl_attach(struct iwa_softc *sc)
+{
+	struct sysctl_ctx_list *ctx = device_get_sysctl_ctx(sc->sc_dev);
+	struct sysctl_oid *tree = device_get_sysctl_tree(sc->sc_dev);
+	struct sysctl_oid_list *child = SYSCTL_CHILDREN(tree);
+	struct sysctl_oid *wd, *rx;
+
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "debug", CTLFLAG_RW,
+	    &sc->sc_debug, 0, "control debugging printfs");
+
+	wd = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "txq_wd", CTLFLAG_RD,
+	    NULL, "TX queue watchdog");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(wd), OID_AUTO, "timeouts",
+	    CTLFLAG_RD, &sc->sc_txq_wd.wd_timeouts, 0,
+	    "stuck queues detected");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(wd), OID_AUTO, "flushes",
+	    CTLFLAG_RD, &sc->sc_txq_wd.wd_flushes, 0,
+	    "TXPATH_FLUSH commands sent");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(wd), OID_AUTO, "flush_fail",
+	    CTLFLAG_RD, &sc->sc_txq_wd.wd_flush_fail, 0,
+	    "TXPATH_FLUSH commands that couldn't be sent");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(wd), OID_AUTO, "restarts",
+	    CTLFLAG_RD, &sc->sc_txq_wd.wd_restarts, 0,
+	    "firmware restarts");
+
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "amsdu_drops", CTLFLAG_RD,
+	    &sc->sc_amsdu_drops, 0, "A-MSDU subframes dropped");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "attach_state", CTLFLAG_RD,
+	    &sc->sc_attach_state, 0,
+	    "deferred attach: 0 pending, 1 done, 2 failed");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "resume_usec", CTLFLAG_RD,
+	    &sc->sc_resume_usec, 0, "time taken by the last resume");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "fw_poll", CTLFLAG_RW,
+	    &sc->sc_fw_poll, 0,
+	    "load firmware by polling rather than waiting for interrupts");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "rbuf_size", CTLFLAG_RD,
+	    &sc->sc_rbuf_size, 0, "RX buffer size");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "rx_copy_thresh", CTLFLAG_RW,
+	    &sc->sc_rx_copy_thresh, 0,
+	    "copy received frames up to this size out of the RX buffer");
+	rx = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "rx", CTLFLAG_RD,
+	    NULL, "RX path");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "crc_err",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_crc_err, 0,
+	    "frames dropped with bad CRC or overrun");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "runt",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_runt, 0,
+	    "frames dropped with a bad length");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "nobuf",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_nobuf, 0,
+	    "frames dropped for lack of an mbuf");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "noif",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_noif, 0,
+	    "frames dropped with no interface attached");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "copied",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_copied, 0,
+	    "frames copied out of the RX buffer");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "zerocopy",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_zerocopy, 0,
+	    "frames passed up in the RX buffer");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "batches",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_batches, 0,
+	    "RX batches handed to net80211");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "wptr_writes",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_wptr_writes, 0,
+	    "RX write pointer updates");
+	SYSCTL_ADD_UINT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "reserve_fail",
+	    CTLFLAG_RD, &sc->sc_rx_stats.rx_reserve_fail, 0,
+	    "failures to top up the RX buffer reserve");
+	SYSCTL_ADD_INT(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "reserve",
+	    CTLFLAG_RD, &sc->rxq.nreserve, 0,
+	    "mapped RX buffers in the restock reserve");
+	SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(rx), OID_AUTO, "occupancy",
+	    CTLTYPE_INT | CTLFLAG_RD, sc, 0, iwa_sysctl_rx_occupancy, "I",
+	    "RX ring slots owned by the hardware");
+
+	iwa_sched_sysctl_attach(sc, ctx, child);
+	iwa_rxba_sysctl_attach(sc, ctx, child);
+	iwa_stats_sysctl_attach(sc, ctx, child);
+	iwa_fwlog_sysctl_attach(sc, ctx, child);
+	iwa_crash_sysctl_attach(sc, ctx, child);
+	iwa_journal_sysctl_attach(sc, ctx, child);
+	iwa_phy_db_sysctl_attach(sc, ctx, child);
+	iwa_nvm_sysctl_attach(sc, ctx, child);
+	iwa_wait_sysctl_attach(sc, ctx, child);
 }
 
 static void
@@ -244,6 +470,7 @@ iwa_stop(struct ifnet *ifp, int disable)
 
 	IWA_LOCK(sc);
 	iwa_stop_locked(sc, disable);
+	iwa_journal_reset(sc);
 	IWA_UNLOCK(sc);
 }
 
@@ -251,6 +478,7 @@ int
 iwa_intr(struct iwa_softc *sc)
 {
 //	struct ifnet *ifp = sc->sc_ifp;
+	struct mbuf *rxbatch = NULL;
 	int handled = 0;
 	int r1, r2, rv = 0;
 	bool isperiodic = false;
@@ -308,27 +536,15 @@ iwa_intr(struct iwa_softc *sc)
 	handled |= (r1 & (CSR_INT_BIT_ALIVE /*| CSR_INT_BIT_SCD*/));
 
 	if (r1 & CSR_INT_BIT_SW_ERR) {
-#if 0
-		int i;
-
-		iwm_nic_error(sc);
-
-		/* Dump driver status (TX and RX rings) while we're here. */
-		aprint_error("driver status:\n");
-		for (i = 0; i < IWL_MVM_MAX_QUEUES; i++) {
-			struct iwm_tx_ring *ring = &sc->txq[i];
-			aprint_error("  tx ring %2d: qid=%-2d cur=%-3d "
-			    "queued=%-3d\n",
-			    i, ring->qid, ring->cur, ring->queued);
-		}
-		aprint_error("  rx ring: cur=%d\n", sc->rxq.cur);
-		aprint_error("  802.11 state %d\n", sc->sc_ic.ic_state);
-#endif
+		/* Grab the error table and ring state before we stop */
+		iwa_crash_capture(sc);
 
 		device_printf(sc->sc_dev,
 		    "firmware error, stopping device\n");
 //		ifp->if_flags &= ~IFF_UP;
 		iwa_stop_locked(sc, 1);
+		if (iwa_journal_can_restart(sc))
+			taskqueue_enqueue(sc->sc_tq, &sc->sc_restart_task);
 		rv = 1;
 		goto out;
 
@@ -340,6 +556,8 @@ iwa_intr(struct iwa_softc *sc)
 		    "hardware error, stopping device \n");
 //		ifp->if_flags &= ~IFF_UP;
 		iwa_stop_locked(sc, 1);
+		if (iwa_journal_can_restart(sc))
+			taskqueue_enqueue(sc->sc_tq, &sc->sc_restart_task);
 		rv = 1;
 		goto out;
 	}
@@ -349,8 +567,7 @@ iwa_intr(struct iwa_softc *sc)
 		IWA_REG_WRITE(sc, CSR_FH_INT_STATUS, CSR_FH_INT_TX_MASK);
 		handled |= CSR_INT_BIT_FH_TX;
 		device_printf(sc->sc_dev, "%s: called; FH_TX set\n", __func__);
-		sc->sc_fw_chunk_done = true;
-		wakeup(&sc->sc_fw);
+		iwa_notif_wait_notify(sc, IWA_NOTIF_FW_CHUNK, NULL);
 	}
 
 	if (r1 & CSR_INT_BIT_RF_KILL) {
@@ -380,7 +597,7 @@ iwa_intr(struct iwa_softc *sc)
 	if ((r1 & (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX)) || isperiodic) {
 		handled |= (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX);
 		IWA_REG_WRITE(sc, CSR_FH_INT_STATUS, CSR_FH_INT_RX_MASK);
-		iwa_notif_intr(sc);
+		rxbatch = iwa_notif_intr(sc);
 
 		/* enable periodic interrupt, see above */
 		if (r1 & (CSR_INT_BIT_FH_RX | CSR_INT_BIT_SW_RX) && !isperiodic)
@@ -394,6 +611,8 @@ iwa_intr(struct iwa_softc *sc)
 out_ena:
 	iwa_restore_interrupts(sc);
 out:
+	/* Last, since it drops the lock */
+	iwa_rx_input_batch(sc, rxbatch);
 
 	IWA_UNLOCK(sc);
 
@@ -401,108 +620,57 @@ out:
 }
 
 /*
- * XXX TODO - we can't assume interrupts are available at attach() time,
- * so this whole "load initial firmware at attach time" has to either stop
- * and be deferred until interface up, or it needs to use some polling
- * of the status registers to verify things are up.
+ * Interrupts are up; kick off the rest of attach.
  *
- * .. grr.
+ * This runs during boot (or straight away if the driver is loaded
+ * later); it only queues the work, so boot doesn't wait for it.
  */
-int
-iwa_attach(struct iwa_softc *sc)
+static void
+iwa_preinit_hook(void *arg)
 {
+	struct iwa_softc *sc = arg;
+
+	taskqueue_enqueue(sc->sc_tq, &sc->sc_attach_task);
+	config_intrhook_disestablish(&sc->sc_preinit_hook);
+	sc->sc_preinit_hook.ich_func = NULL;
+}
+
+/*
+ * The second half of attach: load the firmware, read the NVM, run the
+ * INIT calibration and publish the interface.
+ *
+ * If any of it fails the device stays attached but inactive; detach
+ * tidies up as usual.
+ */
+static void
+iwa_attach_task(void *arg, int npending)
+{
+	struct iwa_softc *sc = arg;
 #if 0
 	struct ieee80211com *ic;
 	struct ifnet *ifp;
 	uint8_t macaddr[IEEE80211_ADDR_LEN];
 #endif
+	sbintime_t t0;
 	int error;
-	int i;
-
-#ifdef	IWA_DEBUG
-	error = resource_int_value(device_get_name(sc->sc_dev),
-	    device_get_unit(sc->sc_dev), "debug", &(sc->sc_debug));
-	if (error != 0)
-		sc->sc_debug = 0xffffffff;
-#else
-	sc->sc_debug = 0xffffffff;
-#endif
-
-	IWA_DPRINTF(sc, IWA_DEBUG_TRACE, "->%s: begin\n",__func__);
-
-	/* Setup initial firmware details */
-	sc->sc_fw_dmasegsz = IWM_FWDMASEGSZ;
-
-	/* Read hardware revision */
-	iwa_populate_hw_id(sc);
-
-	device_printf(sc->sc_dev,
-	    "hw rev: 0x%x, dash: %d, step: %d\n",
-	    sc->sc_hw_rev & CSR_HW_REV_TYPE_MSK,
-	    CSR_HW_REV_DASH(sc->sc_hw_rev),
-	    CSR_HW_REV_STEP(sc->sc_hw_rev));
-
-	/* XXX do we need this; we do it down in preinit() */
-	if ((error = iwa_prepare_card_hw(sc)) != 0) {
-		device_printf(sc->sc_dev,
-		    "hardware not ready, error %d\n",
-		    error);
-		goto fail;
-	}
-
-	/* Allocate DMA memory for firmware transfers. */
-	if ((error = iwa_alloc_fwmem(sc)) != 0) {
-		device_printf(sc->sc_dev,
-		    "could not allocate memory for firmware, error %d\n",
-		    error);
-		goto fail;
-	}
-
-	/* Allocate "Keep Warm" page. */
-	if ((error = iwa_alloc_kw(sc)) != 0) {
-		device_printf(sc->sc_dev,
-		    "could not allocate keep warm page, error %d\n", error);
-		goto fail;
-	}
-
-	if ((error = iwa_alloc_ict(sc)) != 0) {
-		device_printf(sc->sc_dev, "could not allocate ICT table, error %d\n",
-		    error);
-		goto fail;
-	}
-
-	/* Allocate TX scheduler "rings". */
-	if ((error = iwa_alloc_sched(sc)) != 0) {
-		device_printf(sc->sc_dev,
-		    "could not allocate TX scheduler rings, error %d\n", error);
-		goto fail;
-	}
-
-	for (i = 0; i < sc->sc_cfg->base_params->num_of_queues; i++) {
-		if ((error = iwa_alloc_tx_ring(sc, &sc->txq[i], i)) != 0) {
-			device_printf(sc->sc_dev,
-			    "could not allocate TX ring %d, error %d\n", i,
-			    error);
-			goto fail;
-		}
-	}
-
-	/* Allocate RX ring. */
-	if ((error = iwa_alloc_rx_ring(sc, &sc->rxq)) != 0) {
-		device_printf(sc->sc_dev, "could not allocate RX ring, error %d\n",
-		    error);
-		goto fail;
-	}
 
 	/*
 	 * Load initial firmware - do this before the lock is grabbed.
 	 */
+	t0 = sbinuptime();
 	if ((error = iwa_find_firmware(sc)) != 0) {
 		device_printf(sc->sc_dev, "firmware load failed; error %d\n",
 		    error);
 		goto fail;
 	}
 
+	/*
+	 * If there's an NVM image for this NIC, use it rather than
+	 * bringing up the INIT ucode to read the NVM.  If not, or it's
+	 * no good, the NVM is read from the NIC as usual.
+	 */
+	(void) iwa_nvm_load_file(sc);
+
 	IWA_LOCK(sc);
 
 	/*
@@ -531,8 +699,12 @@ iwa_attach(struct iwa_softc *sc)
 		goto fail;
 	}
 
+	iwa_tx_watchdog_start(sc);
+
 	IWA_UNLOCK(sc);
 
+	/* The NVM is in; now the interface can be published */
+
 #if 0
 	ifp = sc->sc_ifp = if_alloc(IFT_IEEE80211);
 	if (ifp == NULL) {
@@ -606,19 +778,17 @@ iwa_attach(struct iwa_softc *sc)
 			| IEEE80211_HTCAP_SHORTGI40	/* short GI in 40MHz */
 #ifdef notyet
 			| IEEE80211_HTCAP_GREENFIELD
-#if IWN_RBUF_SIZE == 8192
-			| IEEE80211_HTCAP_MAXAMSDU_7935	/* max A-MSDU length */
-#else
-			| IEEE80211_HTCAP_MAXAMSDU_3839	/* max A-MSDU length */
-#endif
 #endif
 			/* s/w capabilities */
 			| IEEE80211_HTC_HT		/* HT operation */
 			| IEEE80211_HTC_AMPDU		/* tx A-MPDU */
-#ifdef notyet
 			| IEEE80211_HTC_AMSDU		/* tx A-MSDU */
-#endif
 			;
+		/* max A-MSDU length; 7935 bytes needs an 8k RX buffer */
+		if (sc->sc_rbuf_size >= IWA_RBUF_SIZE_8K)
+			ic->ic_htcaps |= IEEE80211_HTCAP_MAXAMSDU_7935;
+		else
+			ic->ic_htcaps |= IEEE80211_HTCAP_MAXAMSDU_3839;
 	}
 
 	if_initname(ifp, device_get_name(dev), device_get_unit(dev));
@@ -626,7 +796,7 @@ iwa_attach(struct iwa_softc *sc)
 	ifp->if_flags = IFF_BROADCAST | IFF_SIMPLEX | IFF_MULTICAST;
 	ifp->if_init = iwn_init;
 	ifp->if_ioctl = iwn_ioctl;
-	ifp->if_start = iwn_start;
+	ifp->if_start = iwa_start;
 	IFQ_SET_MAXLEN(&ifp->if_snd, ifqmaxlen);
 	ifp->if_snd.ifq_drv_maxlen = ifqmaxlen;
 	IFQ_SET_READY(&ifp->if_snd);
@@ -634,19 +804,19 @@ iwa_attach(struct iwa_softc *sc)
 	ieee80211_ifattach(ic, macaddr);
 	ic->ic_vap_create = iwn_vap_create;
 	ic->ic_vap_delete = iwn_vap_delete;
-	ic->ic_raw_xmit = iwn_raw_xmit;
+	ic->ic_raw_xmit = iwa_raw_xmit;
 	ic->ic_node_alloc = iwn_node_alloc;
 	sc->sc_ampdu_rx_start = ic->ic_ampdu_rx_start;
-	ic->ic_ampdu_rx_start = iwn_ampdu_rx_start;
+	ic->ic_ampdu_rx_start = iwa_ampdu_rx_start;
 	sc->sc_ampdu_rx_stop = ic->ic_ampdu_rx_stop;
-	ic->ic_ampdu_rx_stop = iwn_ampdu_rx_stop;
+	ic->ic_ampdu_rx_stop = iwa_ampdu_rx_stop;
 	sc->sc_addba_request = ic->ic_addba_request;
 	ic->ic_addba_request = iwn_addba_request;
 	sc->sc_addba_response = ic->ic_addba_response;
 	ic->ic_addba_response = iwn_addba_response;
 	sc->sc_addba_stop = ic->ic_addba_stop;
 	ic->ic_addba_stop = iwn_ampdu_tx_stop;
-	ic->ic_newassoc = iwn_newassoc;
+	ic->ic_newassoc = iwa_newassoc;
 	ic->ic_wme.wme_update = iwn_updateedca;
 	ic->ic_update_mcast = iwn_update_mcast;
 	ic->ic_scan_start = iwn_scan_start;
@@ -697,6 +867,167 @@ iwa_attach(struct iwa_softc *sc)
 		ieee80211_announce(ic);
 #endif
 
+	IWA_LOCK(sc);
+	sc->sc_attach_state = IWA_ATTACH_DONE;
+	IWA_UNLOCK(sc);
+	device_printf(sc->sc_dev, "firmware up in %d ms\n",
+	    (int)((sbinuptime() - t0) / SBT_1MS));
+	return;
+
+fail:
+	IWA_LOCK(sc);
+	sc->sc_attach_state = IWA_ATTACH_FAILED;
+	IWA_UNLOCK(sc);
+	device_printf(sc->sc_dev, "deferred attach failed; error %d\n",
+	    error);
+}
+
+int
+iwa_attach(struct iwa_softc *sc)
+{
+	int error;
+	int i;
+
+#ifdef	IWA_DEBUG
+	error = resource_int_value(device_get_name(sc->sc_dev),
+	    device_get_unit(sc->sc_dev), "debug", &(sc->sc_debug));
+	if (error != 0)
+		sc->sc_debug = 0xffffffff;
+#else
+	sc->sc_debug = 0xffffffff;
+#endif
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TRACE, "->%s: begin\n",__func__);
+
+	/* Setup initial firmware details */
+	sc->sc_fw_dmasegsz = IWM_FWDMASEGSZ;
+	if (resource_int_value(device_get_name(sc->sc_dev),
+	    device_get_unit(sc->sc_dev), "fw_poll", &sc->sc_fw_poll) != 0)
+		sc->sc_fw_poll = 0;
+
+	iwa_notif_wait_init(sc);
+	iwa_sched_init(sc);
+	iwa_rxba_init(sc);
+	iwa_stats_init(sc);
+	sc->sc_rx_copy_thresh = IWA_RX_COPY_THRESH;
+
+	/* RX buffer size; 8k buffers allow for large A-MSDUs */
+	if (resource_int_value(device_get_name(sc->sc_dev),
+	    device_get_unit(sc->sc_dev), "rbuf_size", &sc->sc_rbuf_size) != 0)
+		sc->sc_rbuf_size = IWA_RBUF_SIZE;
+	switch (sc->sc_rbuf_size) {
+	case IWA_RBUF_SIZE:
+	case IWA_RBUF_SIZE_8K:
+		break;
+	case 12288:
+		/*
+		 * iwlwifi's 12k buffers are for 11454 byte VHT MPDUs;
+		 * we only do HT, where 8k covers the largest A-MSDU,
+		 * and a 12k buffer would waste 4k of a 16k cluster.
+		 */
+		device_printf(sc->sc_dev,
+		    "rbuf_size 12288 needs VHT; using %d\n",
+		    IWA_RBUF_SIZE_8K);
+		sc->sc_rbuf_size = IWA_RBUF_SIZE_8K;
+		break;
+	default:
+		device_printf(sc->sc_dev,
+		    "invalid rbuf_size %d, using %d\n",
+		    sc->sc_rbuf_size, IWA_RBUF_SIZE);
+		sc->sc_rbuf_size = IWA_RBUF_SIZE;
+		break;
+	}
+
+	callout_init_mtx(&sc->sc_watchdog_to, &sc->sc_mtx, 0);
+	TASK_INIT(&sc->sc_restart_task, 0, iwa_restart_task, sc);
+	TASK_INIT(&sc->sc_attach_task, 0, iwa_attach_task, sc);
+	TASK_INIT(&sc->sc_tx_task, 0, iwa_tx_task, sc);
+
+	sc->sc_tq = taskqueue_create("iwa_taskq", M_WAITOK,
+	    taskqueue_thread_enqueue, &sc->sc_tq);
+	error = taskqueue_start_threads(&sc->sc_tq, 1, 0, "iwa_taskq");
+	if (error != 0) {
+		device_printf(sc->sc_dev, "can't start threads, error %d\n",
+		    error);
+		goto fail;
+	}
+
+	iwa_crash_attach(sc);
+	iwa_journal_attach(sc);
+	if (iwa_fwlog_attach(sc) != 0)
+		device_printf(sc->sc_dev, "firmware log unavailable\n");
+	iwa_sysctl_attach(sc);
+
+	/* Read hardware revision */
+	iwa_populate_hw_id(sc);
+
+	device_printf(sc->sc_dev,
+	    "hw rev: 0x%x, dash: %d, step: %d\n",
+	    sc->sc_hw_rev & CSR_HW_REV_TYPE_MSK,
+	    CSR_HW_REV_DASH(sc->sc_hw_rev),
+	    CSR_HW_REV_STEP(sc->sc_hw_rev));
+
+	/* Allocate DMA memory for firmware transfers. */
+	if ((error = iwa_alloc_fwmem(sc)) != 0) {
+		device_printf(sc->sc_dev,
+		    "could not allocate memory for firmware, error %d\n",
+		    error);
+		goto fail;
+	}
+
+	/* Allocate "Keep Warm" page. */
+	if ((error = iwa_alloc_kw(sc)) != 0) {
+		device_printf(sc->sc_dev,
+		    "could not allocate keep warm page, error %d\n", error);
+		goto fail;
+	}
+
+	if ((error = iwa_alloc_ict(sc)) != 0) {
+		device_printf(sc->sc_dev, "could not allocate ICT table, error %d\n",
+		    error);
+		goto fail;
+	}
+
+	/* Allocate TX scheduler "rings". */
+	if ((error = iwa_alloc_sched(sc)) != 0) {
+		device_printf(sc->sc_dev,
+		    "could not allocate TX scheduler rings, error %d\n", error);
+		goto fail;
+	}
+
+	for (i = 0; i < sc->sc_cfg->base_params->num_of_queues; i++) {
+		if ((error = iwa_alloc_tx_ring(sc, &sc->txq[i], i)) != 0) {
+			device_printf(sc->sc_dev,
+			    "could not allocate TX ring %d, error %d\n", i,
+			    error);
+			goto fail;
+		}
+	}
+
+	/* Allocate RX ring. */
+	if ((error = iwa_alloc_rx_ring(sc, &sc->rxq)) != 0) {
+		device_printf(sc->sc_dev, "could not allocate RX ring, error %d\n",
+		    error);
+		goto fail;
+	}
+
+	/*
+	 * The rest - firmware load, NVM, INIT calibration - needs
+	 * interrupts and takes a while; do it from our taskqueue once
+	 * interrupts are up, so neither boot nor any other device waits
+	 * for it.
+	 */
+	sc->sc_attach_state = IWA_ATTACH_PENDING;
+	sc->sc_preinit_hook.ich_func = iwa_preinit_hook;
+	sc->sc_preinit_hook.ich_arg = sc;
+	if (config_intrhook_establish(&sc->sc_preinit_hook) != 0) {
+		device_printf(sc->sc_dev,
+		    "can't establish config hook\n");
+		sc->sc_preinit_hook.ich_func = NULL;
+		error = ENXIO;
+		goto fail;
+	}
+
 	IWA_DPRINTF(sc, IWA_DEBUG_TRACE, "->%s: end\n",__func__);
 	return 0;
 
@@ -734,8 +1065,42 @@ iwa_detach(struct iwa_softc *sc)
 	}
 #endif
 
+	/* Attach never got as far as interrupts being up */
+	if (sc->sc_preinit_hook.ich_func != NULL) {
+		config_intrhook_disestablish(&sc->sc_preinit_hook);
+		sc->sc_preinit_hook.ich_func = NULL;
+	}
+
+	/* A deferred attach still in progress must finish first */
+	if (sc->sc_tq != NULL)
+		taskqueue_drain(sc->sc_tq, &sc->sc_attach_task);
+
+	iwa_fwlog_detach(sc);
+
+	IWA_LOCK(sc);
+	iwa_tx_watchdog_stop(sc);
+	iwa_rxba_flush(sc);
+	IWA_UNLOCK(sc);
+	callout_drain(&sc->sc_watchdog_to);
+	iwa_rxba_drain(sc);
+
+	if (sc->sc_tq != NULL) {
+		taskqueue_drain_all(sc->sc_tq);
+		taskqueue_free(sc->sc_tq);
+		sc->sc_tq = NULL;
+	}
+
 	IWA_LOCK(sc);
 
+	/* Free any frames still queued */
+	iwa_amsdu_drain(sc);
+	iwa_sched_flush(sc);
+
+	iwa_crash_detach(sc);
+	iwa_journal_detach(sc);
+	iwa_phy_db_free(sc);
+	iwa_nvm_cache_free(sc);
+
 	/* Free DMA resources. */
 	iwa_free_rx_ring(sc, &sc->rxq);
 	for (qid = 0; qid < sc->sc_cfg->base_params->num_of_queues; qid++)
@@ -765,6 +1130,12 @@ iwa_shutdown(struct iwa_softc *sc)
 	return 0;
 }
 
+/*
+ * Suspend: stop the device but keep everything else - the DMA rings,
+ * ICT table, keep-warm page and firmware DMA buffer stay allocated, and
+ * the parsed firmware, calibration results, NVM and configuration
+ * journal are all kept for resume.
+ */
 int
 iwa_suspend(struct iwa_softc *sc)
 {
@@ -774,18 +1145,91 @@ iwa_suspend(struct iwa_softc *sc)
 
 	ieee80211_suspend_all(ic);
 #endif
-	return 0;
+
+	/* Let a deferred attach or a restart finish before we stop */
+	if (sc->sc_tq != NULL) {
+		taskqueue_drain(sc->sc_tq, &sc->sc_attach_task);
+		taskqueue_drain(sc->sc_tq, &sc->sc_restart_task);
+	}
+
+	IWA_LOCK(sc);
+	if (sc->sc_attach_state != IWA_ATTACH_DONE || sc->sc_inactive) {
+		IWA_UNLOCK(sc);
+		return (0);
+	}
+	iwa_stop_locked(sc, 1);
+	sc->sc_inactive = 1;
+	sc->sc_suspended = 1;
+	IWA_UNLOCK(sc);
+	return (0);
 }
 
+/*
+ * Resume: everything the slow path would rebuild is still here, so
+ * bring the firmware straight back.  If it was configured at suspend
+ * (and automatic restart is enabled) the REGULAR ucode is loaded
+ * (polled) and the journal replayed into it; otherwise the device was
+ * idle and stays that way until it's next brought up.  Failing that,
+ * fall back to a full reinit, which still gets to use the cached NVM
+ * and calibration.
+ */
 int
 iwa_resume(struct iwa_softc *sc)
 {
 #if 0
 	struct iwa_softc *sc = device_get_softc(dev);
 	struct ieee80211com *ic = sc->sc_ifp->if_l2com;
+#endif
+	sbintime_t t0;
+	bool restored;
+	int error;
+
+	IWA_LOCK(sc);
+	if (! sc->sc_suspended) {
+		IWA_UNLOCK(sc);
+		return (0);
+	}
+	sc->sc_suspended = 0;
+	t0 = sbinuptime();
+
+	sc->sc_inactive = 0;
+	IWA_REG_WRITE(sc, CSR_INT, 0xffffffff);
+
+	error = 0;
+	restored = false;
+	if (iwa_journal_can_resume(sc)) {
+		sc->sc_resuming = 1;
+		error = iwa_journal_resume(sc);
+		sc->sc_resuming = 0;
+		if (error == 0)
+			restored = true;
+		else {
+			device_printf(sc->sc_dev,
+			    "%s: fast resume failed: %d\n", __func__, error);
+			iwa_stop_locked(sc, 0);
+		}
+	}
+	if (! restored && sc->sc_journal != NULL &&
+	    sc->sc_journal->jn_count != 0) {
+		/* Whatever was configured is gone now */
+		iwa_journal_reset(sc);
+		error = iwa_preinit(sc);
+	}
+	if (error != 0) {
+		device_printf(sc->sc_dev, "%s: resume failed: %d\n",
+		    __func__, error);
+		sc->sc_inactive = 1;
+		IWA_UNLOCK(sc);
+		return (0);
+	}
 
+	iwa_tx_watchdog_start(sc);
+	sc->sc_resume_usec = (sbinuptime() - t0) / SBT_1US;
+	IWA_UNLOCK(sc);
+
+#if 0
 	ieee80211_resume_all(ic);
 #endif
-	return 0;
+	return (0);
 }
 
@@ -0,0 +1,312 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+#include <dev/iwa/if_iwa_crash.h>
+#include <dev/iwa/if_iwa_fwlog.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+
+static MALLOC_DEFINE(M_IWA_CRASH, "iwa_crash", "iwa firmware crash dump");
+
+/*
+ * Read a block of SRAM through the auto-incrementing RDAT window.
+ *
+ * The caller must hold NIC access.
+ */
+static void
+iwa_crash_read(struct iwa_softc *sc, uint32_t addr, uint32_t *buf,
+    int dwords)
+{
+	int i;
+
+	IWA_REG_WRITE(sc, HBUS_TARG_MEM_RADDR, addr);
+	for (i = 0; i < dwords; i++)
+		buf[i] = IWA_REG_READ(sc, HBUS_TARG_MEM_RDAT);
+}
+
+/*
+ * Capture the firmware error table, the event log tail and the ring
+ * state.  Called from the interrupt handler on a firmware assert,
+ * before the device is stopped.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_crash_capture(struct iwa_softc *sc)
+{
+	struct iwa_crash_dump *cd = sc->sc_crash;
+	uint32_t *hdr, base, capacity, mode, wraps, next, start, first, n;
+	uint32_t esize;
+	sbintime_t t0;
+	int qid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (cd == NULL)
+		return;
+
+	t0 = sbinuptime();
+
+	n = cd->cd_count;
+	memset(cd, 0, sizeof(*cd));
+	cd->cd_version = IWA_CRASH_VERSION;
+	cd->cd_count = n + 1;
+	cd->cd_ticks = ticks;
+	cd->cd_error_addr = sc->sc_uc.uc_error_event_table;
+	cd->cd_log_addr = sc->sc_uc.uc_log_event_table;
+
+	/* Driver state first; it doesn't need the NIC */
+	cd->cd_rxq_cur = sc->rxq.cur;
+	cd->cd_rxq_hw = le16toh(sc->rxq.stat->closed_rb_num) & 0xfff;
+	for (qid = 0; qid < IWA_MVM_MAX_QUEUES; qid++) {
+		cd->cd_txq[qid].cur = sc->txq[qid].cur;
+		cd->cd_txq[qid].queued = sc->txq[qid].queued;
+	}
+
+	if (! iwa_grab_nic_access(sc)) {
+		device_printf(sc->sc_dev,
+		    "%s: couldn't get NIC access\n", __func__);
+		goto done;
+	}
+
+	if (cd->cd_error_addr != 0)
+		iwa_crash_read(sc, cd->cd_error_addr,
+		    (uint32_t *) &cd->cd_error,
+		    sizeof(cd->cd_error) / sizeof(uint32_t));
+
+	if (cd->cd_log_addr != 0) {
+		hdr = cd->cd_log_hdr;
+		iwa_crash_read(sc, cd->cd_log_addr, hdr,
+		    nitems(cd->cd_log_hdr));
+		capacity = hdr[0];
+		mode = hdr[1];
+		wraps = hdr[2];
+		next = hdr[3];
+		esize = IWA_FWLOG_EV_SRAM_DWORDS(mode);
+		if (capacity != 0 && next < capacity) {
+			/* The newest entries, oldest first */
+			n = MIN(wraps ? capacity : next, IWA_CRASH_EVENTS);
+			start = (next + capacity - n) % capacity;
+			first = MIN(n, capacity - start);
+			base = cd->cd_log_addr + sizeof(cd->cd_log_hdr);
+			iwa_crash_read(sc, base + start * esize *
+			    sizeof(uint32_t), cd->cd_events, first * esize);
+			if (first < n)
+				iwa_crash_read(sc, base,
+				    cd->cd_events + first * esize,
+				    (n - first) * esize);
+			/* Always id, time, data; see if_iwa_fwlog.h */
+			iwa_fwlog_ev_widen(cd->cd_events, n, mode);
+			cd->cd_nevents = n;
+		}
+	}
+
+	iwa_release_nic_access(sc);
+
+done:
+	cd->cd_usec = (sbinuptime() - t0) / SBT_1US;
+
+	device_printf(sc->sc_dev,
+	    "firmware error 0x%08x at pc 0x%08x; "
+	    "captured %u events in %u usec\n",
+	    cd->cd_error.error_id, cd->cd_error.pc, cd->cd_nevents,
+	    cd->cd_usec);
+}
+
+void
+iwa_crash_attach(struct iwa_softc *sc)
+{
+
+	sc->sc_crash = malloc(sizeof(*sc->sc_crash), M_IWA_CRASH,
+	    M_WAITOK | M_ZERO);
+}
+
+void
+iwa_crash_detach(struct iwa_softc *sc)
+{
+
+	if (sc->sc_crash != NULL) {
+		free(sc->sc_crash, M_IWA_CRASH);
+		sc->sc_crash = NULL;
+	}
+}
+
+static int
+iwa_crash_sysctl_dump(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct iwa_crash_dump *cd;
+	int error;
+
+	cd = malloc(sizeof(*cd), M_TEMP, M_WAITOK);
+	IWA_LOCK(sc);
+	memcpy(cd, sc->sc_crash, sizeof(*cd));
+	IWA_UNLOCK(sc);
+
+	/* Nothing to fetch until there's been a crash */
+	if (cd->cd_count == 0)
+		error = SYSCTL_OUT(req, NULL, 0);
+	else
+		error = SYSCTL_OUT(req, cd, sizeof(*cd));
+	free(cd, M_TEMP);
+	return (error);
+}
+
+static int
+iwa_crash_sysctl_summary(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct iwa_crash_dump *cd;
+	struct iwa_error_event_table *et;
+	struct sbuf sb;
+	int error, i;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+
+	cd = malloc(sizeof(*cd), M_TEMP, M_WAITOK);
+	IWA_LOCK(sc);
+	memcpy(cd, sc->sc_crash, sizeof(*cd));
+	IWA_UNLOCK(sc);
+	et = &cd->cd_error;
+
+	sbuf_new_for_sysctl(&sb, NULL, 512, req);
+	if (cd->cd_count == 0) {
+		sbuf_printf(&sb, "no firmware crash captured");
+		goto out;
+	}
+	sbuf_printf(&sb, "\ncrash %u at ticks %u, captured in %u usec",
+	    cd->cd_count, cd->cd_ticks, cd->cd_usec);
+	sbuf_printf(&sb, "\nerror_id 0x%08x pc 0x%08x", et->error_id, et->pc);
+	sbuf_printf(&sb, "\nblink 0x%08x 0x%08x ilink 0x%08x 0x%08x",
+	    et->blink1, et->blink2, et->ilink1, et->ilink2);
+	sbuf_printf(&sb, "\ndata 0x%08x 0x%08x 0x%08x",
+	    et->data1, et->data2, et->data3);
+	sbuf_printf(&sb, "\nucode_ver 0x%08x hw_ver 0x%08x hcmd 0x%08x",
+	    et->ucode_ver, et->hw_ver, et->hcmd);
+	sbuf_printf(&sb, "\nrx ring: cur %u hw %u", cd->cd_rxq_cur,
+	    cd->cd_rxq_hw);
+	for (i = 0; i < IWA_MVM_MAX_QUEUES; i++) {
+		if (cd->cd_txq[i].queued == 0)
+			continue;
+		sbuf_printf(&sb, "\ntx ring %2d: cur %3u queued %3u", i,
+		    cd->cd_txq[i].cur, cd->cd_txq[i].queued);
+	}
+	for (i = 0; i < cd->cd_nevents; i++)
+		sbuf_printf(&sb, "\nevent 0x%08x time %10u data 0x%08x",
+		    cd->cd_events[i * 3], cd->cd_events[i * 3 + 1],
+		    cd->cd_events[i * 3 + 2]);
+out:
+	free(cd, M_TEMP);
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+void
+iwa_crash_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "crash", CTLFLAG_RD,
+	    NULL, "firmware crash capture");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "dump",
+	    CTLTYPE_OPAQUE | CTLFLAG_RD, sc, 0, iwa_crash_sysctl_dump,
+	    "S,iwa_crash_dump", "last firmware crash dump");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "summary",
+	    CTLTYPE_STRING | CTLFLAG_RD, sc, 0, iwa_crash_sysctl_summary,
+	    "A", "last firmware crash dump, decoded");
+}
@@ -0,0 +1,96 @@
+#ifndef	__IF_IWA_CRASH_H__
+#define	__IF_IWA_CRASH_H__
+
+/*
+ * Firmware crash capture.
+ *
+ * On a firmware assert (CSR_INT_BIT_SW_ERR) the firmware error table,
+ * the tail of the event log and the driver's ring state are captured
+ * into a buffer allocated at attach time, before the device is
+ * stopped.  All the SRAM reads are done inside one NIC access grab
+ * using the auto-incrementing HBUS_TARG_MEM_RDAT window, so the whole
+ * capture is a few hundred register reads.
+ *
+ * The last capture can be fetched via dev.iwa.N.crash.dump (a struct
+ * iwa_crash_dump) or read as text via dev.iwa.N.crash.summary.
+ */
+
+/*
+ * Firmware error table, as written by the firmware on an assert.
+ *
+ * iwlwifi: mvm/utils.c (struct iwl_error_event_table)
+ */
+struct iwa_error_event_table {
+	uint32_t valid;		/* (nonzero) valid, (0) log is empty */
+	uint32_t error_id;	/* type of error */
+	uint32_t pc;		/* program counter */
+	uint32_t blink1;	/* branch link */
+	uint32_t blink2;	/* branch link */
+	uint32_t ilink1;	/* interrupt link */
+	uint32_t ilink2;	/* interrupt link */
+	uint32_t data1;		/* error-specific data */
+	uint32_t data2;		/* error-specific data */
+	uint32_t data3;		/* error-specific data */
+	uint32_t bcon_time;	/* beacon timer */
+	uint32_t tsf_low;	/* network timestamp function timer */
+	uint32_t tsf_hi;	/* network timestamp function timer */
+	uint32_t gp1;		/* GP1 timer register */
+	uint32_t gp2;		/* GP2 timer register */
+	uint32_t gp3;		/* GP3 timer register */
+	uint32_t ucode_ver;	/* uCode version */
+	uint32_t hw_ver;	/* HW Silicon version */
+	uint32_t brd_ver;	/* HW board version */
+	uint32_t log_pc;	/* log program counter */
+	uint32_t frame_ptr;	/* frame pointer */
+	uint32_t stack_ptr;	/* stack pointer */
+	uint32_t hcmd;		/* last host command header */
+	uint32_t isr0;		/* isr status register LMPM_NIC_ISR0 */
+	uint32_t isr1;		/* isr status register LMPM_NIC_ISR1 */
+	uint32_t isr2;		/* isr status register LMPM_NIC_ISR2 */
+	uint32_t isr3;		/* isr status register LMPM_NIC_ISR3 */
+	uint32_t isr4;		/* isr status register LMPM_NIC_ISR4 */
+	uint32_t isr_pref;	/* isr status register LMPM_NIC_PREF_STAT */
+	uint32_t wait_event;	/* wait event() caller address */
+	uint32_t l2p_control;	/* L2pControlField */
+	uint32_t l2p_duration;	/* L2pDurationField */
+	uint32_t l2p_mhvalid;	/* L2pMhValidBits */
+	uint32_t l2p_addr_match; /* L2pAddrMatchStat */
+	uint32_t lmpm_pmg_sel;	/* which clocks are turned on */
+	uint32_t u_timestamp;	/* date and time of the compilation */
+	uint32_t flow_handler;	/* FH read/write pointers, RX credit */
+} __packed;
+
+/* Event log entries captured from the tail of the log */
+#define	IWA_CRASH_EVENTS	64
+
+#define	IWA_CRASH_VERSION	1
+
+struct iwa_crash_dump {
+	uint32_t	cd_version;		/* IWA_CRASH_VERSION */
+	uint32_t	cd_count;		/* captures since attach */
+	uint32_t	cd_ticks;		/* when captured */
+	uint32_t	cd_usec;		/* how long the capture took */
+	uint32_t	cd_error_addr;		/* uc_error_event_table */
+	uint32_t	cd_log_addr;		/* uc_log_event_table */
+	struct iwa_error_event_table cd_error;
+	uint32_t	cd_log_hdr[4];		/* capacity, mode, wraps, next */
+	uint32_t	cd_nevents;		/* entries in cd_events */
+	uint32_t	cd_events[IWA_CRASH_EVENTS * 3];
+	/* Driver ring state */
+	uint32_t	cd_rxq_cur;
+	uint32_t	cd_rxq_hw;		/* closed_rb_num */
+	struct {
+		uint16_t	cur;
+		uint16_t	queued;
+	} cd_txq[IWA_MVM_MAX_QUEUES];
+};
+
+struct iwa_softc;
+
+extern	void iwa_crash_attach(struct iwa_softc *sc);
+extern	void iwa_crash_detach(struct iwa_softc *sc);
+extern	void iwa_crash_capture(struct iwa_softc *sc);
+extern	void iwa_crash_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
+
+#endif	/* __IF_IWA_CRASH_H__ */
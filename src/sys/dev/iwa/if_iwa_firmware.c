@@ -74,6 +74,9 @@ __FBSDID("$FreeBSD$");
 #include <dev/iwa/iwl/iwl-fw.h>
 #include <dev/iwa/iwl/iwl-csr.h>
 #include <dev/iwa/iwl/iwl-config.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
 
 #include <dev/iwa/if_iwa_debug.h>
 
@@ -81,8 +84,18 @@ __FBSDID("$FreeBSD$");
 #include <dev/iwa/if_iwa_trans.h>
 #include <dev/iwa/if_iwa_nvm.h>
 #include <dev/iwa/if_iwareg.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
 #include <dev/iwa/if_iwavar.h>
 
+#include <dev/iwa/if_iwa_fw_util.h>
+#include <dev/iwa/if_iwa_notif.h>
+#include <dev/iwa/if_iwa_rx.h>
+
 /*
  * XXX TODO: pull out the firmware bits completely from the
  * softc so this file doesn't require if_athvar.h to load in.
@@ -505,6 +518,54 @@ out:
 }
 
 
+/*
+ * Polled firmware load: used when interrupts can't be relied on, or
+ * when asked to.  Chunk completion is read straight out of the FH
+ * interrupt status and ALIVE straight off the RX ring, so a load takes
+ * about as long as the DMA does.
+ */
+#define	IWA_FW_POLL_CHUNK_USEC	100000	/* per chunk */
+#define	IWA_FW_POLL_ALIVE_USEC	1000000
+#define	IWA_FW_POLL_STEP_USEC	100
+
+static bool
+iwa_fw_polled(struct iwa_softc *sc)
+{
+
+	return (cold || sc->sc_fw_poll != 0 || sc->sc_resuming != 0);
+}
+
+/*
+ * Drain the RX ring by hand until ALIVE turns up.
+ */
+static int
+iwa_poll_alive(struct iwa_softc *sc, struct iwa_notif_wait *wait)
+{
+	struct mbuf *m, *next;
+	sbintime_t start;
+
+	start = sbinuptime();
+	for (;;) {
+		/*
+		 * Nothing is associated until the firmware is up, so any
+		 * frames received now are of no use; don't drop the lock
+		 * to hand them up in the middle of this.
+		 */
+		for (m = iwa_notif_intr(sc); m != NULL; m = next) {
+			next = m->m_nextpkt;
+			m_freem(m);
+		}
+		if (wait->nw_triggered || wait->nw_aborted)
+			break;
+		if ((sbinuptime() - start) / SBT_1US >= IWA_FW_POLL_ALIVE_USEC)
+			break;
+		iwa_wait_usec(sc, IWA_FW_POLL_STEP_USEC, IWA_WAIT_SLEEP);
+	}
+
+	/* Just removes the wait; returns ETIMEDOUT if it didn't fire */
+	return (iwa_wait_notif(sc, wait, 0));
+}
+
 /*
  * Firmware loading gunk.  This is kind of a weird hybrid between the
  * old iwn driver and the Linux iwlwifi driver.
@@ -513,10 +574,11 @@ out:
  */
 static int
 iwa_firmware_load_chunk(struct iwa_softc *sc, uint32_t dst_addr,
-	const uint8_t *section, uint32_t byte_cnt)
+	const uint8_t *section, uint32_t byte_cnt, bool polled)
 {
+	static const uint16_t chunk_done[] = { IWA_NOTIF_FW_CHUNK };
 	struct iwa_dma_info *dma = &sc->fw_dma;
-	int error;
+	struct iwa_notif_wait wait;
 
 	IWA_LOCK_ASSERT(sc);
 
@@ -527,7 +589,11 @@ iwa_firmware_load_chunk(struct iwa_softc *sc, uint32_t dst_addr,
 	if (!iwa_grab_nic_access(sc))
 		return EBUSY;
 
-	sc->sc_fw_chunk_done = false;
+	if (polled)
+		IWA_REG_WRITE(sc, CSR_FH_INT_STATUS, CSR_FH_INT_TX_MASK);
+	else
+		iwa_init_notif_wait(sc, &wait, chunk_done, nitems(chunk_done),
+		    NULL, NULL);
 
 	IWA_REG_WRITE(sc, FH_TCSR_CHNL_TX_CONFIG_REG(FH_SRVC_CHNL),
 	    FH_TCSR_TX_CONFIG_REG_VAL_DMA_CHNL_PAUSE);
@@ -548,24 +614,51 @@ iwa_firmware_load_chunk(struct iwa_softc *sc, uint32_t dst_addr,
 
 	iwa_release_nic_access(sc);
 
+	if (polled) {
+		/* Watch the service channel finish, then ack it */
+		if (!iwa_wait_bit(sc, IWA_WAIT_FW_CHUNK, CSR_FH_INT_STATUS,
+		    CSR_FH_INT_TX_MASK, CSR_FH_INT_TX_MASK,
+		    IWA_FW_POLL_CHUNK_USEC, IWA_WAIT_SLEEP | IWA_WAIT_ANY))
+			return (ETIMEDOUT);
+		IWA_REG_WRITE(sc, CSR_FH_INT_STATUS, CSR_FH_INT_TX_MASK);
+		IWA_REG_WRITE(sc, CSR_INT, CSR_INT_BIT_FH_TX);
+		return (0);
+	}
+
 	/* wait 1s for this segment to load */
-	while (!sc->sc_fw_chunk_done)
-		if ((error = msleep(&sc->sc_fw, &sc->sc_mtx, 0, "iwmfw", hz)) != 0)
-			break;
+	return (iwa_wait_notif(sc, &wait, hz));
+}
 
-        return error;
+/*
+ * Pick the interesting bits out of the ALIVE notification.
+ *
+ * iwlwifi: mvm/fw.c (iwl_alive_fn)
+ */
+static bool
+iwa_alive_fn(struct iwa_softc *sc, struct iwl_rx_packet *pkt, void *arg)
+{
+	struct mvm_alive_resp *resp = (void *)(pkt + 1);
+
+	sc->sc_uc.uc_error_event_table = le32toh(resp->error_event_table_ptr);
+	sc->sc_uc.uc_log_event_table = le32toh(resp->log_event_table_ptr);
+	sc->sched_base = le32toh(resp->scd_base_ptr);
+	sc->sc_uc.uc_ok = resp->status == IWL_ALIVE_STATUS_OK;
+	return (true);
 }
 
 static int
-iwa_load_firmware(struct iwa_softc *sc, enum iwl_ucode_type ucode_type)
+iwa_load_firmware(struct iwa_softc *sc, enum iwl_ucode_type ucode_type,
+    bool polled)
 {
+	static const uint16_t alive[] = { MVM_ALIVE };
+	struct iwa_notif_wait alive_wait;
 	struct fw_sects *fws;
-	int error, i, w;
+	int error, i;
 	void *data;
 	uint32_t dlen;
 	uint32_t offset;
 
-	sc->sc_uc.uc_intr = false;
+	sc->sc_uc.uc_ok = false;
 
 	fws = &sc->sc_fw.fw_sects[ucode_type];
 	for (i = 0; i < fws->fw_count; i++) {
@@ -576,7 +669,8 @@ iwa_load_firmware(struct iwa_softc *sc, enum iwl_ucode_type ucode_type)
 		    IWA_DEBUG_FIRMWARE,
 		    "LOAD FIRMWARE type %d offset %u len %d\n",
 		    ucode_type, offset, dlen);
-		error = iwa_firmware_load_chunk(sc, offset, data, dlen);
+		error = iwa_firmware_load_chunk(sc, offset, data, dlen,
+		    polled);
 		if (error) {
 			device_printf(sc->sc_dev,
 			    "iwa_firmware_load_chunk() returned error %02x\n",
@@ -585,20 +679,35 @@ iwa_load_firmware(struct iwa_softc *sc, enum iwl_ucode_type ucode_type)
 		}
 	}
 
+	/* Register for ALIVE before letting the firmware run */
+	iwa_init_notif_wait(sc, &alive_wait, alive, nitems(alive),
+	    iwa_alive_fn, NULL);
+
 	/* wait for the firmware to load */
 	IWA_REG_WRITE(sc, CSR_RESET, 0);
 
-	for (w = 0; !sc->sc_uc.uc_intr && w < 10; w++) {
-		error = msleep(&sc->sc_uc, &sc->sc_mtx, 0, "iwmuc", hz/10);
+	if (polled)
+		error = iwa_poll_alive(sc, &alive_wait);
+	else
+		error = iwa_wait_notif(sc, &alive_wait, hz);
+	if (error != 0) {
+		device_printf(sc->sc_dev, "no ALIVE from firmware: %d\n",
+		    error);
+		return error;
+	}
+	if (!sc->sc_uc.uc_ok) {
+		device_printf(sc->sc_dev, "firmware reported bad ALIVE\n");
+		return EIO;
 	}
 
-	return error;
+	return 0;
 }
 
 /* iwlwifi: pcie/trans.c */
 static int
 iwa_start_fw(struct iwa_softc *sc, enum iwl_ucode_type ucode_type)
 {
+	bool polled;
 	int error;
 
 	IWA_REG_WRITE(sc, CSR_INT, ~0);
@@ -612,9 +721,14 @@ iwa_start_fw(struct iwa_softc *sc, enum iwl_ucode_type ucode_type)
 	IWA_REG_WRITE(sc, CSR_UCODE_DRV_GP1_CLR, CSR_UCODE_SW_BIT_RFKILL);
 	IWA_REG_WRITE(sc, CSR_UCODE_DRV_GP1_CLR, CSR_UCODE_DRV_GP1_BIT_CMD_BLOCKED);
 
-	/* clear (again), then enable host interrupts */
+	/*
+	 * clear (again), then enable host interrupts; a polled load
+	 * leaves them off until the firmware is up.
+	 */
+	polled = iwa_fw_polled(sc);
 	IWA_REG_WRITE(sc, CSR_INT, ~0);
-	iwa_enable_interrupts(sc);
+	if (!polled)
+		iwa_enable_interrupts(sc);
 
 	/* really make sure rfkill handshake bits are cleared */
 	/* maybe we should write a few times more?  just to make sure */
@@ -622,33 +736,45 @@ iwa_start_fw(struct iwa_softc *sc, enum iwl_ucode_type ucode_type)
 	IWA_REG_WRITE(sc, CSR_UCODE_DRV_GP1_CLR, CSR_UCODE_SW_BIT_RFKILL);
 
 	/* Load the given image to the HW */
-	return iwa_load_firmware(sc, ucode_type);
+	if ((error = iwa_load_firmware(sc, ucode_type, polled)) != 0)
+		return (error);
+
+	if (polled) {
+		IWA_REG_WRITE(sc, CSR_INT, ~0);
+		iwa_enable_interrupts(sc);
+	}
+	return (0);
 }
 
 static int
 iwa_fw_alive(struct iwa_softc *sc, uint32_t sched_base)
 {
+	int error;
 
-	return iwa_post_alive(sc);
+	if ((error = iwa_post_alive(sc)) != 0)
+		return error;
+
+	/* Queue assignments don't survive a firmware load */
+	iwa_txq_init(sc);
+	return 0;
 }
 
-#if 0
-static int
+int
 iwa_send_tx_ant_cfg(struct iwa_softc *sc, uint8_t valid_tx_ant)
 {
-	struct iwa_tx_ant_cfg_cmd tx_ant_cmd = {
+	struct iwl_tx_ant_cfg_cmd tx_ant_cmd = {
 		.valid = htole32(valid_tx_ant),
 	};
 
-	return iwa_mvm_send_cmd_pdu(sc, TX_ANT_CONFIGURATION_CMD, CMD_SYNC,
+	return iwa_mvm_send_cmd_pdu(sc, TX_ANT_CONFIGURATION_CMD, 0,
 	    sizeof(tx_ant_cmd), &tx_ant_cmd);
 }
 
 /* iwlwifi: mvm/fw.c */
-static int
+int
 iwa_send_phy_cfg_cmd(struct iwa_softc *sc)
 {
-	struct iwa_phy_cfg_cmd phy_cfg_cmd;
+	struct iwl_phy_cfg_cmd phy_cfg_cmd;
 	enum iwl_ucode_type ucode_type = sc->sc_uc_current;
 
 	/* Set parameters */
@@ -658,11 +784,11 @@ iwa_send_phy_cfg_cmd(struct iwa_softc *sc)
 	phy_cfg_cmd.calib_control.flow_trigger =
 	    sc->sc_default_calib[ucode_type].flow_trigger;
 
-	DPRINTFN(10, ("Sending Phy CFG command: 0x%x\n", phy_cfg_cmd.phy_cfg));
-	return iwa_mvm_send_cmd_pdu(sc, PHY_CONFIGURATION_CMD, CMD_SYNC,
+	IWA_DPRINTF(sc, IWA_DEBUG_CMD, "Sending Phy CFG command: 0x%x\n",
+	    phy_cfg_cmd.phy_cfg);
+	return iwa_mvm_send_cmd_pdu(sc, PHY_CONFIGURATION_CMD, 0,
 	    sizeof(phy_cfg_cmd), &phy_cfg_cmd);
 }
-#endif
 
 /*
  * Called to load in the firmware and bring the NIC up.
@@ -16,13 +16,17 @@
 #define FW_STATUS_INPROGRESS    1
 #define FW_STATUS_DONE          2
 
+#define IWM_FW_VALID_TX_ANT(sc) \
+    ((sc->sc_fw_phy_config & FW_PHY_CFG_TX_CHAIN) >> FW_PHY_CFG_TX_CHAIN_POS)
+#define IWM_FW_VALID_RX_ANT(sc) \
+    ((sc->sc_fw_phy_config & FW_PHY_CFG_RX_CHAIN) >> FW_PHY_CFG_RX_CHAIN_POS)
+
 struct iwa_softc;
 
 struct iwa_ucode_status {
 	uint32_t uc_error_event_table;
 	uint32_t uc_log_event_table;
 	bool uc_ok;
-	bool uc_intr;
 };
 
 struct iwa_fw_info {
@@ -47,5 +51,7 @@ struct iwa_fw_info {
 extern	int iwa_find_firmware(struct iwa_softc *sc);
 extern	int iwa_mvm_load_ucode_wait_alive(struct iwa_softc *sc,
 	    enum iwl_ucode_type ucode_type);
+extern	int iwa_send_tx_ant_cfg(struct iwa_softc *sc, uint8_t valid_tx_ant);
+extern	int iwa_send_phy_cfg_cmd(struct iwa_softc *sc);
 
 #endif	/* __IF_IWA_FIRMWARE_H__ */
@@ -80,8 +80,15 @@ __FBSDID("$FreeBSD$");
 #include <dev/iwa/if_iwa_firmware.h>
 #include <dev/iwa/if_iwa_trans.h>
 #include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
 #include <dev/iwa/if_iwavar.h>
 #include <dev/iwa/if_iwareg.h>
+#include <dev/iwa/if_iwa_journal.h>
 
 #include <dev/iwa/if_iwa_fw_util.h>
 
@@ -184,9 +191,9 @@ iwa_send_cmd(struct iwa_softc *sc, struct iwl_host_cmd *hcmd)
 		m->m_pkthdr.len = m->m_len = m->m_ext.ext_size;
 
 		cmd = mtod(m, struct iwl_device_cmd *);
-		/* XXX TODO hcmd->len[0] is wrong? It's not the full length */
 		error = bus_dmamap_load(sc->sc_dmat, data->map, cmd,
-		    hcmd->len[0], iwa_dma_map_addr, &paddr, BUS_DMA_NOWAIT);
+		    sizeof(cmd->hdr) + paylen, iwa_dma_map_addr, &paddr,
+		    BUS_DMA_NOWAIT);
 		if (error != 0) {
 			m_freem(m);
 			goto out;
@@ -236,7 +243,7 @@ iwa_send_cmd(struct iwa_softc *sc, struct iwl_host_cmd *hcmd)
 	}
 	printf("\n");
 
-	if (hcmd->len[0] > sizeof(cmd->payload)) {
+	if (paylen > sizeof(cmd->payload)) {
 		bus_dmamap_sync(sc->sc_dmat, data->map, BUS_DMASYNC_PREWRITE);
 	} else {
 		bus_dmamap_sync(sc->sc_dmat, ring->cmd_dma.map, BUS_DMASYNC_PREWRITE);
@@ -276,6 +283,9 @@ iwa_send_cmd(struct iwa_softc *sc, struct iwl_host_cmd *hcmd)
 	ring->cur = (ring->cur + 1) % IWA_TX_RING_COUNT;
 	IWA_REG_WRITE(sc, HBUS_TARG_WRPTR, ring->qid << 8 | ring->cur);
 
+	/* It's with the firmware now; remember it for a restart */
+	iwa_journal_record(sc, hcmd);
+
 	/*
 	 * sync: wait for wakeup from RX completion path
 	 *
@@ -0,0 +1,582 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+#include <sys/conf.h>
+#include <sys/uio.h>
+#include <sys/fcntl.h>
+#include <sys/poll.h>
+#include <sys/selinfo.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+#include <dev/iwa/if_iwa_fwlog.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+
+struct iwa_fwlog {
+	struct iwa_softc	*fl_sc;
+	struct mtx		fl_mtx;		/* protects the ring */
+	struct cdev		*fl_cdev;
+	struct selinfo		fl_rsel;
+	bool			fl_open;
+	bool			fl_gone;
+
+	/* Ring buffer; fl_head is always at the start of a record */
+	uint8_t			*fl_buf;
+	int			fl_head;	/* read offset */
+	int			fl_len;		/* bytes in the ring */
+	uint32_t		fl_drops;	/* records dropped on overflow */
+
+	/* Our sysctl nodes go away before we do */
+	struct sysctl_ctx_list	fl_sysctl_ctx;
+
+	/* Event log poller; protected by the IWA lock */
+	struct callout		fl_poll;
+	int			fl_poll_msec;
+	bool			fl_ev_valid;
+	uint32_t		fl_ev_mode;
+	uint32_t		fl_ev_wraps;
+	uint32_t		fl_ev_next;
+	uint32_t		fl_ev_lost;
+	uint32_t		fl_ev_buf[IWA_FWLOG_MAX_EVENTS * IWA_FWLOG_EV_DWORDS];
+};
+
+static MALLOC_DEFINE(M_IWA_FWLOG, "iwa_fwlog", "iwa firmware log");
+
+static d_open_t		iwa_fwlog_open;
+static d_close_t	iwa_fwlog_close;
+static d_read_t		iwa_fwlog_read;
+static d_poll_t		iwa_fwlog_poll;
+
+static struct cdevsw iwa_fwlog_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_flags =	0,
+	.d_open =	iwa_fwlog_open,
+	.d_close =	iwa_fwlog_close,
+	.d_read =	iwa_fwlog_read,
+	.d_poll =	iwa_fwlog_poll,
+	.d_name =	"iwa_fwlog",
+};
+
+static void iwa_fwlog_poll_events(void *arg);
+
+static int
+iwa_fwlog_poll_ticks(struct iwa_fwlog *fl)
+{
+
+	return (MAX(1, ((int64_t) fl->fl_poll_msec * hz) / 1000));
+}
+
+/*
+ * Copy in/out of the ring, handling the wrap.
+ */
+static void
+iwa_fwlog_ring_put(struct iwa_fwlog *fl, int off, const void *src, int len)
+{
+	int n;
+
+	off %= IWA_FWLOG_BUFSIZE;
+	n = MIN(len, IWA_FWLOG_BUFSIZE - off);
+	memcpy(fl->fl_buf + off, src, n);
+	if (n < len)
+		memcpy(fl->fl_buf, (const uint8_t *) src + n, len - n);
+}
+
+static void
+iwa_fwlog_ring_get(struct iwa_fwlog *fl, int off, void *dst, int len)
+{
+	int n;
+
+	off %= IWA_FWLOG_BUFSIZE;
+	n = MIN(len, IWA_FWLOG_BUFSIZE - off);
+	memcpy(dst, fl->fl_buf + off, n);
+	if (n < len)
+		memcpy((uint8_t *) dst + n, fl->fl_buf, len - n);
+}
+
+/*
+ * Append a record, dropping the oldest records to make room.
+ */
+static void
+iwa_fwlog_append(struct iwa_fwlog *fl, int type, const void *data, int len)
+{
+	struct iwa_fwlog_hdr hdr;
+	int need;
+
+	need = sizeof(hdr) + len;
+	if (need > IWA_FWLOG_MAX_RECORD)
+		return;
+
+	mtx_lock(&fl->fl_mtx);
+	while (IWA_FWLOG_BUFSIZE - fl->fl_len < need) {
+		KASSERT(fl->fl_len > 0, ("%s: ring empty", __func__));
+		iwa_fwlog_ring_get(fl, fl->fl_head, &hdr, sizeof(hdr));
+		fl->fl_head = (fl->fl_head + sizeof(hdr) + hdr.fh_len) %
+		    IWA_FWLOG_BUFSIZE;
+		fl->fl_len -= sizeof(hdr) + hdr.fh_len;
+		fl->fl_drops++;
+	}
+
+	hdr.fh_type = type;
+	hdr.fh_len = len;
+	hdr.fh_ticks = ticks;
+	iwa_fwlog_ring_put(fl, fl->fl_head + fl->fl_len, &hdr, sizeof(hdr));
+	iwa_fwlog_ring_put(fl, fl->fl_head + fl->fl_len + sizeof(hdr),
+	    data, len);
+	fl->fl_len += need;
+
+	wakeup(fl);
+	selwakeup(&fl->fl_rsel);
+	mtx_unlock(&fl->fl_mtx);
+}
+
+/*
+ * Record a DEBUG_LOG_MSG notification.
+ */
+void
+iwa_fwlog_debug_msg(struct iwa_softc *sc, struct iwl_rx_packet *pkt)
+{
+	struct iwa_fwlog *fl = sc->sc_fwlog;
+
+	if (fl == NULL)
+		return;
+	iwa_fwlog_append(fl, IWA_FWLOG_TYPE_DEBUG, pkt + 1,
+	    iwl_rx_packet_payload_len(pkt));
+}
+
+/*
+ * Widen n event log entries as read from SRAM in the given mode into
+ * IWA_FWLOG_EV_DWORDS each, in place; buf must have room for that.
+ */
+void
+iwa_fwlog_ev_widen(uint32_t *buf, int n, uint32_t mode)
+{
+	int i;
+
+	if (IWA_FWLOG_EV_SRAM_DWORDS(mode) == IWA_FWLOG_EV_DWORDS)
+		return;
+
+	/* Back to front, so nothing is overwritten before it's moved */
+	for (i = n - 1; i >= 0; i--) {
+		buf[i * 3 + 2] = buf[i * 2 + 1];
+		buf[i * 3 + 1] = 0;
+		buf[i * 3] = buf[i * 2];
+	}
+}
+
+/*
+ * Read the event log entries written since the last poll.
+ *
+ * All the new entries (up to IWA_FWLOG_MAX_EVENTS) are read in one
+ * go and stored as a single record.
+ */
+static void
+iwa_fwlog_read_events(struct iwa_softc *sc, struct iwa_fwlog *fl)
+{
+	uint32_t hdr[IWA_FWLOG_EV_HDR_DWORDS];
+	uint32_t base, capacity, mode, wraps, next, start, count, lost, n;
+	uint32_t esize;
+
+	IWA_LOCK_ASSERT(sc);
+
+	base = sc->sc_uc.uc_log_event_table;
+	if (! sc->sc_uc.uc_ok || base == 0)
+		return;
+
+	if (iwa_read_mem(sc, base, hdr, IWA_FWLOG_EV_HDR_DWORDS) != 0)
+		return;
+	capacity = le32toh(hdr[0]);
+	mode = le32toh(hdr[1]);
+	wraps = le32toh(hdr[2]);
+	next = le32toh(hdr[3]);
+	if (capacity == 0 || next >= capacity)
+		return;
+	esize = IWA_FWLOG_EV_SRAM_DWORDS(mode);
+
+	/* First look (or the firmware was restarted): start from here */
+	if (! fl->fl_ev_valid || mode != fl->fl_ev_mode ||
+	    wraps < fl->fl_ev_wraps ||
+	    (wraps == fl->fl_ev_wraps && next < fl->fl_ev_next)) {
+		fl->fl_ev_valid = true;
+		fl->fl_ev_mode = mode;
+		fl->fl_ev_wraps = wraps;
+		fl->fl_ev_next = next;
+		return;
+	}
+
+	count = (wraps - fl->fl_ev_wraps) * capacity + next - fl->fl_ev_next;
+	if (count == 0)
+		return;
+
+	lost = 0;
+	start = fl->fl_ev_next;
+	if (count > capacity) {
+		/* Overwritten before we got to it */
+		lost = count - capacity;
+		count = capacity;
+		start = next;
+	}
+	if (count > IWA_FWLOG_MAX_EVENTS) {
+		/* Catch up with the newest entries */
+		lost += count - IWA_FWLOG_MAX_EVENTS;
+		start = (start + count - IWA_FWLOG_MAX_EVENTS) % capacity;
+		count = IWA_FWLOG_MAX_EVENTS;
+	}
+	if (lost != 0) {
+		fl->fl_ev_lost += lost;
+		iwa_fwlog_append(fl, IWA_FWLOG_TYPE_LOST, &lost, sizeof(lost));
+	}
+
+	/* At most two bulk reads: up to the end of the log, then the start */
+	n = MIN(count, capacity - start);
+	base += IWA_FWLOG_EV_HDR_DWORDS * sizeof(uint32_t);
+	if (iwa_read_mem(sc, base + start * esize * sizeof(uint32_t),
+	    fl->fl_ev_buf, n * esize) != 0)
+		return;
+	if (n < count && iwa_read_mem(sc, base,
+	    fl->fl_ev_buf + n * esize, (count - n) * esize) != 0)
+		return;
+	iwa_fwlog_ev_widen(fl->fl_ev_buf, count, mode);
+
+	iwa_fwlog_append(fl, IWA_FWLOG_TYPE_EVENTS, fl->fl_ev_buf,
+	    count * IWA_FWLOG_EV_DWORDS * sizeof(uint32_t));
+
+	fl->fl_ev_wraps = wraps;
+	fl->fl_ev_next = next;
+}
+
+static void
+iwa_fwlog_poll_events(void *arg)
+{
+	struct iwa_fwlog *fl = arg;
+	struct iwa_softc *sc = fl->fl_sc;
+
+	IWA_LOCK_ASSERT(sc);
+
+	iwa_fwlog_read_events(sc, fl);
+	if (fl->fl_open && fl->fl_poll_msec > 0)
+		callout_reset(&fl->fl_poll, iwa_fwlog_poll_ticks(fl),
+		    iwa_fwlog_poll_events, fl);
+}
+
+/*
+ * The device is stopping; the event log position is meaningless
+ * after the firmware is reloaded.
+ */
+void
+iwa_fwlog_stop(struct iwa_softc *sc)
+{
+	struct iwa_fwlog *fl = sc->sc_fwlog;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (fl == NULL)
+		return;
+	fl->fl_ev_valid = false;
+}
+
+static int
+iwa_fwlog_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
+{
+	struct iwa_fwlog *fl = dev->si_drv1;
+	struct iwa_softc *sc = fl->fl_sc;
+
+	IWA_LOCK(sc);
+	if (fl->fl_open) {
+		IWA_UNLOCK(sc);
+		return (EBUSY);
+	}
+	fl->fl_open = true;
+	fl->fl_ev_valid = false;
+	if (fl->fl_poll_msec > 0)
+		callout_reset(&fl->fl_poll, iwa_fwlog_poll_ticks(fl),
+		    iwa_fwlog_poll_events, fl);
+	IWA_UNLOCK(sc);
+
+	return (0);
+}
+
+static int
+iwa_fwlog_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
+{
+	struct iwa_fwlog *fl = dev->si_drv1;
+	struct iwa_softc *sc = fl->fl_sc;
+
+	IWA_LOCK(sc);
+	fl->fl_open = false;
+	callout_stop(&fl->fl_poll);
+	IWA_UNLOCK(sc);
+
+	return (0);
+}
+
+/*
+ * Only whole records are handed out; the writer relies on fl_head
+ * being at a record header when it drops the oldest ones.
+ */
+static int
+iwa_fwlog_read(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	struct iwa_fwlog *fl = dev->si_drv1;
+	struct iwa_fwlog_hdr hdr;
+	uint8_t *tmp;
+	int error = 0, n;
+	bool copied = false;
+
+	tmp = malloc(IWA_FWLOG_MAX_RECORD, M_IWA_FWLOG, M_WAITOK);
+
+	mtx_lock(&fl->fl_mtx);
+	while (fl->fl_len == 0 && ! fl->fl_gone) {
+		if (ioflag & O_NONBLOCK) {
+			error = EWOULDBLOCK;
+			goto out;
+		}
+		error = msleep(fl, &fl->fl_mtx, PCATCH, "iwalog", 0);
+		if (error != 0)
+			goto out;
+	}
+
+	while (fl->fl_len > 0) {
+		iwa_fwlog_ring_get(fl, fl->fl_head, &hdr, sizeof(hdr));
+		n = sizeof(hdr) + hdr.fh_len;
+		if (n > uio->uio_resid) {
+			if (! copied && uio->uio_resid != 0)
+				error = EMSGSIZE;
+			break;
+		}
+		iwa_fwlog_ring_get(fl, fl->fl_head, tmp, n);
+		fl->fl_head = (fl->fl_head + n) % IWA_FWLOG_BUFSIZE;
+		fl->fl_len -= n;
+
+		mtx_unlock(&fl->fl_mtx);
+		error = uiomove(tmp, n, uio);
+		mtx_lock(&fl->fl_mtx);
+		if (error != 0)
+			break;
+		copied = true;
+	}
+out:
+	mtx_unlock(&fl->fl_mtx);
+	free(tmp, M_IWA_FWLOG);
+	return (error);
+}
+
+static int
+iwa_fwlog_poll(struct cdev *dev, int events, struct thread *td)
+{
+	struct iwa_fwlog *fl = dev->si_drv1;
+	int revents = 0;
+
+	mtx_lock(&fl->fl_mtx);
+	if (events & (POLLIN | POLLRDNORM)) {
+		if (fl->fl_len > 0 || fl->fl_gone)
+			revents |= events & (POLLIN | POLLRDNORM);
+		else
+			selrecord(td, &fl->fl_rsel);
+	}
+	mtx_unlock(&fl->fl_mtx);
+
+	return (revents);
+}
+
+int
+iwa_fwlog_attach(struct iwa_softc *sc)
+{
+	struct iwa_fwlog *fl;
+
+	fl = malloc(sizeof(*fl), M_IWA_FWLOG, M_WAITOK | M_ZERO);
+	fl->fl_buf = malloc(IWA_FWLOG_BUFSIZE, M_IWA_FWLOG, M_WAITOK);
+	fl->fl_sc = sc;
+	fl->fl_poll_msec = IWA_FWLOG_POLL_MSEC;
+	mtx_init(&fl->fl_mtx, "iwa_fwlog", NULL, MTX_DEF);
+	callout_init_mtx(&fl->fl_poll, &sc->sc_mtx, 0);
+	sysctl_ctx_init(&fl->fl_sysctl_ctx);
+
+	fl->fl_cdev = make_dev(&iwa_fwlog_cdevsw,
+	    device_get_unit(sc->sc_dev), UID_ROOT, GID_WHEEL, 0600,
+	    "%s_fwlog", device_get_nameunit(sc->sc_dev));
+	if (fl->fl_cdev == NULL) {
+		device_printf(sc->sc_dev, "%s: couldn't create fwlog device\n",
+		    __func__);
+		mtx_destroy(&fl->fl_mtx);
+		free(fl->fl_buf, M_IWA_FWLOG);
+		free(fl, M_IWA_FWLOG);
+		return (ENXIO);
+	}
+	fl->fl_cdev->si_drv1 = fl;
+	sc->sc_fwlog = fl;
+
+	return (0);
+}
+
+void
+iwa_fwlog_detach(struct iwa_softc *sc)
+{
+	struct iwa_fwlog *fl = sc->sc_fwlog;
+
+	if (fl == NULL)
+		return;
+
+	/* The sysctl nodes point into fl */
+	sysctl_ctx_free(&fl->fl_sysctl_ctx);
+
+	/* Kick any blocked readers out before destroying the device */
+	mtx_lock(&fl->fl_mtx);
+	fl->fl_gone = true;
+	wakeup(fl);
+	selwakeup(&fl->fl_rsel);
+	mtx_unlock(&fl->fl_mtx);
+	destroy_dev(fl->fl_cdev);
+
+	IWA_LOCK(sc);
+	callout_stop(&fl->fl_poll);
+	sc->sc_fwlog = NULL;
+	IWA_UNLOCK(sc);
+	callout_drain(&fl->fl_poll);
+
+	seldrain(&fl->fl_rsel);
+	mtx_destroy(&fl->fl_mtx);
+	free(fl->fl_buf, M_IWA_FWLOG);
+	free(fl, M_IWA_FWLOG);
+}
+
+static int
+iwa_fwlog_sysctl_poll_msec(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_fwlog *fl = arg1;
+	struct iwa_softc *sc = fl->fl_sc;
+	int error, val;
+
+	val = fl->fl_poll_msec;
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (val < 0 || val > IWA_FWLOG_POLL_MAX_MSEC)
+		return (EINVAL);
+
+	IWA_LOCK(sc);
+	fl->fl_poll_msec = val;
+	/* Takes effect now, rather than at the next poll (if any) */
+	if (! fl->fl_open || val == 0)
+		callout_stop(&fl->fl_poll);
+	else
+		callout_reset(&fl->fl_poll, iwa_fwlog_poll_ticks(fl),
+		    iwa_fwlog_poll_events, fl);
+	IWA_UNLOCK(sc);
+	return (0);
+}
+
+/*
+ * The nodes hang off the device's tree but live in fl's own context,
+ * so iwa_fwlog_detach() can remove them before freeing fl.
+ */
+void
+iwa_fwlog_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct iwa_fwlog *fl = sc->sc_fwlog;
+	struct sysctl_oid *node;
+
+	if (fl == NULL)
+		return;
+	ctx = &fl->fl_sysctl_ctx;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "fwlog", CTLFLAG_RD,
+	    NULL, "firmware log streaming");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "poll_msec",
+	    CTLTYPE_INT | CTLFLAG_RW, fl, 0, iwa_fwlog_sysctl_poll_msec, "I",
+	    "event log poll interval while open (msec, 0 = off)");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "drops", CTLFLAG_RD,
+	    &fl->fl_drops, 0, "records dropped because the reader fell behind");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "events_lost", CTLFLAG_RD,
+	    &fl->fl_ev_lost, 0,
+	    "event log entries overwritten before they were read");
+}
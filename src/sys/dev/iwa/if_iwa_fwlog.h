@@ -0,0 +1,64 @@
+#ifndef	__IF_IWA_FWLOG_H__
+#define	__IF_IWA_FWLOG_H__
+
+/*
+ * Firmware log streaming.
+ *
+ * Firmware event log entries (bulk read out of SRAM periodically while
+ * someone is listening) and DEBUG_LOG_MSG notifications are written as
+ * records into a per-device ring buffer, which userland reads as a
+ * byte stream from /dev/iwaN_fwlog.  If the reader falls behind, the
+ * oldest records are dropped.
+ *
+ * Each record is a struct iwa_fwlog_hdr followed by fh_len bytes.
+ * read(2) only ever returns whole records, so a read buffer of
+ * IWA_FWLOG_MAX_RECORD bytes always makes progress; a buffer too small
+ * for the next record gets EMSGSIZE.
+ */
+
+#define	IWA_FWLOG_BUFSIZE	(64 * 1024)
+
+/* Largest record, header included; anything bigger isn't logged */
+#define	IWA_FWLOG_MAX_RECORD	(16 * 1024)
+
+/* How often the event log is polled while the device is open, in msec */
+#define	IWA_FWLOG_POLL_MSEC	100
+#define	IWA_FWLOG_POLL_MAX_MSEC	(60 * 1000)
+
+/* Event log entries read per poll; anything beyond that waits */
+#define	IWA_FWLOG_MAX_EVENTS	256
+
+/*
+ * Event log layout in SRAM (iwlwifi: mvm/ops.c, iwl_mvm_dump_event_log):
+ * capacity, mode, wrap count and write index, then the entries.  In
+ * mode 0 the entries have no timestamp; they're widened to the mode 1
+ * layout as they're read, so the records always have three words
+ * per entry (with a zero time in mode 0.)
+ */
+#define	IWA_FWLOG_EV_HDR_DWORDS	4
+#define	IWA_FWLOG_EV_DWORDS	3		/* event id, time, data */
+#define	IWA_FWLOG_EV_SRAM_DWORDS(mode)	((mode) != 0 ? 3 : 2)
+
+#define	IWA_FWLOG_TYPE_EVENTS	1	/* event log entries */
+#define	IWA_FWLOG_TYPE_DEBUG	2	/* DEBUG_LOG_MSG payload */
+#define	IWA_FWLOG_TYPE_LOST	3	/* uint32_t count of lost events */
+
+struct iwa_fwlog_hdr {
+	uint16_t	fh_type;
+	uint16_t	fh_len;
+	uint32_t	fh_ticks;
+} __packed;
+
+struct iwa_softc;
+struct iwl_rx_packet;
+
+extern	int iwa_fwlog_attach(struct iwa_softc *sc);
+extern	void iwa_fwlog_detach(struct iwa_softc *sc);
+extern	void iwa_fwlog_stop(struct iwa_softc *sc);
+extern	void iwa_fwlog_debug_msg(struct iwa_softc *sc,
+	    struct iwl_rx_packet *pkt);
+extern	void iwa_fwlog_ev_widen(uint32_t *buf, int n, uint32_t mode);
+extern	void iwa_fwlog_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
+
+#endif	/* __IF_IWA_FWLOG_H__ */
@@ -0,0 +1,564 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+#include <dev/iwa/if_iwa_journal.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+
+static MALLOC_DEFINE(M_IWA_JOURNAL, "iwa_journal", "iwa command journal");
+
+/* Station-relative keys carry the station id in bits 8..15 */
+#define	IWA_JOURNAL_STA_KEY(sta, sub)	(((sta) << 8) | ((sub) & 0xff))
+#define	IWA_JOURNAL_STA_MASK		0xff00
+
+#define	IWA_JOURNAL_IGNORE	0	/* not a configuration command */
+#define	IWA_JOURNAL_SET		1	/* record (class, key) */
+#define	IWA_JOURNAL_DEL		2	/* remove (class, key) */
+#define	IWA_JOURNAL_DEL_STA	3	/* remove everything for station key */
+
+/*
+ * Work out what a configuration command does to the journal.
+ *
+ * Context commands are stored with their action rewritten to ADD:
+ * MODIFY carries the whole context, and after a restart the firmware
+ * doesn't have anything to modify.
+ */
+static int
+iwa_journal_classify(uint8_t id, uint8_t *data, int len, int *classp,
+    uint32_t *keyp)
+{
+	struct iwl_mvm_add_sta_cmd *sta;
+	struct iwl_mvm_add_sta_key_cmd *key;
+	struct iwl_scd_txq_cfg_cmd *scd;
+	uint32_t *hdr;
+
+	*keyp = 0;
+
+	switch (id) {
+	case TX_ANT_CONFIGURATION_CMD:
+		*classp = IWA_JC_TX_ANT;
+		return (IWA_JOURNAL_SET);
+
+	case PHY_CONTEXT_CMD:
+	case MAC_CONTEXT_CMD:
+	case BINDING_CONTEXT_CMD:
+		/* COMMON_INDEX_HDR_API_S_VER_1: id_and_color, action */
+		if (len < 2 * sizeof(uint32_t))
+			return (IWA_JOURNAL_IGNORE);
+		hdr = (uint32_t *) data;
+		if (id == PHY_CONTEXT_CMD)
+			*classp = IWA_JC_PHY;
+		else if (id == MAC_CONTEXT_CMD)
+			*classp = IWA_JC_MAC;
+		else
+			*classp = IWA_JC_BINDING;
+		*keyp = le32toh(hdr[0]);
+		if (le32toh(hdr[1]) == FW_CTXT_ACTION_REMOVE)
+			return (IWA_JOURNAL_DEL);
+		hdr[1] = htole32(FW_CTXT_ACTION_ADD);
+		return (IWA_JOURNAL_SET);
+
+	case TIME_QUOTA_CMD:
+		*classp = IWA_JC_QUOTA;
+		return (IWA_JOURNAL_SET);
+
+	case ADD_STA:
+		if (len < sizeof(*sta))
+			return (IWA_JOURNAL_IGNORE);
+		sta = (struct iwl_mvm_add_sta_cmd *) data;
+		/*
+		 * BA sessions don't survive a restart: iwa_rxba_teardown()
+		 * sends the peers a DELBA and they set up new ones, so
+		 * don't bring the old ones back.
+		 */
+		if (sta->add_modify != 0 && (sta->modify_mask &
+		    (STA_MODIFY_ADD_BA_TID | STA_MODIFY_REMOVE_BA_TID)))
+			return (IWA_JOURNAL_IGNORE);
+		if (sta->add_modify == 0 || sta->modify_mask == 0) {
+			/* The whole station */
+			*classp = IWA_JC_STA;
+			*keyp = IWA_JOURNAL_STA_KEY(sta->sta_id, 0);
+			sta->add_modify = 0;
+		} else {
+			*classp = IWA_JC_STA_MOD;
+			*keyp = IWA_JOURNAL_STA_KEY(sta->sta_id,
+			    sta->modify_mask);
+		}
+		return (IWA_JOURNAL_SET);
+
+	case REMOVE_STA:
+		if (len < sizeof(struct iwl_mvm_rm_sta_cmd))
+			return (IWA_JOURNAL_IGNORE);
+		*keyp = IWA_JOURNAL_STA_KEY(
+		    ((struct iwl_mvm_rm_sta_cmd *) data)->sta_id, 0);
+		return (IWA_JOURNAL_DEL_STA);
+
+	case SCD_QUEUE_CFG:
+		if (len < sizeof(*scd))
+			return (IWA_JOURNAL_IGNORE);
+		scd = (struct iwl_scd_txq_cfg_cmd *) data;
+		*classp = IWA_JC_TXQ;
+		*keyp = scd->scd_queue;
+		return (scd->enable ? IWA_JOURNAL_SET : IWA_JOURNAL_DEL);
+
+	case ADD_STA_KEY:
+		if (len < sizeof(*key))
+			return (IWA_JOURNAL_IGNORE);
+		key = (struct iwl_mvm_add_sta_key_cmd *) data;
+		*classp = IWA_JC_KEY;
+		*keyp = IWA_JOURNAL_STA_KEY(key->sta_id, key->key_offset);
+		if (le16toh(key->key_flags) & STA_KEY_NOT_VALID)
+			return (IWA_JOURNAL_DEL);
+		return (IWA_JOURNAL_SET);
+
+	case POWER_TABLE_CMD:
+		*classp = IWA_JC_POWER;
+		return (IWA_JOURNAL_SET);
+
+	case MAC_PM_POWER_TABLE:
+		if (len < sizeof(uint32_t))
+			return (IWA_JOURNAL_IGNORE);
+		*classp = IWA_JC_MAC_POWER;
+		*keyp = le32toh(*(uint32_t *) data);
+		return (IWA_JOURNAL_SET);
+
+	case LQ_CMD:
+		if (len < sizeof(struct iwl_lq_cmd))
+			return (IWA_JOURNAL_IGNORE);
+		*classp = IWA_JC_LQ;
+		*keyp = IWA_JOURNAL_STA_KEY(
+		    ((struct iwl_lq_cmd *) data)->sta_id, 0);
+		return (IWA_JOURNAL_SET);
+	}
+
+	return (IWA_JOURNAL_IGNORE);
+}
+
+/*
+ * Drop the entries in the given class whose key matches under mask.
+ */
+static void
+iwa_journal_remove(struct iwa_journal *jn, int class, uint32_t key,
+    uint32_t mask)
+{
+	int i, j;
+
+	for (i = 0, j = 0; i < jn->jn_count; i++) {
+		if (jn->jn_ent[i].je_class == class &&
+		    (jn->jn_ent[i].je_key & mask) == key) {
+			jn->jn_stats.js_removed++;
+			continue;
+		}
+		if (i != j)
+			memcpy(&jn->jn_ent[j], &jn->jn_ent[i],
+			    sizeof(jn->jn_ent[0]));
+		j++;
+	}
+	jn->jn_count = j;
+}
+
+/*
+ * Find the slot for (class, key); either the existing entry or a
+ * freshly opened one at the end of its class.
+ */
+static struct iwa_journal_ent *
+iwa_journal_slot(struct iwa_journal *jn, int class, uint32_t key)
+{
+	int i, pos;
+
+	pos = jn->jn_count;
+	for (i = 0; i < jn->jn_count; i++) {
+		if (jn->jn_ent[i].je_class == class &&
+		    jn->jn_ent[i].je_key == key) {
+			jn->jn_stats.js_replaced++;
+			return (&jn->jn_ent[i]);
+		}
+		if (jn->jn_ent[i].je_class > class && pos == jn->jn_count)
+			pos = i;
+	}
+
+	if (jn->jn_count == IWA_JOURNAL_MAX_ENTRIES)
+		return (NULL);
+
+	if (pos < jn->jn_count)
+		memmove(&jn->jn_ent[pos + 1], &jn->jn_ent[pos],
+		    (jn->jn_count - pos) * sizeof(jn->jn_ent[0]));
+	jn->jn_count++;
+	jn->jn_stats.js_recorded++;
+	jn->jn_ent[pos].je_class = class;
+	jn->jn_ent[pos].je_key = key;
+	return (&jn->jn_ent[pos]);
+}
+
+/*
+ * Record a command that's just been handed to the firmware.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_journal_record(struct iwa_softc *sc, const struct iwl_host_cmd *hcmd)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+	struct iwa_journal_ent *je;
+	uint32_t key;
+	int class, i, len;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (jn == NULL || jn->jn_replaying ||
+	    sc->sc_uc_current != IWL_UCODE_REGULAR)
+		return;
+
+	for (i = 0, len = 0; i < nitems(hcmd->len); i++)
+		len += hcmd->len[i];
+	/* Configuration commands all fit in a command slot */
+	if (len > sizeof(jn->jn_scratch))
+		return;
+	for (i = 0, len = 0; i < nitems(hcmd->len); i++) {
+		if (hcmd->len[i] == 0)
+			continue;
+		memcpy(jn->jn_scratch + len, hcmd->data[i], hcmd->len[i]);
+		len += hcmd->len[i];
+	}
+
+	switch (iwa_journal_classify(hcmd->id, jn->jn_scratch, len, &class,
+	    &key)) {
+	case IWA_JOURNAL_SET:
+		/*
+		 * A full ADD_STA carries the whole station; older modifies
+		 * would replay after it and undo it.
+		 */
+		if (class == IWA_JC_STA)
+			iwa_journal_remove(jn, IWA_JC_STA_MOD, key,
+			    IWA_JOURNAL_STA_MASK);
+		if ((je = iwa_journal_slot(jn, class, key)) == NULL) {
+			jn->jn_stats.js_overflow++;
+			jn->jn_valid = 0;
+			return;
+		}
+		je->je_id = hcmd->id;
+		je->je_len = len;
+		memcpy(je->je_data, jn->jn_scratch, len);
+		break;
+	case IWA_JOURNAL_DEL:
+		iwa_journal_remove(jn, class, key, 0xffffffff);
+		/* Anything hanging off a MAC goes with it */
+		if (class == IWA_JC_MAC)
+			iwa_journal_remove(jn, IWA_JC_MAC_POWER, key,
+			    0xffffffff);
+		break;
+	case IWA_JOURNAL_DEL_STA:
+		iwa_journal_remove(jn, IWA_JC_STA, key, IWA_JOURNAL_STA_MASK);
+		iwa_journal_remove(jn, IWA_JC_STA_MOD, key,
+		    IWA_JOURNAL_STA_MASK);
+		iwa_journal_remove(jn, IWA_JC_KEY, key, IWA_JOURNAL_STA_MASK);
+		iwa_journal_remove(jn, IWA_JC_LQ, key, IWA_JOURNAL_STA_MASK);
+		break;
+	}
+}
+
+/*
+ * Forget everything; the next bring-up starts from scratch.
+ */
+void
+iwa_journal_reset(struct iwa_softc *sc)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (jn == NULL)
+		return;
+	jn->jn_count = 0;
+	jn->jn_valid = 1;
+}
+
+/*
+ * Whether the journal holds a configuration we're allowed to replay.
+ */
+bool
+iwa_journal_can_resume(struct iwa_softc *sc)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+
+	IWA_LOCK_ASSERT(sc);
+
+	return (jn != NULL && jn->jn_autorestart && jn->jn_valid &&
+	    jn->jn_count != 0);
+}
+
+/*
+ * Whether a dead firmware can be brought back from the journal.
+ */
+bool
+iwa_journal_can_restart(struct iwa_softc *sc)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (! iwa_journal_can_resume(sc))
+		return (false);
+
+	/* Don't spin if the replay itself is what kills it */
+	if (jn->jn_stats.js_replays != 0 &&
+	    ticks - jn->jn_last_restart < IWA_JOURNAL_HOLDOFF) {
+		device_printf(sc->sc_dev,
+		    "firmware died again right after a restart; giving up\n");
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Reload the REGULAR firmware and replay the journal.
+ *
+ * The commands are queued back to back as async commands and only
+ * the last one is waited for; the command queue completes in order so
+ * once it's done the firmware has taken all of them.
+ */
+static int
+iwa_journal_replay(struct iwa_softc *sc)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+	struct iwa_journal_ent *je;
+	struct iwl_host_cmd hcmd;
+	int error, i;
+
+	if ((error = iwa_prepare_card_hw(sc)) != 0)
+		return (error);
+	if ((error = iwa_start_hw(sc)) != 0)
+		return (error);
+	if ((error = iwa_mvm_load_ucode_wait_alive(sc,
+	    IWL_UCODE_REGULAR)) != 0)
+		return (error);
+
+	/* Calibration results first, as for any REGULAR bring-up */
+	jn->jn_replaying = 1;
+	if ((error = iwa_phy_db_send(sc)) != 0 ||
+	    (error = iwa_send_phy_cfg_cmd(sc)) != 0) {
+		jn->jn_replaying = 0;
+		return (error);
+	}
+
+	for (i = 0; i < jn->jn_count; i++) {
+		je = &jn->jn_ent[i];
+		memset(&hcmd, 0, sizeof(hcmd));
+		hcmd.id = je->je_id;
+		hcmd.data[0] = je->je_data;
+		hcmd.len[0] = je->je_len;
+		if (i != jn->jn_count - 1)
+			hcmd.flags = CMD_ASYNC;
+		if ((error = iwa_send_cmd(sc, &hcmd)) != 0)
+			break;
+	}
+	jn->jn_replaying = 0;
+	return (error);
+}
+
+/*
+ * Bring dead firmware back from the journal.
+ *
+ * The device must be stopped.  This sleeps; it requires the IWA lock
+ * to be held.
+ */
+int
+iwa_journal_restart(struct iwa_softc *sc)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+	sbintime_t t0;
+	uint32_t usec;
+	int error;
+
+	IWA_LOCK_ASSERT(sc);
+
+	t0 = sbinuptime();
+	jn->jn_last_restart = ticks;
+
+	if ((error = iwa_journal_replay(sc)) != 0) {
+		jn->jn_stats.js_replay_fail++;
+		return (error);
+	}
+
+	usec = (sbinuptime() - t0) / SBT_1US;
+	jn->jn_stats.js_replays++;
+	jn->jn_stats.js_last_usec = usec;
+	if (usec > jn->jn_stats.js_max_usec)
+		jn->jn_stats.js_max_usec = usec;
+
+	device_printf(sc->sc_dev,
+	    "firmware restarted; %d commands replayed in %u usec\n",
+	    jn->jn_count, usec);
+	return (0);
+}
+
+/*
+ * Put the configuration back after a suspend.
+ *
+ * Nothing died, so this stays out of the restart accounting; a crash
+ * just after resume still gets its restart.
+ *
+ * The device must be stopped.  This sleeps; it requires the IWA lock
+ * to be held.
+ */
+int
+iwa_journal_resume(struct iwa_softc *sc)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+	int error;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if ((error = iwa_journal_replay(sc)) != 0)
+		return (error);
+	jn->jn_stats.js_resumes++;
+	return (0);
+}
+
+void
+iwa_journal_attach(struct iwa_softc *sc)
+{
+	struct iwa_journal *jn;
+
+	jn = malloc(sizeof(*jn), M_IWA_JOURNAL, M_WAITOK | M_ZERO);
+	jn->jn_valid = 1;
+	jn->jn_autorestart = 1;
+	sc->sc_journal = jn;
+}
+
+void
+iwa_journal_detach(struct iwa_softc *sc)
+{
+
+	if (sc->sc_journal != NULL) {
+		free(sc->sc_journal, M_IWA_JOURNAL);
+		sc->sc_journal = NULL;
+	}
+}
+
+void
+iwa_journal_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct iwa_journal *jn = sc->sc_journal;
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "journal", CTLFLAG_RD,
+	    NULL, "configuration command journal");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "autorestart", CTLFLAG_RW,
+	    &jn->jn_autorestart, 0,
+	    "restart dead firmware by replaying the journal");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "entries", CTLFLAG_RD,
+	    &jn->jn_count, 0, "commands in the journal");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "valid", CTLFLAG_RD,
+	    &jn->jn_valid, 0, "journal holds the whole configuration");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "recorded", CTLFLAG_RD,
+	    &jn->jn_stats.js_recorded, 0, "entries added");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "replaced", CTLFLAG_RD,
+	    &jn->jn_stats.js_replaced, 0, "entries updated in place");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "removed", CTLFLAG_RD,
+	    &jn->jn_stats.js_removed, 0, "entries dropped");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "overflow", CTLFLAG_RD,
+	    &jn->jn_stats.js_overflow, 0, "commands that didn't fit");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "replays", CTLFLAG_RD,
+	    &jn->jn_stats.js_replays, 0, "successful restarts");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "replay_fail", CTLFLAG_RD,
+	    &jn->jn_stats.js_replay_fail, 0, "failed restarts");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "resumes", CTLFLAG_RD,
+	    &jn->jn_stats.js_resumes, 0, "configurations restored on resume");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "last_usec", CTLFLAG_RD,
+	    &jn->jn_stats.js_last_usec, 0, "last restart time, usec");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "max_usec", CTLFLAG_RD,
+	    &jn->jn_stats.js_max_usec, 0, "longest restart time, usec");
+}
@@ -0,0 +1,93 @@
+#ifndef	__IF_IWA_JOURNAL_H__
+#define	__IF_IWA_JOURNAL_H__
+
+/*
+ * Configuration command journal.
+ *
+ * Every configuration command sent to the REGULAR firmware after ALIVE
+ * (PHY/MAC contexts, bindings, stations, queues, keys, power, LQ) is
+ * recorded here.  The journal is compacted as it goes: a later command
+ * for the same object replaces the earlier one, and removing an object
+ * drops everything recorded against it, so it only ever holds the
+ * current firmware configuration.
+ *
+ * When the firmware dies, the restart task reloads the REGULAR image
+ * and replays the journal as one burst of async commands on the command
+ * queue, waiting only for the last one.  net80211 never notices.
+ *
+ * Entries are kept sorted by replay class so contexts are created
+ * before anything referring to them.
+ */
+
+/* Enough for an associated STA with a couple of keys */
+#define	IWA_JOURNAL_MAX_ENTRIES	32
+
+/* Fits in the command slot so replay never needs an mbuf */
+#define	IWA_JOURNAL_MAX_LEN	DEF_CMD_PAYLOAD_SIZE
+
+/* Don't restart again if the firmware dies this soon after a replay */
+#define	IWA_JOURNAL_HOLDOFF	(10 * hz)
+
+/* Replay order */
+enum iwa_journal_class {
+	IWA_JC_TX_ANT = 0,
+	IWA_JC_PHY,
+	IWA_JC_MAC,
+	IWA_JC_BINDING,
+	IWA_JC_QUOTA,
+	IWA_JC_STA,
+	IWA_JC_STA_MOD,
+	IWA_JC_TXQ,
+	IWA_JC_KEY,
+	IWA_JC_POWER,
+	IWA_JC_MAC_POWER,
+	IWA_JC_LQ,
+};
+
+struct iwa_journal_ent {
+	uint8_t		je_id;		/* command id */
+	uint8_t		je_class;	/* enum iwa_journal_class */
+	uint16_t	je_len;
+	uint32_t	je_key;		/* object within the class */
+	uint8_t		je_data[IWA_JOURNAL_MAX_LEN];
+};
+
+struct iwa_journal_stats {
+	uint32_t	js_recorded;	/* new entries */
+	uint32_t	js_replaced;	/* entries updated in place */
+	uint32_t	js_removed;	/* entries dropped by a remove */
+	uint32_t	js_overflow;	/* commands that didn't fit */
+	uint32_t	js_replays;
+	uint32_t	js_replay_fail;
+	uint32_t	js_resumes;	/* replays on resume */
+	uint32_t	js_last_usec;	/* last restart, reload + replay */
+	uint32_t	js_max_usec;
+};
+
+struct iwa_journal {
+	int			jn_count;
+	int			jn_valid;	/* 0 if anything was lost */
+	int			jn_replaying;
+	int			jn_autorestart;
+	int			jn_last_restart;	/* ticks */
+	struct iwa_journal_stats jn_stats;
+	uint8_t			jn_scratch[IWA_JOURNAL_MAX_LEN];
+	struct iwa_journal_ent	jn_ent[IWA_JOURNAL_MAX_ENTRIES];
+};
+
+struct iwa_softc;
+struct iwl_host_cmd;
+
+extern	void iwa_journal_attach(struct iwa_softc *sc);
+extern	void iwa_journal_detach(struct iwa_softc *sc);
+extern	void iwa_journal_reset(struct iwa_softc *sc);
+extern	void iwa_journal_record(struct iwa_softc *sc,
+	    const struct iwl_host_cmd *hcmd);
+extern	bool iwa_journal_can_restart(struct iwa_softc *sc);
+extern	int iwa_journal_restart(struct iwa_softc *sc);
+extern	bool iwa_journal_can_resume(struct iwa_softc *sc);
+extern	int iwa_journal_resume(struct iwa_softc *sc);
+extern	void iwa_journal_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
+
+#endif	/* __IF_IWA_JOURNAL_H__ */
@@ -0,0 +1,220 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+#include <dev/iwa/if_iwa_notif.h>
+
+void
+iwa_notif_wait_init(struct iwa_softc *sc)
+{
+
+	TAILQ_INIT(&sc->sc_notif_waits);
+}
+
+/*
+ * Register interest in any of the given notifications.  This must be
+ * done before triggering whatever the firmware is going to answer.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_init_notif_wait(struct iwa_softc *sc, struct iwa_notif_wait *wait,
+    const uint16_t *cmds, int ncmds, iwa_notif_fn_t fn, void *arg)
+{
+
+	IWA_LOCK_ASSERT(sc);
+	KASSERT(ncmds <= IWA_MAX_NOTIF_CMDS,
+	    ("%s: too many commands (%d)", __func__, ncmds));
+
+	memset(wait, 0, sizeof(*wait));
+	wait->nw_fn = fn;
+	wait->nw_arg = arg;
+	memcpy(wait->nw_cmds, cmds, ncmds * sizeof(cmds[0]));
+	wait->nw_ncmds = ncmds;
+	TAILQ_INSERT_TAIL(&sc->sc_notif_waits, wait, nw_entry);
+}
+
+/*
+ * Give up on a wait without sleeping, eg if triggering it failed.
+ */
+void
+iwa_remove_notif_wait(struct iwa_softc *sc, struct iwa_notif_wait *wait)
+{
+
+	IWA_LOCK_ASSERT(sc);
+
+	TAILQ_REMOVE(&sc->sc_notif_waits, wait, nw_entry);
+}
+
+/*
+ * Sleep until the wait is satisfied, aborted, or timo ticks pass.
+ * The wait is removed either way.
+ *
+ * Returns 0, ETIMEDOUT, or EIO if the device was stopped under us.
+ *
+ * This requires the IWA lock to be held.
+ */
+int
+iwa_wait_notif(struct iwa_softc *sc, struct iwa_notif_wait *wait, int timo)
+{
+	int error, deadline, left;
+
+	IWA_LOCK_ASSERT(sc);
+
+	error = 0;
+	deadline = ticks + timo;
+	while (! wait->nw_triggered && ! wait->nw_aborted) {
+		left = deadline - ticks;
+		if (left <= 0) {
+			error = EWOULDBLOCK;
+			break;
+		}
+		error = msleep(wait, &sc->sc_mtx, 0, "iwanotif", left);
+		if (error != 0 && error != EWOULDBLOCK)
+			break;
+	}
+	TAILQ_REMOVE(&sc->sc_notif_waits, wait, nw_entry);
+
+	if (wait->nw_triggered)
+		return (0);
+	if (wait->nw_aborted)
+		return (EIO);
+	return (error == EWOULDBLOCK ? ETIMEDOUT : error);
+}
+
+/*
+ * Called for every received packet, and for driver events with a
+ * NULL packet.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_notif_wait_notify(struct iwa_softc *sc, uint16_t cmd,
+    struct iwl_rx_packet *pkt)
+{
+	struct iwa_notif_wait *wait;
+	int i;
+
+	IWA_LOCK_ASSERT(sc);
+
+	TAILQ_FOREACH(wait, &sc->sc_notif_waits, nw_entry) {
+		if (wait->nw_triggered || wait->nw_aborted)
+			continue;
+		for (i = 0; i < wait->nw_ncmds; i++)
+			if (wait->nw_cmds[i] == cmd)
+				break;
+		if (i == wait->nw_ncmds)
+			continue;
+		if (wait->nw_fn == NULL || wait->nw_fn(sc, pkt, wait->nw_arg)) {
+			wait->nw_triggered = true;
+			wakeup(wait);
+		}
+	}
+}
+
+/*
+ * The device has stopped; nothing pending is going to arrive.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_notif_wait_abort(struct iwa_softc *sc)
+{
+	struct iwa_notif_wait *wait;
+
+	IWA_LOCK_ASSERT(sc);
+
+	TAILQ_FOREACH(wait, &sc->sc_notif_waits, nw_entry) {
+		wait->nw_aborted = true;
+		wakeup(wait);
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef	__IF_IWA_NOTIF_H__
+#define	__IF_IWA_NOTIF_H__
+
+/*
+ * Notification waits.
+ *
+ * A caller that's about to trigger something the firmware answers
+ * with a notification (ALIVE, INIT_COMPLETE, ...) registers a wait
+ * for the notification IDs first, then triggers it, then sleeps in
+ * iwa_wait_notif().  The RX path checks every packet against the
+ * registered waits and wakes the matching ones up directly, optionally
+ * running a callback on the packet first.  Since the wait is in place
+ * before the event can happen, it can't be missed, and the sleeper
+ * wakes as soon as the firmware answers rather than on a tick.
+ *
+ * Waits live on the caller's stack; everything is done under the IWA
+ * lock.
+ *
+ * iwlwifi: iwl-notif-wait.c
+ */
+
+#define	IWA_MAX_NOTIF_CMDS	5
+
+/*
+ * Driver events which aren't firmware notifications but are waited
+ * for the same way.  Firmware notification IDs are 8 bits.
+ */
+#define	IWA_NOTIF_FW_CHUNK	0x100	/* FH_TX: firmware chunk loaded */
+
+struct iwa_softc;
+struct iwl_rx_packet;
+
+/*
+ * Called from the RX path with the IWA lock held for each matching
+ * packet (NULL for driver events); return true if the wait is done.
+ */
+typedef	bool	(*iwa_notif_fn_t)(struct iwa_softc *sc,
+		    struct iwl_rx_packet *pkt, void *arg);
+
+struct iwa_notif_wait {
+	TAILQ_ENTRY(iwa_notif_wait) nw_entry;
+	iwa_notif_fn_t	nw_fn;
+	void		*nw_arg;
+	uint16_t	nw_cmds[IWA_MAX_NOTIF_CMDS];
+	int		nw_ncmds;
+	bool		nw_triggered;
+	bool		nw_aborted;
+};
+
+extern	void iwa_notif_wait_init(struct iwa_softc *sc);
+extern	void iwa_init_notif_wait(struct iwa_softc *sc,
+	    struct iwa_notif_wait *wait, const uint16_t *cmds, int ncmds,
+	    iwa_notif_fn_t fn, void *arg);
+extern	void iwa_remove_notif_wait(struct iwa_softc *sc,
+	    struct iwa_notif_wait *wait);
+extern	int iwa_wait_notif(struct iwa_softc *sc, struct iwa_notif_wait *wait,
+	    int timo);
+extern	void iwa_notif_wait_notify(struct iwa_softc *sc, uint16_t cmd,
+	    struct iwl_rx_packet *pkt);
+extern	void iwa_notif_wait_abort(struct iwa_softc *sc);
+
+#endif	/* __IF_IWA_NOTIF_H__ */
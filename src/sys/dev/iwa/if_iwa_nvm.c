@@ -24,6 +24,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/param.h>
 #include <sys/sockio.h>
 #include <sys/sysctl.h>
+#include <sys/sbuf.h>
 #include <sys/mbuf.h>
 #include <sys/kernel.h>
 #include <sys/socket.h>
@@ -79,10 +80,17 @@ __FBSDID("$FreeBSD$");
 #include <dev/iwa/if_iwa_firmware.h>
 #include <dev/iwa/if_iwa_nvm.h>
 #include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
 #include <dev/iwa/if_iwavar.h>
 #include <dev/iwa/if_iwareg.h>
 
 #include <dev/iwa/if_iwa_fw_util.h>
+#include <dev/iwa/if_iwa_notif.h>
 
 /*
  * NVM read access and content parsing.  We do not support
@@ -107,6 +115,8 @@ static const int nvm_to_read[] = {
 	NVM_SECTION_TYPE_PRODUCTION,
 };
 
+static MALLOC_DEFINE(M_IWA_NVM, "iwa_nvm", "iwa NVM cache");
+
 /* Default NVM size to read */
 #define IWL_NVM_DEFAULT_CHUNK_SIZE (2*1024)
 #define IWL_MAX_NVM_SECTION_SIZE 7000
@@ -114,126 +124,230 @@ static const int nvm_to_read[] = {
 #define NVM_WRITE_OPCODE 1
 #define NVM_READ_OPCODE 0
 
-static int
-iwa_nvm_read_chunk(struct iwa_softc *sc, uint16_t section,
-	uint16_t offset, uint16_t length, uint8_t *data, uint16_t *len)
+/* iwlwifi: NVM_ACCESS_CMD response status */
+#define	READ_NVM_CHUNK_SUCCEED			0
+#define	READ_NVM_CHUNK_NOT_VALID_ADDRESS	1
+
+/* Chunks requested per section; sections end early with a short read */
+#define	IWA_NVM_CHUNKS_PER_SECTION	\
+	howmany(IWL_MAX_NVM_SECTION_SIZE, IWL_NVM_DEFAULT_CHUNK_SIZE)
+
+/* For the whole burst */
+#define	IWA_NVM_READ_TIMEOUT	(2 * hz)
+
+/*
+ * State for one pipelined NVM read.  The chunks for every section are
+ * queued back to back; the responses come back in the same order and
+ * are appended to nr_buf as they arrive, so each section ends up
+ * contiguous in it.
+ */
+struct iwa_nvm_read {
+	uint8_t			*nr_buf;
+	int			nr_bufsize;
+	int			nr_fill;
+	int			nr_pending;	/* responses outstanding */
+	int			nr_error;
+	bool			nr_done[NVM_MAX_NUM_SECTIONS];
+	struct iwa_nvm_section	nr_sect[NVM_MAX_NUM_SECTIONS];
+};
+
+/*
+ * Notification wait callback; called for each NVM_ACCESS_CMD response.
+ */
+static bool
+iwa_nvm_read_fn(struct iwa_softc *sc, struct iwl_rx_packet *pkt, void *arg)
 {
-	offset = 0;
-	struct iwl_nvm_access_cmd nvm_access_cmd = {
-		.offset = htole16(offset),
-		.length = htole16(length),
-		.type = htole16(section),
-		.op_code = NVM_READ_OPCODE,
-	};
+	struct iwa_nvm_read *nr = arg;
 	struct iwl_nvm_access_resp *nvm_resp;
-	struct iwl_rx_packet *pkt;
-	struct iwl_host_cmd cmd = {
-		.id = NVM_ACCESS_CMD,
-		.flags = CMD_WANT_SKB | CMD_SEND_IN_RFKILL,
-		.data = { &nvm_access_cmd, },
-	};
-	int ret, bytes_read, offset_read;
-	uint8_t *resp_data;
-
-	device_printf(sc->sc_dev, "%s: section=%d; offset=%d; length=%d\n",
-	    __func__,
-	    (int) section,
-	    (int) offset,
-	    (int) length);
-
-	cmd.len[0] = sizeof(struct iwl_nvm_access_cmd);
-
-	/* Sync request */
-	ret = iwa_send_cmd(sc, &cmd);
-	if (ret) {
+	struct iwa_nvm_section *sect;
+	uint32_t paylen;
+	uint16_t type, offset, len, status;
+
+	nr->nr_pending--;
+	if (nr->nr_error != 0)
+		goto out;
+
+	paylen = iwl_rx_packet_payload_len(pkt);
+	if (paylen < sizeof(*nvm_resp)) {
+		device_printf(sc->sc_dev,
+		    "NVM ACCESS response too short (%u bytes)\n", paylen);
+		nr->nr_error = EINVAL;
+		goto out;
+	}
+
+	nvm_resp = (void *)pkt->data;
+	type = le16toh(nvm_resp->type);
+	offset = le16toh(nvm_resp->offset);
+	len = le16toh(nvm_resp->length);
+	status = le16toh(nvm_resp->status);
+
+	IWA_DPRINTF(sc, IWA_DEBUG_NVRAM,
+	    "%s: section=%d, offset=%d, len=%d, status=%d\n",
+	    __func__, type, offset, len, status);
+
+	if (type >= NVM_MAX_NUM_SECTIONS) {
 		device_printf(sc->sc_dev,
-		    "%s: iwa_send_cmd failed; error=%d\n",
-		    __func__,
-		    ret);
-		return ret;
+		    "NVM ACCESS response with invalid section %d\n", type);
+		nr->nr_error = EINVAL;
+		goto out;
 	}
 
-	pkt = cmd.resp_pkt;
+	/*
+	 * Speculative read past a section we've already seen the end of;
+	 * whatever the firmware made of it doesn't matter.
+	 */
+	if (nr->nr_done[type])
+		goto out;
+
 	if (pkt->hdr.flags & IWL_CMD_FAILED_MSK) {
 		device_printf(sc->sc_dev,
 		    "Bad return from NVM_ACCES_COMMAND (0x%08X)\n",
 		    pkt->hdr.flags);
-		ret = EIO;
-		goto exit;
+		nr->nr_error = EIO;
+		goto out;
 	}
 
-	/* Extract NVM response */
-	nvm_resp = (void *)pkt->data;
+	sect = &nr->nr_sect[type];
+	if (status != READ_NVM_CHUNK_SUCCEED) {
+		/*
+		 * Reading past the end of a section which is an exact
+		 * multiple of the chunk size, or a section this NVM
+		 * doesn't have.  The parser checks for the ones it needs.
+		 */
+		if (status != READ_NVM_CHUNK_NOT_VALID_ADDRESS) {
+			device_printf(sc->sc_dev,
+			    "NVM access command failed with status %d\n",
+			    status);
+			nr->nr_error = EINVAL;
+		}
+		nr->nr_done[type] = true;
+		goto out;
+	}
 
-	ret = le16toh(nvm_resp->status);
-	bytes_read = le16toh(nvm_resp->length);
-	offset_read = le16toh(nvm_resp->offset);
-	device_printf(sc->sc_dev, "%s: called; ret=%d, bytes=%d, offset=%d\n",
-	    __func__,
-	    ret,
-	    bytes_read,
-	    offset_read);
-	resp_data = nvm_resp->data;
-	if (ret) {
+	if (offset != sect->length) {
 		device_printf(sc->sc_dev,
-		    "NVM access command failed with status %d\n", ret);
-		ret = EINVAL;
-		goto exit;
+		    "NVM ACCESS response with invalid offset %d\n", offset);
+		nr->nr_error = EINVAL;
+		goto out;
 	}
-
-	if (offset_read != offset) {
+	if (len > paylen - sizeof(*nvm_resp)) {
+		device_printf(sc->sc_dev,
+		    "NVM ACCESS response with invalid length %d\n", len);
+		nr->nr_error = EINVAL;
+		goto out;
+	}
+	if (len > nr->nr_bufsize - nr->nr_fill) {
 		device_printf(sc->sc_dev,
-		    "NVM ACCESS response with invalid offset %d\n", offset_read);
-		ret = EINVAL;
-		goto exit;
+		    "%s: section %d overflows the NVM buffer\n",
+		    __func__, type);
+		nr->nr_error = ENOSPC;
+		goto out;
 	}
 
-	memcpy(data + offset, resp_data, bytes_read);
-	*len = bytes_read;
+	if (sect->data == NULL)
+		sect->data = nr->nr_buf + nr->nr_fill;
+	memcpy(nr->nr_buf + nr->nr_fill, nvm_resp->data, len);
+	nr->nr_fill += len;
+	sect->length += len;
 
- exit:
-	iwa_free_resp(sc, &cmd);
-	return ret;
+	/* Read until exhausted (reading less than requested) */
+	if (len < IWL_NVM_DEFAULT_CHUNK_SIZE)
+		nr->nr_done[type] = true;
+
+out:
+	return (nr->nr_pending == 0);
 }
 
 /*
- * Reads an NVM section completely.
- * NICs prior to 7000 family doesn't have a real NVM, but just read
- * section 0 which is the EEPROM. Because the EEPROM reading is unlimited
- * by uCode, we need to manually check in this case that we don't
- * overflow and try to read more than the EEPROM size.
- * For 7000 family NICs, we supply the maximal size we can read, and
- * the uCode fills the response with as much data as we can,
- * without overflowing, so no check is needed.
+ * Read the given NVM sections into buf, in one pipelined burst.
+ *
+ * Every chunk of every section is queued as an async NVM_ACCESS_CMD,
+ * with the section's real offsets; we don't know the section sizes up
+ * front, so IWA_NVM_CHUNKS_PER_SECTION are asked for each and the
+ * firmware answers the ones past the end with a short or empty read.
+ * The responses are collected by a notification wait, so there's a
+ * single sleep for the whole NVM rather than one per chunk.
+ *
+ * For 7000 family NICs the uCode never returns more than the section
+ * holds, so no further bounds checking is needed beyond the buffer.
+ *
+ * This sleeps; it requires the IWA lock to be held.
  */
 static int
-iwa_nvm_read_section(struct iwa_softc *sc,
-	uint16_t section, uint8_t *data, uint16_t *len)
+iwa_nvm_read_sections(struct iwa_softc *sc, const int *sections, int nsect,
+    uint8_t *buf, int bufsize, struct iwa_nvm_section *out, int *lenp)
 {
-	uint16_t length, seglen;
-	int error;
-
-	/* Set nvm section read length */
-	length = seglen = IWL_NVM_DEFAULT_CHUNK_SIZE;
-	*len = 0;
-
-	/* Read the NVM until exhausted (reading less than requested) */
-	while (seglen == length) {
-		error = iwa_nvm_read_chunk(sc,
-		    section, *len, length, data, &seglen);
-		if (error) {
-			device_printf(sc->sc_dev,
-			    "Cannot read NVM from section "
-			    "%d offset %d, length %d\n",
-			    section, *len, length);
-			return (error);
+	static const uint16_t nvm_access[] = { NVM_ACCESS_CMD };
+	struct iwl_nvm_access_cmd nvm_access_cmd;
+	struct iwl_host_cmd cmd;
+	struct iwa_notif_wait wait;
+	struct iwa_nvm_read nr;
+	int error, werror, i, j;
+
+	IWA_LOCK_ASSERT(sc);
+
+	memset(&nr, 0, sizeof(nr));
+	nr.nr_buf = buf;
+	nr.nr_bufsize = bufsize;
+
+	/*
+	 * Nothing can be answered until we sleep, since the RX path needs
+	 * the lock; so the wait can be set up before the first command.
+	 */
+	iwa_init_notif_wait(sc, &wait, nvm_access, nitems(nvm_access),
+	    iwa_nvm_read_fn, &nr);
+
+	error = 0;
+	for (i = 0; i < nsect && error == 0; i++) {
+		for (j = 0; j < IWA_NVM_CHUNKS_PER_SECTION; j++) {
+			memset(&nvm_access_cmd, 0, sizeof(nvm_access_cmd));
+			nvm_access_cmd.op_code = NVM_READ_OPCODE;
+			nvm_access_cmd.type = htole16(sections[i]);
+			nvm_access_cmd.offset =
+			    htole16(j * IWL_NVM_DEFAULT_CHUNK_SIZE);
+			nvm_access_cmd.length =
+			    htole16(IWL_NVM_DEFAULT_CHUNK_SIZE);
+
+			memset(&cmd, 0, sizeof(cmd));
+			cmd.id = NVM_ACCESS_CMD;
+			cmd.flags = CMD_ASYNC | CMD_SEND_IN_RFKILL;
+			cmd.data[0] = &nvm_access_cmd;
+			cmd.len[0] = sizeof(nvm_access_cmd);
+
+			error = iwa_send_cmd(sc, &cmd);
+			if (error != 0) {
+				device_printf(sc->sc_dev,
+				    "Cannot read NVM from section "
+				    "%d offset %d: %d\n",
+				    sections[i],
+				    j * IWL_NVM_DEFAULT_CHUNK_SIZE, error);
+				break;
+			}
+			nr.nr_pending++;
 		}
-		*len += seglen;
 	}
 
+	/* Whatever was queued still has to drain before nr goes away */
+	if (nr.nr_pending == 0) {
+		iwa_remove_notif_wait(sc, &wait);
+		return (error);
+	}
+	werror = iwa_wait_notif(sc, &wait, IWA_NVM_READ_TIMEOUT);
+	if (error == 0)
+		error = (werror != 0) ? werror : nr.nr_error;
+	if (error != 0) {
+		device_printf(sc->sc_dev, "%s: NVM read failed: %d\n",
+		    __func__, error);
+		return (error);
+	}
+
+	for (i = 0; i < nsect; i++)
+		out[sections[i]] = nr.nr_sect[sections[i]];
+	*lenp = nr.nr_fill;
+
 	IWA_DPRINTF(sc, IWA_DEBUG_NVRAM,
-	    "NVM section %d read completed\n", section);
-	return 0;
+	    "%s: NVM read completed, %d bytes\n", __func__, nr.nr_fill);
+	return (0);
 }
 
 /*
@@ -302,61 +416,83 @@ enum iwl_nvm_channel_flags {
 	NVM_CHANNEL_160MHZ = BIT(11),
 };
 
+/* iwlwifi: iwl_nvm_channels[]; the order of the NVM_CHANNELS words */
+static const uint8_t iwa_nvm_channels[] = {
+	/* 2.4 GHz */
+	1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+	/* 5 GHz */
+	36, 40, 44 , 48, 52, 56, 60, 64,
+	100, 104, 108, 112, 116, 120, 124, 128, 132, 136, 140, 144,
+	149, 153, 157, 161, 165
+};
+#define	NUM_2GHZ_CHANNELS	14
+
 #define CHECK_AND_PRINT_I(x)	\
 	((ch_flags & NVM_CHANNEL_##x) ? # x " " : "")
 
+/*
+ * Build the channel table from the NVM channel flags.
+ *
+ * This is done once per NVM read; everything that needs to know
+ * about a channel afterwards looks it up with iwa_nvm_chan_lookup().
+ */
 static void
 iwa_init_channel_map(struct iwa_softc *sc, const uint16_t * const nvm_ch_flags)
 {
-	device_printf(sc->sc_dev, "%s: TODO\n", __func__);
-#if 0
-	struct ieee80211com *ic = &sc->sc_ic;
 	struct iwa_nvm_data *data = &sc->sc_nvm;
-	int ch_idx;
-	struct ieee80211_channel *channel;
+	struct iwa_nvm_chan *ch;
 	uint16_t ch_flags;
+	int ch_idx, hw_value;
 	bool is_5ghz;
 
-	for (ch_idx = 0; ch_idx < __arraycount(iwm_nvm_channels); ch_idx++) {
+	memset(data->chans, 0, sizeof(data->chans));
+	data->n_chans = 0;
+
+	for (ch_idx = 0; ch_idx < nitems(iwa_nvm_channels); ch_idx++) {
 		ch_flags = le16_to_cpup(nvm_ch_flags + ch_idx);
-		int flags, hw_value;
+		hw_value = iwa_nvm_channels[ch_idx];
+		is_5ghz = ch_idx >= NUM_2GHZ_CHANNELS;
 
-		if (ch_idx >= NUM_2GHZ_CHANNELS &&
-		    !data->sku_cap_band_52GHz_enable)
+		if (is_5ghz && !data->sku_cap_band_52GHz_enable)
 			ch_flags &= ~NVM_CHANNEL_VALID;
 
 		if (!(ch_flags & NVM_CHANNEL_VALID)) {
-			device_printf(sc->sc_dev,
+			IWA_DPRINTF(sc, IWA_DEBUG_NVRAM,
 			    "Ch. %d Flags %x [%sGHz] - No traffic\n",
-			    iwm_nvm_channels[ch_idx],
-			    ch_flags,
-			    (ch_idx >= NUM_2GHZ_CHANNELS) ?
-			    "5.2" : "2.4");
+			    hw_value, ch_flags, is_5ghz ? "5.2" : "2.4");
 			continue;
 		}
 
-		hw_value = iwm_nvm_channels[ch_idx];
-		channel = &ic->ic_channels[hw_value];
-
-		is_5ghz = ch_idx >= NUM_2GHZ_CHANNELS;
-		if (!is_5ghz) {
-			flags = IEEE80211_CHAN_2GHZ;
-			channel->ic_flags
-			    = IEEE80211_CHAN_CCK
-			    | IEEE80211_CHAN_OFDM
-			    | IEEE80211_CHAN_DYN
-			    | IEEE80211_CHAN_2GHZ;
-		} else {
-			flags = IEEE80211_CHAN_5GHZ;
-			channel->ic_flags =
-			    IEEE80211_CHAN_A;
-		}
-		channel->ic_freq = ieee80211_ieee2mhz(hw_value, flags);
-
-		if (!(ch_flags & NVM_CHANNEL_ACTIVE))
-			channel->ic_flags |= IEEE80211_CHAN_PASSIVE;
+		IWA_DPRINTF(sc, IWA_DEBUG_NVRAM,
+		    "Ch. %d Flags %x [%sGHz] - %s%s%s%s%s%s%s%s\n",
+		    hw_value, ch_flags, is_5ghz ? "5.2" : "2.4",
+		    CHECK_AND_PRINT_I(VALID), CHECK_AND_PRINT_I(IBSS),
+		    CHECK_AND_PRINT_I(ACTIVE), CHECK_AND_PRINT_I(RADAR),
+		    CHECK_AND_PRINT_I(DFS), CHECK_AND_PRINT_I(40MHZ),
+		    CHECK_AND_PRINT_I(80MHZ), CHECK_AND_PRINT_I(160MHZ));
+
+		ch = &data->chans[hw_value];
+		ch->ch_freq = ieee80211_ieee2mhz(hw_value,
+		    is_5ghz ? IEEE80211_CHAN_5GHZ : IEEE80211_CHAN_2GHZ);
+		ch->ch_flags = IWA_CHAN_VALID;
+		if (ch_flags & NVM_CHANNEL_IBSS)
+			ch->ch_flags |= IWA_CHAN_IBSS;
+		if (ch_flags & NVM_CHANNEL_ACTIVE)
+			ch->ch_flags |= IWA_CHAN_ACTIVE;
+		if (ch_flags & NVM_CHANNEL_RADAR)
+			ch->ch_flags |= IWA_CHAN_RADAR;
+		if (ch_flags & NVM_CHANNEL_DFS)
+			ch->ch_flags |= IWA_CHAN_DFS;
+		if (ch_flags & NVM_CHANNEL_40MHZ)
+			ch->ch_flags |= IWA_CHAN_40MHZ;
+		if (ch_flags & NVM_CHANNEL_80MHZ)
+			ch->ch_flags |= IWA_CHAN_80MHZ;
+		if (ch_flags & NVM_CHANNEL_160MHZ)
+			ch->ch_flags |= IWA_CHAN_160MHZ;
+		/* The 7000 family NVM has no per-channel limit */
+		ch->ch_max_pwr = DEFAULT_MAX_TX_POWER;
+		data->n_chans++;
 	}
-#endif
 }
 
 static int
@@ -417,29 +553,38 @@ iwa_parse_nvm_data(struct iwa_softc *sc,
  * END NVM PARSE
  */
 
-struct iwa_nvm_section {
-        uint16_t length;
-        const uint8_t *data;
-};
-
-#define IWM_FW_VALID_TX_ANT(sc) \
-    ((sc->sc_fw_phy_config & FW_PHY_CFG_TX_CHAIN) >> FW_PHY_CFG_TX_CHAIN_POS)
-#define IWM_FW_VALID_RX_ANT(sc) \
-    ((sc->sc_fw_phy_config & FW_PHY_CFG_RX_CHAIN) >> FW_PHY_CFG_RX_CHAIN_POS)
-
 static int
 iwa_parse_nvm_sections(struct iwa_softc *sc, struct iwa_nvm_section *sections)
 {
 	const uint16_t *hw, *sw, *calib;
 
-	/* Checking for required sections */
+	/*
+	 * Checking for required sections; a section the NVM doesn't have
+	 * reads back as NOT_VALID_ADDRESS at offset 0 and stays empty.
+	 */
 	if (!sections[NVM_SECTION_TYPE_SW].data ||
-	    !sections[NVM_SECTION_TYPE_HW].data) {
+	    !sections[NVM_SECTION_TYPE_HW].data ||
+	    !sections[NVM_SECTION_TYPE_CALIBRATION].data) {
 		device_printf(sc->sc_dev,
 		    "%s: Can't parse empty NVM sections\n", __func__);
 		return ENOENT;
 	}
 
+	/* .. and that they hold every word iwa_parse_nvm_data() reads */
+	if (sections[NVM_SECTION_TYPE_SW].length <
+	    (NVM_CHANNELS + nitems(iwa_nvm_channels)) * sizeof(uint16_t) ||
+	    sections[NVM_SECTION_TYPE_HW].length <
+	    (HW_ADDR + 3) * sizeof(uint16_t) ||
+	    sections[NVM_SECTION_TYPE_CALIBRATION].length <
+	    (XTAL_CALIB + 2) * sizeof(uint16_t)) {
+		device_printf(sc->sc_dev,
+		    "%s: NVM sections too short (hw %d, sw %d, calib %d)\n",
+		    __func__, sections[NVM_SECTION_TYPE_HW].length,
+		    sections[NVM_SECTION_TYPE_SW].length,
+		    sections[NVM_SECTION_TYPE_CALIBRATION].length);
+		return EINVAL;
+	}
+
 	hw = (const uint16_t *)sections[NVM_SECTION_TYPE_HW].data;
 	sw = (const uint16_t *)sections[NVM_SECTION_TYPE_SW].data;
 	calib = (const uint16_t *)sections[NVM_SECTION_TYPE_CALIBRATION].data;
@@ -447,60 +592,326 @@ iwa_parse_nvm_sections(struct iwa_softc *sc, struct iwa_nvm_section *sections)
 	    IWM_FW_VALID_TX_ANT(sc), IWM_FW_VALID_RX_ANT(sc));
 }
 
+/*
+ * BEGIN NVM FILE
+ *
+ * iwlwifi: iwl_mvm_read_external_nvm()
+ */
+
+/* Optional header in front of the sections */
+#define	IWA_NVM_FILE_HEADER_0		0x2A504C54
+#define	IWA_NVM_FILE_HEADER_1		0x4E564D2A
+#define	IWA_NVM_FILE_HEADER_SIZE	(4 * sizeof(uint32_t))
+
+/* Each section starts with two words: length and section id (pre-8000) */
+#define	IWA_NVM_FILE_SECT_HDR_SIZE	(2 * sizeof(uint16_t))
+#define	IWA_NVM_FILE_WORD1_LEN(x)	(8 * ((x) & 0x03FF))
+#define	IWA_NVM_FILE_WORD2_ID(x)	((x) >> 12)
+
+/*
+ * Split an NVM file image into its sections, copying them into buf.
+ * The section list ends with an all-zero section header.
+ */
+static int
+iwa_nvm_parse_file(struct iwa_softc *sc, const uint8_t *data, size_t size,
+    uint8_t *buf, int bufsize, struct iwa_nvm_section *out, int *lenp)
+{
+	const uint8_t *p, *eof;
+	uint16_t word1, word2;
+	int fill, len, id;
+
+	p = data;
+	eof = data + size;
+	if (size > IWA_NVM_FILE_HEADER_SIZE &&
+	    le32dec(p) == IWA_NVM_FILE_HEADER_0 &&
+	    le32dec(p + 4) == IWA_NVM_FILE_HEADER_1) {
+		device_printf(sc->sc_dev,
+		    "NVM file version %08x, manufactured %08x\n",
+		    le32dec(p + 8), le32dec(p + 12));
+		p += IWA_NVM_FILE_HEADER_SIZE;
+	}
+
+	fill = 0;
+	for (;;) {
+		if (eof - p < IWA_NVM_FILE_SECT_HDR_SIZE) {
+			device_printf(sc->sc_dev,
+			    "%s: NVM file too short for section header\n",
+			    __func__);
+			return (EINVAL);
+		}
+		word1 = le16dec(p);
+		word2 = le16dec(p + 2);
+		p += IWA_NVM_FILE_SECT_HDR_SIZE;
+
+		/* EOF marker */
+		if (word1 == 0 && word2 == 0)
+			break;
+
+		len = 2 * IWA_NVM_FILE_WORD1_LEN(word1);
+		id = IWA_NVM_FILE_WORD2_ID(word2);
+		if (len == 0 || len > IWL_MAX_NVM_SECTION_SIZE ||
+		    len > eof - p || id >= NVM_MAX_NUM_SECTIONS) {
+			device_printf(sc->sc_dev,
+			    "%s: bad NVM file section %d, length %d\n",
+			    __func__, id, len);
+			return (EINVAL);
+		}
+		if (len > bufsize - fill) {
+			device_printf(sc->sc_dev,
+			    "%s: NVM file section %d overflows the NVM buffer\n",
+			    __func__, id);
+			return (ENOSPC);
+		}
+
+		memcpy(buf + fill, p, len);
+		out[id].data = buf + fill;
+		out[id].length = len;
+		fill += len;
+		p += len;
+	}
+
+	*lenp = fill;
+	return (0);
+}
+
+/*
+ * iwlwifi: iwl_nvm_check_version(), except that both versions have
+ * to be new enough.  calib_version is still the 255 placeholder from
+ * iwa_parse_nvm_data(), so in practice this checks nvm_version.
+ */
+static int
+iwa_nvm_check_version(struct iwa_softc *sc)
+{
+	const struct iwl_cfg *cfg = sc->sc_cfg;
+	struct iwa_nvm_data *data = &sc->sc_nvm;
+
+	if (data->nvm_version >= cfg->nvm_ver &&
+	    data->calib_version >= cfg->nvm_calib_ver)
+		return (0);
+
+	device_printf(sc->sc_dev,
+	    "Unsupported NVM version %04x (calib %02x); need %04x (calib %04x)\n",
+	    data->nvm_version, data->calib_version,
+	    cfg->nvm_ver, cfg->nvm_calib_ver);
+	return (EINVAL);
+}
+
+/*
+ * Use an NVM image supplied via firmware(9) instead of reading the NIC.
+ *
+ * The image is named by the nvm_file hint; without one the NVM is read
+ * from the NIC.  Only the pre-8000 file layout is understood, so the
+ * 8000 series (including the A-step parts for which iwlwifi falls back
+ * to default_nvm_file) always reads its own NVM.  If the image parses
+ * and passes the version check it seeds the NVM cache, so the INIT
+ * ucode never has to be brought up just to read the NVM.  It's assumed to match what's on the NIC; it
+ * isn't written back.
+ *
+ * Returns ENOENT if there's no image to use, in which case the NVM is
+ * read from the NIC as usual; likewise for any other error.
+ *
+ * This may sleep in the firmware(9) API - no locks must be held.
+ */
+int
+iwa_nvm_load_file(struct iwa_softc *sc)
+{
+	struct iwa_nvm_cache *nc = &sc->sc_nvm_cache;
+	const struct firmware *fwh;
+	const char *name;
+	int bufsize, error;
+
+	IWA_UNLOCK_ASSERT(sc);
+
+	if (sc->sc_cfg->device_family == IWL_DEVICE_FAMILY_8000)
+		return (ENOENT);
+	if (resource_string_value(device_get_name(sc->sc_dev),
+	    device_get_unit(sc->sc_dev), "nvm_file", &name) != 0)
+		return (ENOENT);
+
+	fwh = firmware_get(name);
+	if (fwh == NULL) {
+		device_printf(sc->sc_dev,
+		    "%s: failed to read NVM file (%s)\n", __func__, name);
+		return (ENOENT);
+	}
+
+	bufsize = sc->sc_cfg->base_params->eeprom_size;
+	if (nc->nc_buf == NULL)
+		nc->nc_buf = malloc(bufsize, M_IWA_NVM, M_WAITOK);
+
+	IWA_LOCK(sc);
+	memset(nc->nc_sect, 0, sizeof(nc->nc_sect));
+	error = iwa_nvm_parse_file(sc, fwh->data, fwh->datasize,
+	    nc->nc_buf, bufsize, nc->nc_sect, &nc->nc_len);
+	if (error == 0)
+		error = iwa_parse_nvm_sections(sc, nc->nc_sect);
+	if (error == 0)
+		error = iwa_nvm_check_version(sc);
+	if (error == 0) {
+		nc->nc_valid = true;
+		nc->nc_ticks = ticks;
+		nc->nc_from_file = 1;
+	}
+	IWA_UNLOCK(sc);
+
+	if (error == 0)
+		device_printf(sc->sc_dev, "using NVM from %s\n", name);
+	else
+		device_printf(sc->sc_dev, "ignoring NVM file %s: %d\n",
+		    name, error);
+
+	firmware_put(fwh, FIRMWARE_UNLOAD);
+	return (error);
+}
+
+/*
+ * END NVM FILE
+ */
+
 /*
  * Initialise the NVRAM section - this involves sending commands
  * to wake the hardware up.
  *
+ * Only the first call after attach actually talks to the NIC; the
+ * sections and parsed results are cached until detach.
+ *
  * For now, do this with the iwa lock held.
  */
 int
 iwa_nvm_init(struct iwa_softc *sc)
 {
-	/* XXX big stack variable? */
-	struct iwa_nvm_section nvm_sections[NVM_MAX_NUM_SECTIONS + 1];
-	int i, section, error;
-	uint16_t len;
-	uint8_t *nvm_buffer, *temp;
+	struct iwa_nvm_cache *nc = &sc->sc_nvm_cache;
+	int bufsize, error;
 
 	IWA_LOCK_ASSERT(sc);
 
+	if (nc->nc_valid) {
+		nc->nc_hits++;
+		return (0);
+	}
+
 	/* Read From FW NVM */
 	IWA_DPRINTF(sc, IWA_DEBUG_NVRAM, "%s: Read NVM\n", __func__);
 
-	/* TODO: find correct NVM max size for a section */
-	nvm_buffer = malloc(sc->sc_cfg->base_params->eeprom_size,
-	    M_TEMP, M_NOWAIT);
-	if (nvm_buffer == NULL) {
-		device_printf(sc->sc_dev,
-		    "%s: nvmbuffer malloc failed\n", __func__);
-		error = ENOMEM;
-		return (error);
+	/* All the sections we read fit in the NVM together */
+	bufsize = sc->sc_cfg->base_params->eeprom_size;
+	if (nc->nc_buf == NULL) {
+		nc->nc_buf = malloc(bufsize, M_IWA_NVM, M_NOWAIT);
+		if (nc->nc_buf == NULL) {
+			device_printf(sc->sc_dev,
+			    "%s: nvmbuffer malloc failed\n", __func__);
+			return (ENOMEM);
+		}
 	}
-#define	N(a)	(sizeof(a)/sizeof(a[0]))
-	for (i = 0; i < N(nvm_to_read); i++) {
-		section = nvm_to_read[i];
-		KASSERT(section <= N(nvm_sections), (""));
 
-		error = iwa_nvm_read_section(sc, section, nvm_buffer, &len);
-		if (error)
-			break;
+	memset(nc->nc_sect, 0, sizeof(nc->nc_sect));
+	error = iwa_nvm_read_sections(sc, nvm_to_read, nitems(nvm_to_read),
+	    nc->nc_buf, bufsize, nc->nc_sect, &nc->nc_len);
+	if (error != 0)
+		return (error);
+	nc->nc_reads++;
 
-		temp = malloc(len, M_TEMP, M_NOWAIT);
-		if (temp == NULL) {
-			device_printf(sc->sc_dev,
-			    "%s: nvram temp malloc failed\n",
-			    __func__);
-			error = ENOMEM;
-			break;
-		}
-		memcpy(temp, nvm_buffer, len);
-		nvm_sections[section].data = temp;
-		nvm_sections[section].length = len;
+	if ((error = iwa_parse_nvm_sections(sc, nc->nc_sect)) != 0)
+		return (error);
+
+	nc->nc_valid = true;
+	nc->nc_ticks = ticks;
+	nc->nc_from_file = 0;
+	return (0);
+}
+
+/*
+ * True if the NVM has been read and parsed already, so there's no
+ * need to bring up the INIT ucode just to get at it.
+ */
+bool
+iwa_nvm_cached(struct iwa_softc *sc)
+{
+
+	return (sc->sc_nvm_cache.nc_valid);
+}
+
+/*
+ * Returns the NVM's idea of the given channel, or NULL if it isn't
+ * usable.
+ */
+const struct iwa_nvm_chan *
+iwa_nvm_chan_lookup(struct iwa_softc *sc, int chan)
+{
+	const struct iwa_nvm_chan *ch;
+
+	if (chan <= 0 || chan > IWA_NVM_MAX_CHAN)
+		return (NULL);
+	ch = &sc->sc_nvm.chans[chan];
+	if (!(ch->ch_flags & IWA_CHAN_VALID))
+		return (NULL);
+	return (ch);
+}
+
+void
+iwa_nvm_cache_free(struct iwa_softc *sc)
+{
+	struct iwa_nvm_cache *nc = &sc->sc_nvm_cache;
+
+	nc->nc_valid = false;
+	memset(nc->nc_sect, 0, sizeof(nc->nc_sect));
+	if (nc->nc_buf != NULL)
+		free(nc->nc_buf, M_IWA_NVM);
+	nc->nc_buf = NULL;
+	nc->nc_len = 0;
+}
+
+static int
+iwa_nvm_sysctl_channels(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct iwa_nvm_chan *chans;
+	struct sbuf sb;
+	int error, i;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+
+	chans = malloc(sizeof(sc->sc_nvm.chans), M_TEMP, M_WAITOK);
+	IWA_LOCK(sc);
+	memcpy(chans, sc->sc_nvm.chans, sizeof(sc->sc_nvm.chans));
+	IWA_UNLOCK(sc);
+
+	sbuf_new_for_sysctl(&sb, NULL, 512, req);
+	for (i = 0; i <= IWA_NVM_MAX_CHAN; i++) {
+		if (!(chans[i].ch_flags & IWA_CHAN_VALID))
+			continue;
+		sbuf_printf(&sb, "\n%3d %4u MHz %2u dBm %b", i,
+		    chans[i].ch_freq, chans[i].ch_max_pwr, chans[i].ch_flags,
+		    "\20\1VALID\2IBSS\3ACTIVE\4RADAR\5DFS\00640\00780\010160");
 	}
-#undef	N
-	free(nvm_buffer, M_TEMP);
-	if (error)
-		return error;
+	free(chans, M_TEMP);
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
 
-	return iwa_parse_nvm_sections(sc, nvm_sections);
+void
+iwa_nvm_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct iwa_nvm_cache *nc = &sc->sc_nvm_cache;
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "nvm", CTLFLAG_RD,
+	    NULL, "NVM cache");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "reads", CTLFLAG_RD,
+	    &nc->nc_reads, 0, "NVM reads from the NIC");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "hits", CTLFLAG_RD,
+	    &nc->nc_hits, 0, "NVM reads satisfied from the cache");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "len", CTLFLAG_RD,
+	    &nc->nc_len, 0, "bytes of NVM cached");
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "from_file", CTLFLAG_RD,
+	    &nc->nc_from_file, 0, "NVM came from an image file");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "channels",
+	    CTLTYPE_STRING | CTLFLAG_RD, sc, 0, iwa_nvm_sysctl_channels,
+	    "A", "channel table");
 }
@@ -4,6 +4,27 @@
 struct iwa_softc;
 
 
+/*
+ * Per-channel information from the NVM_CHANNELS flags, parsed once and
+ * indexed directly by IEEE channel number.
+ */
+#define	IWA_NVM_MAX_CHAN	165
+
+#define	IWA_CHAN_VALID		0x01
+#define	IWA_CHAN_IBSS		0x02
+#define	IWA_CHAN_ACTIVE		0x04	/* active scanning allowed */
+#define	IWA_CHAN_RADAR		0x08
+#define	IWA_CHAN_DFS		0x10
+#define	IWA_CHAN_40MHZ		0x20
+#define	IWA_CHAN_80MHZ		0x40
+#define	IWA_CHAN_160MHZ		0x80
+
+struct iwa_nvm_chan {
+	uint16_t	ch_freq;	/* MHz */
+	uint8_t		ch_flags;	/* IWA_CHAN_* */
+	uint8_t		ch_max_pwr;	/* dBm */
+};
+
 struct iwa_nvm_data {
 	int n_hw_addrs;
 	uint8_t hw_addr[ETHER_ADDR_LEN];
@@ -30,8 +51,42 @@ struct iwa_nvm_data {
 
 	uint16_t nvm_version;
 	uint8_t max_tx_pwr_half_dbm;
+
+	int n_chans;			/* valid ones */
+	struct iwa_nvm_chan chans[IWA_NVM_MAX_CHAN + 1];
+};
+
+struct iwa_nvm_section {
+        uint16_t length;
+        const uint8_t *data;
+};
+
+/*
+ * The NVM contents don't change while the device is attached, so the
+ * first read is kept here: the raw sections (pointing into nc_buf)
+ * alongside the parsed copy in sc_nvm.  Later bring-ups, firmware
+ * restarts and resumes use it instead of asking the firmware again.
+ * It can also be seeded from an NVM image file at attach.
+ * Only detach throws it away.
+ */
+struct iwa_nvm_cache {
+	bool			nc_valid;
+	int			nc_ticks;	/* when it was read */
+	uint8_t			*nc_buf;	/* eeprom_size */
+	int			nc_len;		/* bytes used */
+	int			nc_from_file;	/* iwa_nvm_load_file() */
+	struct iwa_nvm_section	nc_sect[NVM_MAX_NUM_SECTIONS];
+	uint32_t		nc_reads;	/* times read from the NIC */
+	uint32_t		nc_hits;	/* times a read was skipped */
 };
 
 extern	int iwa_nvm_init(struct iwa_softc *sc);
+extern	int iwa_nvm_load_file(struct iwa_softc *sc);
+extern	bool iwa_nvm_cached(struct iwa_softc *sc);
+extern	const struct iwa_nvm_chan *iwa_nvm_chan_lookup(struct iwa_softc *sc,
+	    int chan);
+extern	void iwa_nvm_cache_free(struct iwa_softc *sc);
+extern	void iwa_nvm_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
 
 #endif	/* __IF_IWA_NVM_H__ */
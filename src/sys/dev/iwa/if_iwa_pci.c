@@ -72,11 +72,21 @@ __FBSDID("$FreeBSD$");
 
 #include <dev/iwa/iwl/iwl-config.h>
 #include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
 
 #include <dev/iwa/if_iwa_debug.h>
 #include <dev/iwa/if_iwa_firmware.h>
 #include <dev/iwa/if_iwa_trans.h>
 #include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
 #include <dev/iwa/if_iwavar.h>
 
 struct iwa_ident {
@@ -368,10 +378,10 @@ iwa_pci_resume(device_t dev)
 	struct iwa_softc *sc = device_get_softc(dev);
 #if 0
 	struct ieee80211com *ic = sc->sc_ifp->if_l2com;
+#endif
 
 	/* Clear device-specific "PCI retry timeout" register (41h). */
 	pci_write_config(dev, 0x41, 0, 1);
-#endif
 
 	return (iwa_resume(sc));
 }
@@ -0,0 +1,304 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+
+static MALLOC_DEFINE(M_IWA_PHY_DB, "iwa_phy_db", "iwa PHY calibration database");
+
+static struct iwa_phy_db_entry *
+iwa_phy_db_get_section(struct iwa_phy_db *pd, int type, int chg_id)
+{
+
+	switch (type) {
+	case IWA_PHY_DB_CFG:
+		return (&pd->pd_cfg);
+	case IWA_PHY_DB_CALIB_NCH:
+		return (&pd->pd_calib_nch);
+	case IWA_PHY_DB_CALIB_CHG_PAPD:
+		if (chg_id < 0 || chg_id >= IWA_NUM_PAPD_CH_GROUPS)
+			return (NULL);
+		return (&pd->pd_papd[chg_id]);
+	case IWA_PHY_DB_CALIB_CHG_TXP:
+		if (chg_id < 0 || chg_id >= IWA_NUM_TXP_CH_GROUPS)
+			return (NULL);
+		return (&pd->pd_txp[chg_id]);
+	}
+	return (NULL);
+}
+
+static void
+iwa_phy_db_free_section(struct iwa_phy_db_entry *entry)
+{
+
+	if (entry->data != NULL)
+		free(entry->data, M_IWA_PHY_DB);
+	entry->data = NULL;
+	entry->size = 0;
+}
+
+/*
+ * Throw away the calibration results; the next bring-up has to run
+ * the INIT ucode again.
+ */
+void
+iwa_phy_db_free(struct iwa_softc *sc)
+{
+	struct iwa_phy_db *pd = &sc->sc_phy_db;
+	int i;
+
+	pd->pd_valid = false;
+	iwa_phy_db_free_section(&pd->pd_cfg);
+	iwa_phy_db_free_section(&pd->pd_calib_nch);
+	for (i = 0; i < IWA_NUM_PAPD_CH_GROUPS; i++)
+		iwa_phy_db_free_section(&pd->pd_papd[i]);
+	for (i = 0; i < IWA_NUM_TXP_CH_GROUPS; i++)
+		iwa_phy_db_free_section(&pd->pd_txp[i]);
+}
+
+/*
+ * Store a calibration section from the INIT ucode.  len is the
+ * notification payload length.
+ *
+ * This is called from the RX path; it requires the IWA lock to be held.
+ */
+int
+iwa_phy_db_set_section(struct iwa_softc *sc,
+    const struct iwa_calib_res_notif_phy_db *notif, int len)
+{
+	struct iwa_phy_db_entry *entry;
+	uint16_t type, size;
+	int chg_id = 0;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (len < (int) sizeof(*notif))
+		return (EINVAL);
+	type = le16toh(notif->type);
+	size = le16toh(notif->length);
+	if (size > len - sizeof(*notif)) {
+		device_printf(sc->sc_dev,
+		    "%s: section type %d claims %d bytes, only %d there\n",
+		    __func__, type, size, (int) (len - sizeof(*notif)));
+		return (EINVAL);
+	}
+
+	if (type == IWA_PHY_DB_CALIB_CHG_PAPD ||
+	    type == IWA_PHY_DB_CALIB_CHG_TXP) {
+		if (size < sizeof(uint16_t))
+			return (EINVAL);
+		chg_id = le16toh(*(const uint16_t *)notif->data);
+	}
+
+	entry = iwa_phy_db_get_section(&sc->sc_phy_db, type, chg_id);
+	if (entry == NULL) {
+		device_printf(sc->sc_dev,
+		    "%s: unknown section type %d (chg %d)\n",
+		    __func__, type, chg_id);
+		return (EINVAL);
+	}
+
+	iwa_phy_db_free_section(entry);
+	entry->data = malloc(size, M_IWA_PHY_DB, M_NOWAIT);
+	if (entry->data == NULL)
+		return (ENOMEM);
+	memcpy(entry->data, notif->data, size);
+	entry->size = size;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_FIRMWARE,
+	    "%s: type %d chg %d size %d\n", __func__, type, chg_id, size);
+	return (0);
+}
+
+/*
+ * Queue one section; only the last one sent is waited for.
+ */
+static int
+iwa_phy_db_send_section(struct iwa_softc *sc, int type,
+    struct iwa_phy_db_entry *entry, bool last)
+{
+	struct iwa_phy_db_cmd cmd;
+	struct iwl_host_cmd hcmd;
+
+	cmd.type = htole16(type);
+	cmd.length = htole16(entry->size);
+
+	memset(&hcmd, 0, sizeof(hcmd));
+	hcmd.id = IWA_PHY_DB_CMD;
+	hcmd.data[0] = &cmd;
+	hcmd.len[0] = sizeof(cmd);
+	hcmd.data[1] = entry->data;
+	hcmd.len[1] = entry->size;
+	if (! last)
+		hcmd.flags = CMD_ASYNC;
+
+	return (iwa_send_cmd(sc, &hcmd));
+}
+
+/*
+ * Feed the calibration results to the REGULAR ucode.
+ *
+ * Must be called after ALIVE and before anything else is configured.
+ * The sections are queued back to back on the command queue; since it
+ * completes in order, waiting for the last one covers them all.
+ *
+ * This sleeps; it requires the IWA lock to be held.
+ */
+int
+iwa_phy_db_send(struct iwa_softc *sc)
+{
+	struct iwa_phy_db *pd = &sc->sc_phy_db;
+	struct {
+		int type;
+		struct iwa_phy_db_entry *entry;
+	} sect[2 + IWA_NUM_PAPD_CH_GROUPS + IWA_NUM_TXP_CH_GROUPS];
+	int error, i, n;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (! pd->pd_valid || pd->pd_cfg.size == 0 ||
+	    pd->pd_calib_nch.size == 0) {
+		device_printf(sc->sc_dev, "%s: no calibration results\n",
+		    __func__);
+		return (EINVAL);
+	}
+
+	/* Configuration and non-channel first, then the channel groups */
+	n = 0;
+	sect[n].type = IWA_PHY_DB_CFG;
+	sect[n++].entry = &pd->pd_cfg;
+	sect[n].type = IWA_PHY_DB_CALIB_NCH;
+	sect[n++].entry = &pd->pd_calib_nch;
+	for (i = 0; i < IWA_NUM_PAPD_CH_GROUPS; i++) {
+		if (pd->pd_papd[i].size == 0)
+			continue;
+		sect[n].type = IWA_PHY_DB_CALIB_CHG_PAPD;
+		sect[n++].entry = &pd->pd_papd[i];
+	}
+	for (i = 0; i < IWA_NUM_TXP_CH_GROUPS; i++) {
+		if (pd->pd_txp[i].size == 0)
+			continue;
+		sect[n].type = IWA_PHY_DB_CALIB_CHG_TXP;
+		sect[n++].entry = &pd->pd_txp[i];
+	}
+
+	for (i = 0; i < n; i++) {
+		error = iwa_phy_db_send_section(sc, sect[i].type,
+		    sect[i].entry, i == n - 1);
+		if (error != 0) {
+			device_printf(sc->sc_dev,
+			    "%s: section type %d failed: %d\n",
+			    __func__, sect[i].type, error);
+			return (error);
+		}
+	}
+
+	pd->pd_sends++;
+	return (0);
+}
+
+void
+iwa_phy_db_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct iwa_phy_db *pd = &sc->sc_phy_db;
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "phy_db", CTLFLAG_RD,
+	    NULL, "PHY calibration database");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "init_runs", CTLFLAG_RD,
+	    &pd->pd_init_runs, 0, "INIT calibration runs");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "sends", CTLFLAG_RD,
+	    &pd->pd_sends, 0, "times replayed to the REGULAR ucode");
+}
@@ -0,0 +1,69 @@
+#ifndef	__IF_IWA_PHY_DB_H__
+#define	__IF_IWA_PHY_DB_H__
+
+/*
+ * PHY calibration database.
+ *
+ * The INIT ucode hands back its calibration results as a series of
+ * CALIB_RES_NOTIF_PHY_DB sections, which the REGULAR ucode needs fed
+ * back to it via PHY_DB_CMD after ALIVE.  The sections are kept here
+ * for the life of the device, so the INIT calibration run only has to
+ * happen once; later bring-ups (interface up, firmware restart,
+ * resume) go straight to the REGULAR image and replay them.
+ *
+ * iwlwifi: iwl-phy-db.c
+ */
+
+/* Not in fw-api.h */
+#define	IWA_PHY_DB_CMD			0x6c
+
+#define	IWA_NUM_PAPD_CH_GROUPS		9
+#define	IWA_NUM_TXP_CH_GROUPS		9
+
+enum iwa_phy_db_section_type {
+	IWA_PHY_DB_CFG = 1,
+	IWA_PHY_DB_CALIB_NCH,
+	IWA_PHY_DB_UNUSED,
+	IWA_PHY_DB_CALIB_CHG_PAPD,
+	IWA_PHY_DB_CALIB_CHG_TXP,
+	IWA_PHY_DB_MAX
+};
+
+/* CALIB_RES_NOTIF_PHY_DB payload and PHY_DB_CMD header */
+struct iwa_calib_res_notif_phy_db {
+	uint16_t	type;
+	uint16_t	length;
+	uint8_t		data[];
+} __packed;
+
+struct iwa_phy_db_cmd {
+	uint16_t	type;
+	uint16_t	length;
+} __packed;
+
+struct iwa_phy_db_entry {
+	uint16_t	size;
+	uint8_t		*data;
+};
+
+struct iwa_phy_db {
+	bool			pd_valid;	/* INIT calibration completed */
+	int			pd_ticks;	/* when it completed */
+	uint32_t		pd_init_runs;
+	uint32_t		pd_sends;
+	struct iwa_phy_db_entry	pd_cfg;
+	struct iwa_phy_db_entry	pd_calib_nch;
+	struct iwa_phy_db_entry	pd_papd[IWA_NUM_PAPD_CH_GROUPS];
+	struct iwa_phy_db_entry	pd_txp[IWA_NUM_TXP_CH_GROUPS];
+};
+
+struct iwa_softc;
+
+extern	void iwa_phy_db_free(struct iwa_softc *sc);
+extern	int iwa_phy_db_set_section(struct iwa_softc *sc,
+	    const struct iwa_calib_res_notif_phy_db *notif, int len);
+extern	int iwa_phy_db_send(struct iwa_softc *sc);
+extern	void iwa_phy_db_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
+
+#endif	/* __IF_IWA_PHY_DB_H__ */
@@ -83,35 +83,292 @@ __FBSDID("$FreeBSD$");
 #include <dev/iwa/if_iwa_firmware.h>
 #include <dev/iwa/if_iwa_trans.h>
 #include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
 #include <dev/iwa/if_iwavar.h>
 #include <dev/iwa/if_iwareg.h>
 #include <dev/iwa/if_iwa_rx.h>
+#include <dev/iwa/if_iwa_fwlog.h>
 #include <dev/iwa/if_iwa_fw_util.h>
+#include <dev/iwa/if_iwa_notif.h>
 
 #define SYNC_RESP_STRUCT(_var_, _pkt_)					\
 do {									\
-	bus_dmamap_sync(sc->sc_dmat, data->map, \
+	bus_dmamap_sync(sc->rxq.data_dmat, data->map, \
 	    BUS_DMASYNC_POSTREAD);			\
 	_var_ = (void *)((_pkt_)+1);					\
 } while (/*CONSTCOND*/0)
 
 #define SYNC_RESP_PTR(_ptr_, _len_, _pkt_)				\
 do {									\
-	bus_dmamap_sync(sc->sc_dmat, data->map, BUS_DMASYNC_POSTREAD);	\
+	bus_dmamap_sync(sc->rxq.data_dmat, data->map, BUS_DMASYNC_POSTREAD);	\
 	_ptr_ = (void *)((_pkt_)+1);					\
 } while (/*CONSTCOND*/0)
 
+/* iwlwifi: the largest cfg_phy_cnt in a sane iwl_rx_phy_info */
+#define	IWA_RX_CFG_PHY_MAX	20
+
 #define ADVANCE_RXQ(sc) (sc->rxq.cur = (sc->rxq.cur + 1) % IWA_RX_RING_COUNT);
 
+/* Default noise floor, in dBm */
+#define	IWA_DEFAULT_NF		-95
+
+/*
+ * Cache the PHY info that precedes each received MPDU.
+ *
+ * iwlwifi: mvm/rx.c
+ */
+static void
+iwa_rx_rx_phy_cmd(struct iwa_softc *sc, struct iwl_rx_packet *pkt,
+    struct iwa_rx_data *data)
+{
+
+	bus_dmamap_sync(sc->rxq.data_dmat, data->map, BUS_DMASYNC_POSTREAD);
+	memcpy(&sc->sc_last_phy_info, pkt + 1, sizeof(sc->sc_last_phy_info));
+}
+
+/*
+ * Return the strongest per-chain energy, in dBm.
+ *
+ * iwlwifi: mvm/rx.c (iwl_mvm_get_signal_strength)
+ */
+static int
+iwa_rx_get_signal_strength(struct iwa_softc *sc,
+    struct iwl_rx_phy_info *phy_info)
+{
+	int energy_a, energy_b, energy_c, max_energy;
+	uint32_t val;
+
+	val = le32toh(phy_info->non_cfg_phy[IWL_RX_INFO_ENERGY_ANT_ABC_IDX]);
+	energy_a = (val & IWL_RX_INFO_ENERGY_ANT_A_MSK) >>
+	    IWL_RX_INFO_ENERGY_ANT_A_POS;
+	energy_a = energy_a ? -energy_a : -256;
+	energy_b = (val & IWL_RX_INFO_ENERGY_ANT_B_MSK) >>
+	    IWL_RX_INFO_ENERGY_ANT_B_POS;
+	energy_b = energy_b ? -energy_b : -256;
+	energy_c = (val & IWL_RX_INFO_ENERGY_ANT_C_MSK) >>
+	    IWL_RX_INFO_ENERGY_ANT_C_POS;
+	energy_c = energy_c ? -energy_c : -256;
+	max_energy = MAX(energy_a, energy_b);
+	max_energy = MAX(max_energy, energy_c);
+
+	IWA_DPRINTF(sc, IWA_DEBUG_RX,
+	    "energy In A %d B %d C %d , and max %d\n",
+	    energy_a, energy_b, energy_c, max_energy);
+
+	return max_energy;
+}
+
+/*
+ * Hand a list (m_nextpkt linked) of received frames to net80211.
+ * The signal level of each frame is in its packet header; see
+ * IWA_RX_SET_SIGNAL().
+ *
+ * This drops the IWA lock across the calls.
+ */
+void
+iwa_rx_input_list(struct iwa_softc *sc, struct mbuf *m)
+{
+	struct ieee80211com *ic = sc->sc_ifp->if_l2com;
+	struct ieee80211_node *ni;
+	struct mbuf *next;
+	int rssi, nf;
+
+	IWA_LOCK_ASSERT(sc);
+
+	IWA_UNLOCK(sc);
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		m->m_pkthdr.rcvif = sc->sc_ifp;
+		rssi = IWA_RX_RSSI(m);
+		nf = IWA_RX_NF(m);
+
+		ni = ieee80211_find_rxnode(ic,
+		    mtod(m, struct ieee80211_frame_min *));
+		if (ni != NULL) {
+			(void) ieee80211_input(ni, m, rssi, nf);
+			ieee80211_free_node(ni);
+		} else
+			(void) ieee80211_input_all(ic, m, rssi, nf);
+	}
+	IWA_LOCK(sc);
+}
+
+/*
+ * Copy a received frame out of its RX buffer into a new mbuf sized
+ * for the frame, and give the RX buffer back to the hardware.
+ *
+ * Returns NULL if no mbuf could be allocated.
+ */
+static struct mbuf *
+iwa_rx_copybreak(struct iwa_softc *sc, struct iwa_rx_data *data,
+    const void *buf, int len)
+{
+	struct mbuf *m;
+
+	m = m_get2(len, M_NOWAIT, MT_DATA, M_PKTHDR);
+	if (m != NULL) {
+		memcpy(mtod(m, void *), buf, len);
+		m->m_pkthdr.len = m->m_len = len;
+		sc->sc_rx_stats.rx_copied++;
+	}
+
+	bus_dmamap_sync(sc->rxq.data_dmat, data->map, BUS_DMASYNC_PREREAD);
+
+	return (m);
+}
+
+/*
+ * Handle a received MPDU.
+ *
+ * The RX buffer holds the iwl_rx_packet header, the
+ * iwl_rx_mpdu_res_start, the 802.11 frame and then a 32 bit
+ * rx_pkt_status.
+ *
+ * Frames bigger than the copy threshold are passed up in the RX
+ * buffer itself: the mbuf data pointer is moved to the 802.11 header
+ * and the slot is left for iwa_rx_restock() to refill.  Smaller frames
+ * (ACKs, beacons, management frames) are copied into a small mbuf
+ * so the large RX buffer stays in the ring.  If the restock reserve
+ * can't cover a big frame it is copied out as well.
+ *
+ * Frames ready to go up are appended to the caller's batch via tailp.
+ *
+ * iwlwifi: mvm/rx.c
+ */
+static void
+iwa_rx_rx_mpdu(struct iwa_softc *sc, struct iwl_rx_packet *pkt,
+    struct iwa_rx_data *data, int slot_idx, struct mbuf ***tailp)
+{
+	struct iwl_rx_phy_info *phy_info = &sc->sc_last_phy_info;
+	struct iwl_rx_mpdu_res_start *rx_res;
+	struct ieee80211_frame *wh;
+	struct mbuf *m;
+	uint32_t rx_pkt_status;
+	int len, rssi;
+
+	bus_dmamap_sync(sc->rxq.data_dmat, data->map, BUS_DMASYNC_POSTREAD);
+
+	rx_res = (struct iwl_rx_mpdu_res_start *)(pkt + 1);
+	wh = (struct ieee80211_frame *)(rx_res + 1);
+	len = le16toh(rx_res->byte_count);
+
+	if (len < sizeof(struct ieee80211_frame_min) ||
+	    sizeof(*rx_res) + len + sizeof(rx_pkt_status) >
+	    iwl_rx_packet_payload_len(pkt)) {
+		IWA_DPRINTF(sc, IWA_DEBUG_RX, "%s: bad length %d\n",
+		    __func__, len);
+		sc->sc_rx_stats.rx_runt++;
+		return;
+	}
+
+	/* iwlwifi: the PHY info this frame goes with has to be sane */
+	if (phy_info->cfg_phy_cnt > IWA_RX_CFG_PHY_MAX) {
+		device_printf(sc->sc_dev,
+		    "dsp size out of range [0,%d]: %d\n",
+		    IWA_RX_CFG_PHY_MAX, phy_info->cfg_phy_cnt);
+		return;
+	}
+
+	rx_pkt_status = le32dec((uint8_t *)wh + len);
+	if ((rx_pkt_status & RX_MPDU_RES_STATUS_CRC_OK) == 0 ||
+	    (rx_pkt_status & RX_MPDU_RES_STATUS_OVERRUN_OK) == 0) {
+		IWA_DPRINTF(sc, IWA_DEBUG_RX, "%s: bad CRC/overrun (0x%08x)\n",
+		    __func__, rx_pkt_status);
+		sc->sc_rx_stats.rx_crc_err++;
+		return;
+	}
+
+	/* Nowhere to send it yet */
+	if (sc->sc_ifp == NULL) {
+		sc->sc_rx_stats.rx_noif++;
+		return;
+	}
+
+	rssi = iwa_rx_get_signal_strength(sc, phy_info);
+
+	m = NULL;
+	if (len > sc->sc_rx_copy_thresh) {
+		m = iwa_rx_take(sc, &sc->rxq, slot_idx);
+		if (m != NULL) {
+			/* Point the mbuf at the 802.11 frame */
+			m->m_data = (caddr_t) wh;
+			m->m_pkthdr.len = m->m_len = len;
+			sc->sc_rx_stats.rx_zerocopy++;
+		}
+	}
+	if (m == NULL) {
+		/* Small frame, or no replacement buffer: copy it out */
+		m = iwa_rx_copybreak(sc, data, wh, len);
+		if (m == NULL) {
+			sc->sc_rx_stats.rx_nobuf++;
+			return;
+		}
+	}
+
+	IWA_DPRINTF(sc, IWA_DEBUG_RX,
+	    "%s: len=%d rssi=%d chan=%d rate=0x%08x\n",
+	    __func__, len, rssi, le16toh(phy_info->channel),
+	    le32toh(phy_info->rate_n_flags));
+
+	IWA_RX_SET_SIGNAL(m, rssi, IWA_DEFAULT_NF);
+
+	/*
+	 * Frames in an RX BA session may be held back for reordering;
+	 * whatever is ready goes on the batch iwa_notif_intr() returns.
+	 */
+	for (m = iwa_rxba_input(sc, m); m != NULL; m = m->m_nextpkt) {
+		**tailp = m;
+		*tailp = &m->m_nextpkt;
+	}
+}
+
+/*
+ * Hand a batch of received frames from iwa_notif_intr() up, or toss
+ * it if there's no interface to give it to.
+ *
+ * This drops the IWA lock across the calls, so the caller must be
+ * done with the rings and anything else it looked at first.
+ */
+void
+iwa_rx_input_batch(struct iwa_softc *sc, struct mbuf *m)
+{
+	struct mbuf *next;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (m == NULL)
+		return;
+	sc->sc_rx_stats.rx_batches++;
+	if (sc->sc_ifp != NULL) {
+		iwa_rx_input_list(sc, m);
+		return;
+	}
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m_freem(m);
+	}
+}
+
 /*
  * Process an CSR_INT_BIT_FH_RX or CSR_INT_BIT_SW_RX interrupt.
  * Basic structure from if_iwn
  *
+ * Returns the received frames ready to go up, as an m_nextpkt linked
+ * list; the caller passes them to iwa_rx_input_batch() once it's
+ * finished with the rings, since that drops the lock.
+ *
  * Requires: IWA lock held
  */
-void
+struct mbuf *
 iwa_notif_intr(struct iwa_softc *sc)
 {
+	struct mbuf *rxbatch = NULL, **rxtail = &rxbatch;
 	uint16_t hw;
 
 	IWA_LOCK_ASSERT(sc);
@@ -127,7 +384,7 @@ iwa_notif_intr(struct iwa_softc *sc)
 		struct iwl_cmd_response *cresp;
 		int qid, idx;
 
-		bus_dmamap_sync(sc->sc_dmat, data->map,
+		bus_dmamap_sync(sc->rxq.data_dmat, data->map,
 		    BUS_DMASYNC_POSTREAD);
 		pkt = mtod(data->m, struct iwl_rx_packet *);
 
@@ -167,23 +424,28 @@ iwa_notif_intr(struct iwa_softc *sc)
 			continue;
 		}
 
+		/* Wake up anyone waiting for this one */
+		iwa_notif_wait_notify(sc, pkt->hdr.cmd, pkt);
+
 		switch (pkt->hdr.cmd) {
 		case REPLY_RX_PHY_CMD:
-#if 0
-			iwa_mvm_rx_rx_phy_cmd(sc, pkt, data);
-#endif
+			iwa_rx_rx_phy_cmd(sc, pkt, data);
 			break;
 
 		case REPLY_RX_MPDU_CMD:
-#if 0
-			iwa_mvm_rx_rx_mpdu(sc, pkt, data);
-#endif
+			iwa_rx_rx_mpdu(sc, pkt, data, slot_idx, &rxtail);
 			break;
 
 		case TX_CMD:
-#if 0
-			iwa_mvm_rx_tx_cmd(sc, pkt, data);
-#endif
+			bus_dmamap_sync(sc->rxq.data_dmat, data->map,
+			    BUS_DMASYNC_POSTREAD);
+			iwa_tx_resp(sc, pkt);
+			break;
+
+		case BA_NOTIF:
+			bus_dmamap_sync(sc->rxq.data_dmat, data->map,
+			    BUS_DMASYNC_POSTREAD);
+			iwa_tx_ba_notif(sc, pkt);
 			break;
 
 		case MISSED_BEACONS_NOTIFICATION:
@@ -192,57 +454,35 @@ iwa_notif_intr(struct iwa_softc *sc)
 #endif
 			break;
 
-		case MVM_ALIVE: {
-			struct mvm_alive_resp *resp;
-			SYNC_RESP_STRUCT(resp, pkt);
-
-			sc->sc_uc.uc_error_event_table
-			    = le32toh(resp->error_event_table_ptr);
-			sc->sc_uc.uc_log_event_table
-			    = le32toh(resp->log_event_table_ptr);
-			sc->sched_base = le32toh(resp->scd_base_ptr);
-			sc->sc_uc.uc_ok = resp->status == IWL_ALIVE_STATUS_OK;
-
-			sc->sc_uc.uc_intr = true;
-			wakeup(&sc->sc_uc);
-			break; }
+		/* Handled by their notification waits */
+		case MVM_ALIVE:
+		case INIT_COMPLETE_NOTIF:
+			break;
 
 		case CALIB_RES_NOTIF_PHY_DB: {
-#if 0
-			struct iwl_calib_res_notif_phy_db *phy_db_notif;
+			struct iwa_calib_res_notif_phy_db *phy_db_notif;
 			SYNC_RESP_STRUCT(phy_db_notif, pkt);
 
-			iwa_phy_db_set_section(sc, phy_db_notif);
-#endif
-
+			if (iwa_phy_db_set_section(sc, phy_db_notif,
+			    iwl_rx_packet_payload_len(pkt)) != 0)
+				device_printf(sc->sc_dev,
+				    "couldn't store calibration section\n");
 			break; }
 
+		case DEBUG_LOG_MSG:
+			bus_dmamap_sync(sc->rxq.data_dmat, data->map,
+			    BUS_DMASYNC_POSTREAD);
+			iwa_fwlog_debug_msg(sc, pkt);
+			break;
+
 		case STATISTICS_NOTIFICATION: {
-#if 0
 			struct iwl_notif_statistics *stats;
 			SYNC_RESP_STRUCT(stats, pkt);
-			memcpy(&sc->sc_stats, stats, sizeof(sc->sc_stats));
-#endif
+			iwa_stats_notif(sc, stats);
 			break; }
 
+		/* Collected by the NVM reader's notification wait */
 		case NVM_ACCESS_CMD:
-			/*
-			 * XXX TODO: should we put it into the origin
-			 * command structure now, and do the wakeup?
-			 * Or just handle it after this chunk?
-			 */
-			/*
-			 * XXX TODO: why is this differently treated
-			 * to the command block below?
-			 */
-#if 0
-			if (sc->sc_wantresp == ((qid << 16) | idx)) {
-				bus_dmamap_sync(sc->sc_dmat, data->map,
-				    BUS_DMASYNC_POSTREAD);
-				memcpy(sc->sc_cmd_resp,
-				    pkt, sizeof(sc->sc_cmd_resp));
-			}
-#endif
 			break;
 
 		case PHY_CONFIGURATION_CMD:
@@ -276,12 +516,7 @@ iwa_notif_intr(struct iwa_softc *sc)
 			break;
 
 		/* ignore */
-		case 0x6c: /* PHY_DB_CMD, no idea why it's not in fw-api.h */
-			break;
-
-		case INIT_COMPLETE_NOTIF:
-			sc->sc_init_complete = true;
-			wakeup(&sc->sc_init_complete);
+		case IWA_PHY_DB_CMD:
 			break;
 
 		case SCAN_COMPLETE_NOTIFICATION: {
@@ -330,8 +565,8 @@ iwa_notif_intr(struct iwa_softc *sc)
 			break;
 		}
 
-		device_printf(sc->sc_dev, "%s: checking flags=0x%04x, is_cmd=%d\n",
-		    __func__,
+		IWA_DPRINTF(sc, IWA_DEBUG_CMD,
+		    "%s: checking flags=0x%04x, is_cmd=%d\n", __func__,
 		    le16toh(pkt->hdr.sequence),
 		    IWA_SEQ_TO_UCODE_RX(le16toh(pkt->hdr.sequence)));
 
@@ -351,7 +586,7 @@ iwa_notif_intr(struct iwa_softc *sc)
 			struct mbuf *m;
 			int error;
 
-			device_printf(sc->sc_dev,
+			IWA_DPRINTF(sc, IWA_DEBUG_CMD,
 			    "%s: command response!\n", __func__);
 
 			SYNC_RESP_STRUCT(cresp, pkt);
@@ -364,7 +599,7 @@ iwa_notif_intr(struct iwa_softc *sc)
 			 * a NULL mbuf pointer so the caller knows that
 			 * it can't steal the buffer.
 			 */
-			error = iwa_rx_addbuf(sc, &sc->rxq, IWA_RBUF_SIZE,
+			error = iwa_rx_addbuf(sc, &sc->rxq, sc->sc_rbuf_size,
 			    slot_idx);
 			if (error != 0) {
 				device_printf(sc->sc_dev,
@@ -385,11 +620,13 @@ iwa_notif_intr(struct iwa_softc *sc)
 
 	iwa_clear_bit(sc, CSR_GP_CNTRL, CSR_GP_CNTRL_REG_FLAG_MAC_ACCESS_REQ);
 
+	/* Refill the slots we emptied and tell the firmware */
+	iwa_rx_restock(sc, &sc->rxq);
+
 	/*
-	 * Tell the firmware what we have processed.
-	 * Seems like the hardware gets upset unless we align
-	 * the write by 8??
+	 * The received frames go up in one go; the lock is only dropped
+	 * once per interrupt rather than once per frame, so TX can get
+	 * in during RX bursts.
 	 */
-	hw = (hw == 0) ? IWA_RX_RING_COUNT - 1 : hw - 1;
-	IWA_REG_WRITE(sc, FH_RSCSR_CHNL0_WPTR, hw & ~7);
+	return (rxbatch);
 }
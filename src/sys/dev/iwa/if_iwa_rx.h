@@ -1,7 +1,32 @@
 #ifndef	__IF_IWA_RX_H__
 #define	__IF_IWA_RX_H__
 
-extern	void iwa_notif_intr(struct iwa_softc *sc);
+/*
+ * RX copybreak.
+ *
+ * Received frames up to this many bytes are copied into a new mbuf
+ * and the (sc_rbuf_size) RX buffer stays in the ring; bigger frames
+ * are passed up in the RX buffer itself.  0 means always pass the
+ * RX buffer up.
+ */
+#define	IWA_RX_COPY_THRESH	256
+
+/*
+ * The signal level of a received frame travels with it in the packet
+ * header until it's handed to net80211 (it may sit in the reorder
+ * buffer for a while.)  The RSSI is stored relative to the noise
+ * floor, as ieee80211_input() wants it.
+ */
+#define	IWA_RX_SET_SIGNAL(m, rssi, nf)	do {				\
+	(m)->m_pkthdr.PH_loc.eight[0] = MIN(MAX((rssi) - (nf), 0), 127); \
+	(m)->m_pkthdr.PH_loc.eight[1] = (int8_t) (nf);			\
+} while (0)
+#define	IWA_RX_RSSI(m)	((int) (m)->m_pkthdr.PH_loc.eight[0])
+#define	IWA_RX_NF(m)	((int) (int8_t) (m)->m_pkthdr.PH_loc.eight[1])
+
+extern	struct mbuf *iwa_notif_intr(struct iwa_softc *sc);
+extern	void iwa_rx_input_list(struct iwa_softc *sc, struct mbuf *m);
+extern	void iwa_rx_input_batch(struct iwa_softc *sc, struct mbuf *m);
 
 
 #endif /* __IF_IWA_RX_H__ */
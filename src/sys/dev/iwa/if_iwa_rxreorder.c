@@ -0,0 +1,711 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+#include <dev/iwa/if_iwa_rx.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+
+#define	IWA_RXBA_SLOT(sn)	((sn) & (IWA_RXBA_MAX_WINSIZE - 1))
+
+/* The time a held frame arrived, in ticks */
+#define	IWA_RXBA_STAMP(m)	((m)->m_pkthdr.PH_loc.thirtytwo[1])
+
+static void iwa_rxba_timeout(void *arg);
+static void iwa_rxba_task(void *arg, int npending);
+
+void
+iwa_rxba_init(struct iwa_softc *sc)
+{
+	struct iwa_rxba *ba;
+	int i;
+
+	for (i = 0; i < IWL_MAX_RX_BA_SESSIONS; i++) {
+		ba = &sc->sc_rxba[i];
+		memset(ba, 0, sizeof(*ba));
+		ba->ba_sc = sc;
+		callout_init_mtx(&ba->ba_timer, &sc->sc_mtx, 0);
+	}
+	sc->sc_rxba_nactive = 0;
+	sc->sc_rxba_pend_head = sc->sc_rxba_pend_tail = NULL;
+	TASK_INIT(&sc->sc_rxba_task, 0, iwa_rxba_task, sc);
+}
+
+static struct iwa_rxba *
+iwa_rxba_lookup(struct iwa_softc *sc, const uint8_t *addr, int tid)
+{
+	struct iwa_rxba *ba;
+	int i;
+
+	for (i = 0; i < IWL_MAX_RX_BA_SESSIONS; i++) {
+		ba = &sc->sc_rxba[i];
+		if (ba->ba_active && ba->ba_tid == tid &&
+		    IEEE80211_ADDR_EQ(ba->ba_addr, addr))
+			return (ba);
+	}
+	return (NULL);
+}
+
+static void
+iwa_rxba_append(struct mbuf ***tailp, struct mbuf *m)
+{
+
+	m->m_nextpkt = NULL;
+	**tailp = m;
+	*tailp = &m->m_nextpkt;
+}
+
+/*
+ * Move the window start forward by n, releasing any held frames
+ * that fall out of the window onto the given list in order.
+ */
+static void
+iwa_rxba_release(struct iwa_rxba *ba, int n, struct mbuf ***tailp)
+{
+	int i, idx, nslots;
+
+	/* Only the first IWA_RXBA_MAX_WINSIZE slots can hold anything */
+	nslots = MIN(n, IWA_RXBA_MAX_WINSIZE);
+	for (i = 0; i < nslots && ba->ba_nstored > 0; i++) {
+		idx = IWA_RXBA_SLOT(ba->ba_head + i);
+		if ((ba->ba_bitmap & (1ULL << idx)) == 0)
+			continue;
+		iwa_rxba_append(tailp, ba->ba_slot[idx]);
+		ba->ba_slot[idx] = NULL;
+		ba->ba_bitmap &= ~(1ULL << idx);
+		ba->ba_nstored--;
+	}
+	ba->ba_head = (ba->ba_head + n) & IWA_RXBA_SEQ_MASK;
+}
+
+/*
+ * Release the in-order run of held frames at the window start.
+ */
+static void
+iwa_rxba_release_run(struct iwa_rxba *ba, struct mbuf ***tailp)
+{
+	uint64_t rot;
+	int hidx, run;
+
+	if (ba->ba_nstored == 0)
+		return;
+
+	/* Rotate the bitmap so the window start is bit 0 */
+	hidx = IWA_RXBA_SLOT(ba->ba_head);
+	rot = ba->ba_bitmap;
+	if (hidx != 0)
+		rot = (rot >> hidx) | (rot << (IWA_RXBA_MAX_WINSIZE - hidx));
+
+	if (~rot == 0)
+		run = IWA_RXBA_MAX_WINSIZE;
+	else
+		run = ffsll(~rot) - 1;
+	if (run > 0)
+		iwa_rxba_release(ba, run, tailp);
+}
+
+/*
+ * Free everything held by a session and deactivate it.
+ */
+static void
+iwa_rxba_free(struct iwa_softc *sc, struct iwa_rxba *ba)
+{
+	int idx;
+
+	IWA_LOCK_ASSERT(sc);
+
+	callout_stop(&ba->ba_timer);
+	for (idx = 0; idx < IWA_RXBA_MAX_WINSIZE; idx++) {
+		if (ba->ba_slot[idx] != NULL) {
+			m_freem(ba->ba_slot[idx]);
+			ba->ba_slot[idx] = NULL;
+		}
+	}
+	ba->ba_bitmap = 0;
+	ba->ba_nstored = 0;
+	if (ba->ba_active) {
+		ba->ba_active = false;
+		sc->sc_rxba_nactive--;
+	}
+}
+
+/*
+ * Queue released frames for delivery from the taskqueue.
+ *
+ * This is used where the frames can't be handed up directly
+ * (the reorder timer, session teardown.)
+ */
+static void
+iwa_rxba_defer(struct iwa_softc *sc, struct mbuf *m)
+{
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (m == NULL)
+		return;
+	if (sc->sc_rxba_pend_tail == NULL)
+		sc->sc_rxba_pend_head = m;
+	else
+		sc->sc_rxba_pend_tail->m_nextpkt = m;
+	while (m->m_nextpkt != NULL)
+		m = m->m_nextpkt;
+	sc->sc_rxba_pend_tail = m;
+	taskqueue_enqueue(sc->sc_tq, &sc->sc_rxba_task);
+}
+
+/*
+ * Tell the peers of sessions torn down by iwa_rxba_teardown() that
+ * they're gone, and stop the net80211 side of them.  This sends
+ * frames, so it's done without the IWA lock held.
+ */
+static void
+iwa_rxba_send_delba(struct iwa_softc *sc, uint8_t addrs[][IEEE80211_ADDR_LEN],
+    const uint8_t *tids, int n)
+{
+	struct ieee80211com *ic = sc->sc_ifp->if_l2com;
+	struct ieee80211_node *ni;
+	uint16_t args[3];
+	int i;
+
+	IWA_UNLOCK_ASSERT(sc);
+
+	for (i = 0; i < n; i++) {
+		ni = ieee80211_find_node(&ic->ic_sta, addrs[i]);
+		if (ni == NULL)
+			continue;
+		IWA_DPRINTF(sc, IWA_DEBUG_RX, "%s: %6D tid %d\n",
+		    __func__, addrs[i], ":", tids[i]);
+		args[0] = tids[i];
+		args[1] = 0;			/* recipient */
+		args[2] = IEEE80211_REASON_UNSPECIFIED;
+		(void) ieee80211_send_action(ni, IEEE80211_ACTION_CAT_BA,
+		    IEEE80211_ACTION_BA_DELBA, args);
+		ic->ic_ampdu_rx_stop(ni, &ni->ni_rx_ampdu[tids[i]]);
+		ieee80211_free_node(ni);
+	}
+}
+
+static void
+iwa_rxba_task(void *arg, int npending)
+{
+	struct iwa_softc *sc = arg;
+	uint8_t addrs[IWL_MAX_RX_BA_SESSIONS][IEEE80211_ADDR_LEN];
+	uint8_t tids[IWL_MAX_RX_BA_SESSIONS];
+	struct iwa_rxba *ba;
+	struct mbuf *m, *next;
+	int i, n;
+
+	IWA_LOCK(sc);
+	m = sc->sc_rxba_pend_head;
+	sc->sc_rxba_pend_head = sc->sc_rxba_pend_tail = NULL;
+	if (m != NULL && sc->sc_ifp != NULL)
+		iwa_rx_input_list(sc, m);
+	else {
+		for (; m != NULL; m = next) {
+			next = m->m_nextpkt;
+			m_freem(m);
+		}
+	}
+
+	n = 0;
+	for (i = 0; i < IWL_MAX_RX_BA_SESSIONS; i++) {
+		ba = &sc->sc_rxba[i];
+		if (! ba->ba_delba)
+			continue;
+		ba->ba_delba = false;
+		IEEE80211_ADDR_COPY(addrs[n], ba->ba_addr);
+		tids[n] = ba->ba_tid;
+		n++;
+	}
+	IWA_UNLOCK(sc);
+
+	if (n > 0 && sc->sc_ifp != NULL)
+		iwa_rxba_send_delba(sc, addrs, tids, n);
+}
+
+/*
+ * Release held frames which have waited too long for a hole to fill.
+ * The window start is moved past the last such frame; holes before
+ * it are given up on.
+ */
+static void
+iwa_rxba_timeout(void *arg)
+{
+	struct iwa_rxba *ba = arg;
+	struct iwa_softc *sc = ba->ba_sc;
+	struct mbuf *head = NULL, **tail = &head;
+	struct mbuf *m;
+	int i, last;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (! ba->ba_active || ba->ba_nstored == 0)
+		return;
+
+	last = -1;
+	for (i = 0; i < ba->ba_winsize; i++) {
+		m = ba->ba_slot[IWA_RXBA_SLOT(ba->ba_head + i)];
+		if (m != NULL &&
+		    ticks - (int) IWA_RXBA_STAMP(m) >= IWA_RXBA_TIMEOUT)
+			last = i;
+	}
+	if (last >= 0) {
+		sc->sc_rxba_stats.rs_timeouts++;
+		iwa_rxba_release(ba, last + 1, &tail);
+		iwa_rxba_release_run(ba, &tail);
+	}
+
+	if (ba->ba_nstored > 0)
+		callout_reset(&ba->ba_timer, IWA_RXBA_TIMEOUT,
+		    iwa_rxba_timeout, ba);
+
+	iwa_rxba_defer(sc, head);
+}
+
+/*
+ * Start an RX BA session for the given transmitter/TID.
+ *
+ * This requires the IWA lock to be held.
+ */
+int
+iwa_rxba_start(struct iwa_softc *sc, const uint8_t *addr, int tid,
+    uint16_t ssn, int winsize)
+{
+	struct iwa_rxba *ba;
+	int i;
+
+	IWA_LOCK_ASSERT(sc);
+
+	/* Restarting a session drops whatever the old one held */
+	ba = iwa_rxba_lookup(sc, addr, tid);
+	if (ba != NULL)
+		iwa_rxba_free(sc, ba);
+
+	for (i = 0; i < IWL_MAX_RX_BA_SESSIONS; i++) {
+		if (! sc->sc_rxba[i].ba_active)
+			break;
+	}
+	if (i == IWL_MAX_RX_BA_SESSIONS) {
+		device_printf(sc->sc_dev,
+		    "%s: out of RX BA sessions\n", __func__);
+		return (ENOSPC);
+	}
+
+	ba = &sc->sc_rxba[i];
+	ba->ba_delba = false;
+	IEEE80211_ADDR_COPY(ba->ba_addr, addr);
+	ba->ba_tid = tid;
+	if (winsize <= 0 || winsize > IWA_RXBA_MAX_WINSIZE)
+		winsize = IWA_RXBA_MAX_WINSIZE;
+	ba->ba_winsize = winsize;
+	ba->ba_head = ssn & IWA_RXBA_SEQ_MASK;
+	ba->ba_active = true;
+	sc->sc_rxba_nactive++;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_RX,
+	    "%s: %6D tid %d: ssn %d, winsize %d\n",
+	    __func__, addr, ":", tid, ssn, winsize);
+
+	return (0);
+}
+
+/*
+ * Stop an RX BA session; anything it holds is handed up in order.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_rxba_stop(struct iwa_softc *sc, const uint8_t *addr, int tid)
+{
+	struct iwa_rxba *ba;
+	struct mbuf *head = NULL, **tail = &head;
+
+	IWA_LOCK_ASSERT(sc);
+
+	ba = iwa_rxba_lookup(sc, addr, tid);
+	if (ba == NULL)
+		return;
+
+	iwa_rxba_release(ba, IWA_RXBA_MAX_WINSIZE, &tail);
+	iwa_rxba_free(sc, ba);
+	iwa_rxba_defer(sc, head);
+
+	IWA_DPRINTF(sc, IWA_DEBUG_RX, "%s: %6D tid %d\n",
+	    __func__, addr, ":", tid);
+}
+
+/*
+ * Tear down all RX BA sessions and free anything held or pending.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_rxba_flush(struct iwa_softc *sc)
+{
+	struct mbuf *m, *next;
+	int i;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (i = 0; i < IWL_MAX_RX_BA_SESSIONS; i++) {
+		iwa_rxba_free(sc, &sc->sc_rxba[i]);
+		sc->sc_rxba[i].ba_delba = false;
+	}
+
+	for (m = sc->sc_rxba_pend_head; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m_freem(m);
+	}
+	sc->sc_rxba_pend_head = sc->sc_rxba_pend_tail = NULL;
+}
+
+/*
+ * Tear down all RX BA sessions when the firmware is stopped.
+ *
+ * The firmware forgets its sessions and the reorder state goes with
+ * them; held frames are handed up in order.  The peers still think
+ * the sessions are up though, so each one is sent a DELBA from the
+ * taskqueue; they'll set up a fresh session (and the firmware side of
+ * it) with a new ADDBA rather than have us reorder against a stale
+ * window.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_rxba_teardown(struct iwa_softc *sc)
+{
+	struct iwa_rxba *ba;
+	struct mbuf *head = NULL, **tail = &head;
+	int i;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (sc->sc_rxba_nactive == 0)
+		return;
+
+	for (i = 0; i < IWL_MAX_RX_BA_SESSIONS; i++) {
+		ba = &sc->sc_rxba[i];
+		if (! ba->ba_active)
+			continue;
+		iwa_rxba_release(ba, IWA_RXBA_MAX_WINSIZE, &tail);
+		iwa_rxba_free(sc, ba);
+		ba->ba_delba = true;
+	}
+	iwa_rxba_defer(sc, head);
+
+	/* iwa_rxba_defer() only queues the task if there were frames */
+	taskqueue_enqueue(sc->sc_tq, &sc->sc_rxba_task);
+}
+
+/*
+ * Wait for the reorder timers to finish; called without the lock
+ * held at detach time after iwa_rxba_flush().
+ */
+void
+iwa_rxba_drain(struct iwa_softc *sc)
+{
+	int i;
+
+	for (i = 0; i < IWL_MAX_RX_BA_SESSIONS; i++)
+		callout_drain(&sc->sc_rxba[i].ba_timer);
+}
+
+/*
+ * Handle a BlockAckReq: move the window start up to its SSN, releasing
+ * held frames before it in order.
+ *
+ * net80211 only acts on a BAR for sessions it's reordering itself,
+ * which ours aren't (see iwa_ampdu_rx_start()), so without this a peer
+ * that gave up on some frames would leave the rest held until the
+ * reorder timer went off.
+ */
+static void
+iwa_rxba_bar(struct iwa_softc *sc, struct mbuf *m, struct mbuf ***tailp)
+{
+	struct ieee80211_frame_bar *bar;
+	struct iwa_rxba *ba;
+	int delta, ssn, tid;
+
+	if (m->m_len < sizeof(*bar))
+		return;
+	bar = mtod(m, struct ieee80211_frame_bar *);
+	tid = (le16toh(bar->i_ctl) & IEEE80211_BAR_TID) >> IEEE80211_BAR_TID_S;
+	ba = iwa_rxba_lookup(sc, bar->i_ta, tid);
+	if (ba == NULL)
+		return;
+
+	ssn = le16toh(bar->i_seq) >> IEEE80211_SEQ_SEQ_SHIFT;
+	delta = (ssn - ba->ba_head) & IWA_RXBA_SEQ_MASK;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_RX, "%s: %6D tid %d: ssn %d, head %d\n",
+	    __func__, bar->i_ta, ":", tid, ssn, ba->ba_head);
+
+	/* A BAR for the window start or behind it changes nothing */
+	if (delta == 0 || delta >= (IWA_RXBA_SEQ_MASK + 1) / 2)
+		return;
+
+	sc->sc_rxba_stats.rs_bars++;
+	iwa_rxba_release(ba, delta, tailp);
+	iwa_rxba_release_run(ba, tailp);
+	if (ba->ba_nstored == 0)
+		callout_stop(&ba->ba_timer);
+}
+
+/*
+ * Run a received frame through the reorder buffer.
+ *
+ * Returns an m_nextpkt linked list of frames now ready to be handed
+ * up in order, which may be empty (the frame is being held or was a
+ * duplicate) or just the frame itself (it's not part of a BA session.)
+ *
+ * This requires the IWA lock to be held.
+ */
+struct mbuf *
+iwa_rxba_input(struct iwa_softc *sc, struct mbuf *m)
+{
+	struct ieee80211_frame *wh;
+	struct iwa_rxba *ba;
+	struct mbuf *head = NULL, **tail = &head;
+	int delta, idx, sn;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (sc->sc_rxba_nactive == 0)
+		return (m);
+
+	wh = mtod(m, struct ieee80211_frame *);
+	if ((wh->i_fc[0] & (IEEE80211_FC0_TYPE_MASK |
+	    IEEE80211_FC0_SUBTYPE_MASK)) ==
+	    (IEEE80211_FC0_TYPE_CTL | IEEE80211_FC0_SUBTYPE_BAR)) {
+		iwa_rxba_bar(sc, m, &tail);
+		/* Anything released goes up ahead of the BAR itself */
+		iwa_rxba_append(&tail, m);
+		return (head);
+	}
+
+	/* QoS-Null frames have a sequence number but aren't reordered */
+	if (! IEEE80211_QOS_HAS_SEQ(wh) ||
+	    (wh->i_fc[0] & IEEE80211_FC0_SUBTYPE_MASK) ==
+	    IEEE80211_FC0_SUBTYPE_QOS_NULL ||
+	    IEEE80211_IS_MULTICAST(wh->i_addr1) ||
+	    (wh->i_fc[1] & IEEE80211_FC1_MORE_FRAG) != 0)
+		return (m);
+
+	ba = iwa_rxba_lookup(sc, wh->i_addr2, ieee80211_gettid(wh));
+	if (ba == NULL)
+		return (m);
+
+	sn = le16toh(*(uint16_t *)wh->i_seq) >> IEEE80211_SEQ_SEQ_SHIFT;
+	delta = (sn - ba->ba_head) & IWA_RXBA_SEQ_MASK;
+
+	/* Behind the window: old or a retransmission */
+	if (delta >= (IWA_RXBA_SEQ_MASK + 1) / 2) {
+		sc->sc_rxba_stats.rs_dup++;
+		m_freem(m);
+		return (NULL);
+	}
+
+	/* Past the window: move the window so this frame ends it */
+	if (delta >= ba->ba_winsize) {
+		sc->sc_rxba_stats.rs_moves++;
+		iwa_rxba_release(ba, delta - ba->ba_winsize + 1, &tail);
+		delta = ba->ba_winsize - 1;
+	}
+
+	if (delta == 0) {
+		/* The frame we were waiting for */
+		iwa_rxba_append(&tail, m);
+		ba->ba_head = (ba->ba_head + 1) & IWA_RXBA_SEQ_MASK;
+	} else {
+		idx = IWA_RXBA_SLOT(sn);
+		if (ba->ba_bitmap & (1ULL << idx)) {
+			sc->sc_rxba_stats.rs_dup++;
+			m_freem(m);
+		} else {
+			IWA_RXBA_STAMP(m) = ticks;
+			ba->ba_slot[idx] = m;
+			ba->ba_bitmap |= (1ULL << idx);
+			ba->ba_nstored++;
+			sc->sc_rxba_stats.rs_stored++;
+		}
+	}
+	iwa_rxba_release_run(ba, &tail);
+
+	if (ba->ba_nstored == 0)
+		callout_stop(&ba->ba_timer);
+	else if (! callout_pending(&ba->ba_timer))
+		callout_reset(&ba->ba_timer, IWA_RXBA_TIMEOUT,
+		    iwa_rxba_timeout, ba);
+
+	return (head);
+}
+
+/*
+ * net80211 A-MPDU RX hooks.
+ *
+ * net80211 handles the ADDBA/DELBA exchange; we set up and tear down
+ * the matching reorder window.  net80211's own reorder state is only
+ * started if we have no window to give the session: otherwise it
+ * would reorder everything a second time, and could hold on to frames
+ * we had already given up waiting on.  rap is still filled in since
+ * the ADDBA response advertises rxa_wnd.
+ */
+int
+iwa_ampdu_rx_start(struct ieee80211_node *ni, struct ieee80211_rx_ampdu *rap,
+    int baparamset, int batimeout, int baseqctl)
+{
+	struct iwa_softc *sc = ni->ni_ic->ic_ifp->if_softc;
+	int bufsiz, error, ssn, tid;
+
+	tid = rap - ni->ni_rx_ampdu;
+	bufsiz = (baparamset & IEEE80211_BAPS_BUFSIZ) >>
+	    IEEE80211_BAPS_BUFSIZ_S;
+	ssn = (baseqctl & IEEE80211_BASEQ_START) >> IEEE80211_BASEQ_START_S;
+	if (bufsiz == 0 || bufsiz > IWA_RXBA_MAX_WINSIZE)
+		bufsiz = IWA_RXBA_MAX_WINSIZE;
+
+	IWA_LOCK(sc);
+	error = iwa_rxba_start(sc, ni->ni_macaddr, tid, ssn, bufsiz);
+	IWA_UNLOCK(sc);
+	if (error != 0)
+		return (sc->sc_ampdu_rx_start(ni, rap, baparamset, batimeout,
+		    baseqctl));
+
+	/* Not IEEE80211_AGGR_RUNNING/XCHGPEND: net80211 leaves it alone */
+	memset(rap, 0, sizeof(*rap));
+	rap->rxa_start = ssn;
+	rap->rxa_wnd = bufsiz;
+	return (0);
+}
+
+void
+iwa_ampdu_rx_stop(struct ieee80211_node *ni, struct ieee80211_rx_ampdu *rap)
+{
+	struct iwa_softc *sc = ni->ni_ic->ic_ifp->if_softc;
+	int tid;
+
+	tid = rap - ni->ni_rx_ampdu;
+	IWA_LOCK(sc);
+	iwa_rxba_stop(sc, ni->ni_macaddr, tid);
+	IWA_UNLOCK(sc);
+
+	/* In case net80211 ended up reordering this one itself */
+	sc->sc_ampdu_rx_stop(ni, rap);
+}
+
+void
+iwa_rxba_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "rxba", CTLFLAG_RD,
+	    NULL, "A-MPDU RX reorder buffer");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_INT(ctx, child, OID_AUTO, "sessions", CTLFLAG_RD,
+	    &sc->sc_rxba_nactive, 0, "active RX BA sessions");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "stored", CTLFLAG_RD,
+	    &sc->sc_rxba_stats.rs_stored, 0,
+	    "frames held for reordering");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "dup", CTLFLAG_RD,
+	    &sc->sc_rxba_stats.rs_dup, 0,
+	    "old or duplicate frames dropped");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "moves", CTLFLAG_RD,
+	    &sc->sc_rxba_stats.rs_moves, 0,
+	    "window moved forward by a new frame");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "bars", CTLFLAG_RD,
+	    &sc->sc_rxba_stats.rs_bars, 0,
+	    "window moved forward by a BlockAckReq");
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "timeouts", CTLFLAG_RD,
+	    &sc->sc_rxba_stats.rs_timeouts, 0,
+	    "held frames released by the timer");
+}
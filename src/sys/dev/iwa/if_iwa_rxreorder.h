@@ -0,0 +1,71 @@
+#ifndef	__IF_IWA_RXREORDER_H__
+#define	__IF_IWA_RXREORDER_H__
+
+/*
+ * A-MPDU RX reorder buffer.
+ *
+ * Each (transmitter, TID) with an RX block ack session gets a window
+ * of up to IWA_RXBA_MAX_WINSIZE frames.  Frames are held in a circular
+ * slot array indexed by the low bits of their sequence number; a
+ * bitmap of occupied slots lets the in-order run at the head of the
+ * window be found with a single ffs.  Frames are released to net80211
+ * in order as holes fill, when the window is pushed forward, or when
+ * the oldest held frame has waited IWA_RXBA_TIMEOUT.
+ */
+
+/* iwlwifi: mvm/sta.h; not among the headers imported into iwl/ */
+#ifndef	IWL_MAX_RX_BA_SESSIONS
+#define	IWL_MAX_RX_BA_SESSIONS	16
+#endif
+
+/* Slot array size; also the largest BA window we accept */
+#define	IWA_RXBA_MAX_WINSIZE	64
+
+/* How long a frame is held waiting for a hole to fill */
+#define	IWA_RXBA_TIMEOUT	(hz / 10)
+
+#define	IWA_RXBA_SEQ_MASK	0xfff
+
+struct iwa_softc;
+
+struct iwa_rxba {
+	struct iwa_softc	*ba_sc;
+	bool			ba_active;
+	bool			ba_delba;	/* peer still to be told */
+	uint8_t			ba_addr[IEEE80211_ADDR_LEN];
+	uint8_t			ba_tid;
+	uint16_t		ba_winsize;
+	uint16_t		ba_head;	/* SN at the window start */
+	int			ba_nstored;
+	uint64_t		ba_bitmap;	/* occupied slots */
+	struct mbuf		*ba_slot[IWA_RXBA_MAX_WINSIZE];
+	struct callout		ba_timer;
+};
+
+struct iwa_rxba_stats {
+	uint32_t	rs_stored;	/* frames held for reordering */
+	uint32_t	rs_dup;		/* old/duplicate frames dropped */
+	uint32_t	rs_moves;	/* window pushed forward */
+	uint32_t	rs_bars;	/* window moved by a BAR */
+	uint32_t	rs_timeouts;	/* held frames released by the timer */
+};
+
+extern	void iwa_rxba_init(struct iwa_softc *sc);
+extern	int iwa_rxba_start(struct iwa_softc *sc, const uint8_t *addr,
+	    int tid, uint16_t ssn, int winsize);
+extern	void iwa_rxba_stop(struct iwa_softc *sc, const uint8_t *addr,
+	    int tid);
+extern	void iwa_rxba_flush(struct iwa_softc *sc);
+extern	void iwa_rxba_teardown(struct iwa_softc *sc);
+extern	void iwa_rxba_drain(struct iwa_softc *sc);
+extern	struct mbuf *iwa_rxba_input(struct iwa_softc *sc, struct mbuf *m);
+
+extern	int iwa_ampdu_rx_start(struct ieee80211_node *ni,
+	    struct ieee80211_rx_ampdu *rap, int baparamset, int batimeout,
+	    int baseqctl);
+extern	void iwa_ampdu_rx_stop(struct ieee80211_node *ni,
+	    struct ieee80211_rx_ampdu *rap);
+extern	void iwa_rxba_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
+
+#endif	/* __IF_IWA_RXREORDER_H__ */
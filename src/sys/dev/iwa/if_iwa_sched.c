@@ -0,0 +1,811 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+/*
+ * Legacy rates, indexed by the PLCP value in rate_n_flags, in kbit/s.
+ */
+static const struct {
+	uint8_t		plcp;
+	uint32_t	kbps;
+} iwa_sched_legacy_rates[] = {
+	{ 10, 1000 },		/* CCK */
+	{ 20, 2000 },
+	{ 55, 5500 },
+	{ 110, 11000 },
+	{ 13, 6000 },		/* OFDM */
+	{ 15, 9000 },
+	{ 5, 12000 },
+	{ 7, 18000 },
+	{ 9, 24000 },
+	{ 11, 36000 },
+	{ 1, 48000 },
+	{ 3, 54000 },
+};
+
+/* HT MCS 0..7, single stream, 20MHz, long GI, in kbit/s */
+static const uint32_t iwa_sched_ht_rates[] = {
+	6500, 13000, 19500, 26000, 39000, 52000, 58500, 65000,
+};
+
+/*
+ * VHT MCS 0..9, single stream, 20MHz, long GI, in kbit/s.
+ * (MCS 9 isn't valid at 20MHz with one stream; it is at 40MHz.)
+ */
+static const uint32_t iwa_sched_vht_rates[] = {
+	6500, 13000, 19500, 26000, 39000, 52000, 58500, 65000, 78000, 86667,
+};
+
+/*
+ * Scale a 20MHz long GI HT/VHT rate for the channel width and guard
+ * interval in rate_n_flags.  The widths go by the number of data
+ * subcarriers: 52 at 20MHz, 108 at 40MHz, 234 at 80MHz, 468 at 160MHz.
+ */
+static uint32_t
+iwa_sched_rate_scale(uint32_t kbps, uint32_t rate_n_flags)
+{
+
+	switch (rate_n_flags & RATE_MCS_CHAN_WIDTH_MSK) {
+	case RATE_MCS_CHAN_WIDTH_40:
+		kbps = kbps * 27 / 13;
+		break;
+	case RATE_MCS_CHAN_WIDTH_80:
+		kbps = kbps * 9 / 2;
+		break;
+	case RATE_MCS_CHAN_WIDTH_160:
+		kbps = kbps * 9;
+		break;
+	}
+	if (rate_n_flags & RATE_MCS_SGI_MSK)
+		kbps = kbps * 10 / 9;
+	return (kbps);
+}
+
+/*
+ * Return the PHY rate for the given rate_n_flags, in kbit/s.
+ */
+static uint32_t
+iwa_sched_rate_kbps(uint32_t rate_n_flags)
+{
+#define	N(a)	(sizeof(a)/sizeof(a[0]))
+	uint32_t kbps;
+	int i, mcs, nss;
+
+	if (rate_n_flags & RATE_MCS_HT_MSK) {
+		kbps = iwa_sched_ht_rates[rate_n_flags &
+		    RATE_HT_MCS_RATE_CODE_MSK];
+		nss = ((rate_n_flags & RATE_HT_MCS_NSS_MSK) >>
+		    RATE_HT_MCS_NSS_POS) + 1;
+		return (iwa_sched_rate_scale(kbps * nss, rate_n_flags));
+	}
+
+	if (rate_n_flags & RATE_MCS_VHT_MSK) {
+		mcs = rate_n_flags & RATE_VHT_MCS_RATE_CODE_MSK;
+		nss = ((rate_n_flags & RATE_VHT_MCS_NSS_MSK) >>
+		    RATE_VHT_MCS_NSS_POS) + 1;
+		if (mcs < N(iwa_sched_vht_rates))
+			return (iwa_sched_rate_scale(
+			    iwa_sched_vht_rates[mcs] * nss, rate_n_flags));
+		/* Unknown MCS; as below */
+		return (6000);
+	}
+
+	for (i = 0; i < N(iwa_sched_legacy_rates); i++) {
+		if (iwa_sched_legacy_rates[i].plcp ==
+		    (rate_n_flags & RATE_LEGACY_RATE_MSK))
+			return (iwa_sched_legacy_rates[i].kbps);
+	}
+
+	/* Unknown; assume the slowest OFDM rate */
+	return (6000);
+#undef	N
+}
+
+/*
+ * Work out how much airtime a TX response accounts for, in usec.
+ *
+ * The firmware reports the actual medium time (including RTS/CTS,
+ * retries and the ACK/BA) in wireless_media_time; use that if it's
+ * there.  Otherwise estimate it from the rate, the number of frames
+ * and the number of attempts.
+ */
+static uint32_t
+iwa_sched_tx_airtime(const struct iwl_mvm_tx_resp *tx_resp)
+{
+	uint32_t airtime, kbps, len;
+	int nframes, tries;
+
+	airtime = le16toh(tx_resp->wireless_media_time);
+	if (airtime != 0)
+		return (airtime);
+
+	nframes = MAX(tx_resp->frame_count, 1);
+	tries = 1 + tx_resp->failure_frame;
+	len = le16toh(tx_resp->byte_cnt);
+	kbps = iwa_sched_rate_kbps(le32toh(tx_resp->initial_rate));
+
+	/* bits / (kbit/s) == msec; scale to usec */
+	airtime = (len * 8 * 1000) / kbps + IWA_SCHED_OVERHEAD;
+	return (airtime * nframes * tries);
+}
+
+void
+iwa_sched_init(struct iwa_softc *sc)
+{
+	struct iwa_sched *s = &sc->sc_sched;
+
+	memset(s, 0, sizeof(*s));
+	TAILQ_INIT(&s->s_active);
+	s->s_quantum = IWA_SCHED_QUANTUM;
+	s->s_maxqlen = IWA_SCHED_MAXQLEN;
+	s->s_aql_limit = IWA_SCHED_AQL_LIMIT;
+	s->s_codel_target = IWA_CODEL_TARGET;
+	s->s_codel_interval = IWA_CODEL_INTERVAL;
+}
+
+/*
+ * Current time in usec, for frame timestamps.  This wraps every
+ * ~71 minutes; all the comparisons below are wrap-safe.
+ */
+static uint32_t
+iwa_sched_now(void)
+{
+	struct timeval tv;
+
+	microuptime(&tv);
+	return ((uint32_t) tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+#define	IWA_TIME_AFTER_EQ(a, b)	((int32_t)((a) - (b)) >= 0)
+
+/* The enqueue timestamp lives in the driver-local pkthdr scratch space */
+#define	IWA_SCHED_TSTAMP(m)	((m)->m_pkthdr.PH_loc.thirtytwo[0])
+
+/*
+ * Free a list of frames, along with their node references.
+ */
+static void
+iwa_sched_free_frames(struct mbuf *m)
+{
+	struct ieee80211_node *ni;
+	struct mbuf *next;
+
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+		m_freem(m);
+		if (ni != NULL)
+			ieee80211_free_node(ni);
+	}
+}
+
+static void
+iwa_sched_deactivate(struct iwa_sched *s, struct iwa_sched_sta *ss)
+{
+
+	if (! ss->ss_active)
+		return;
+	TAILQ_REMOVE(&s->s_active, ss, ss_list);
+	ss->ss_active = false;
+	s->s_nactive--;
+}
+
+/*
+ * Toss everything queued for the given station (eg on disassociation.)
+ */
+void
+iwa_sched_flush_sta(struct iwa_softc *sc, int sta_id)
+{
+	struct iwa_sched *s = &sc->sc_sched;
+	struct iwa_sched_sta *ss = &s->s_sta[sta_id];
+	struct iwa_sched_tidq *tq;
+	int tid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (tid = 0; tid < IWA_TXQ_NUM_TIDS; tid++) {
+		tq = &ss->ss_tidq[tid];
+		iwa_sched_free_frames(tq->tq_head);
+		tq->tq_head = tq->tq_tail = NULL;
+		tq->tq_qlen = 0;
+		tq->tq_bytes = 0;
+		memset(&tq->tq_codel, 0, sizeof(tq->tq_codel));
+	}
+	ss->ss_qlen = 0;
+	ss->ss_deficit = 0;
+	iwa_sched_deactivate(s, ss);
+}
+
+/*
+ * Toss everything queued (eg on stop.)
+ */
+void
+iwa_sched_flush(struct iwa_softc *sc)
+{
+	int sta_id;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (sta_id = 0; sta_id < IWL_MVM_STATION_COUNT; sta_id++)
+		iwa_sched_flush_sta(sc, sta_id);
+}
+
+/*
+ * Queue a frame for the given station/TID.
+ *
+ * The frame (and the node reference in m_pkthdr.rcvif) is always
+ * consumed; if the TID queue is full it's dropped and ENOBUFS
+ * is returned.
+ */
+int
+iwa_sched_enqueue(struct iwa_softc *sc, int sta_id, int tid, struct mbuf *m)
+{
+	struct iwa_sched *s = &sc->sc_sched;
+	struct iwa_sched_sta *ss;
+	struct iwa_sched_tidq *tq;
+
+	IWA_LOCK_ASSERT(sc);
+
+	KASSERT(sta_id < IWL_MVM_STATION_COUNT && tid < IWA_TXQ_NUM_TIDS,
+	    ("%s: bad sta_id %d / tid %d", __func__, sta_id, tid));
+	ss = &s->s_sta[sta_id];
+	tq = &ss->ss_tidq[tid];
+
+	m->m_nextpkt = NULL;
+	if (tq->tq_qlen >= s->s_maxqlen) {
+		tq->tq_drops++;
+		iwa_sched_free_frames(m);
+		return (ENOBUFS);
+	}
+
+	IWA_SCHED_TSTAMP(m) = iwa_sched_now();
+	if (tq->tq_tail == NULL)
+		tq->tq_head = m;
+	else
+		tq->tq_tail->m_nextpkt = m;
+	tq->tq_tail = m;
+	tq->tq_qlen++;
+	tq->tq_bytes += m->m_pkthdr.len;
+	ss->ss_qlen++;
+
+	/* Newly backlogged stations go to the back of the line */
+	if (! ss->ss_active) {
+		TAILQ_INSERT_TAIL(&s->s_active, ss, ss_list);
+		ss->ss_active = true;
+		s->s_nactive++;
+	}
+	return (0);
+}
+
+static struct mbuf *
+iwa_sched_tidq_pop(struct iwa_sched_sta *ss, struct iwa_sched_tidq *tq)
+{
+	struct mbuf *m;
+
+	if ((m = tq->tq_head) == NULL)
+		return (NULL);
+	tq->tq_head = m->m_nextpkt;
+	if (tq->tq_head == NULL)
+		tq->tq_tail = NULL;
+	m->m_nextpkt = NULL;
+	tq->tq_qlen--;
+	tq->tq_bytes -= m->m_pkthdr.len;
+	ss->ss_qlen--;
+	return (m);
+}
+
+static void
+iwa_sched_sojourn_record(struct iwa_sched *s, int tid, uint32_t sojourn)
+{
+	int b;
+
+	sojourn >>= IWA_SCHED_HIST_MIN_SHIFT;
+	for (b = 0; sojourn != 0 && b < IWA_SCHED_HIST_BUCKETS - 1; b++)
+		sojourn >>= 1;
+	s->s_sojourn[tid][b]++;
+}
+
+/*
+ * Integer square root, for the CoDel control law.
+ */
+static uint32_t
+iwa_codel_isqrt(uint32_t x)
+{
+	uint32_t r, b;
+
+	r = 0;
+	for (b = 1U << 30; b > x; b >>= 2)
+		;
+	for (; b != 0; b >>= 2) {
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else
+			r >>= 1;
+	}
+	return (r);
+}
+
+static uint32_t
+iwa_codel_control_law(struct iwa_sched *s, uint32_t t, uint32_t count)
+{
+
+	return (t + s->s_codel_interval / MAX(iwa_codel_isqrt(count), 1));
+}
+
+/*
+ * Pop a frame from the TID queue and decide whether CoDel wants it
+ * dropped.  Returns the frame and sets *okp if it's OK to drop.
+ */
+static struct mbuf *
+iwa_codel_pop(struct iwa_sched *s, struct iwa_sched_sta *ss,
+    struct iwa_sched_tidq *tq, int tid, uint32_t now, bool *okp)
+{
+	struct iwa_codel *cd = &tq->tq_codel;
+	struct mbuf *m;
+	uint32_t sojourn;
+
+	*okp = false;
+	if ((m = iwa_sched_tidq_pop(ss, tq)) == NULL) {
+		cd->cd_first_above = 0;
+		return (NULL);
+	}
+
+	sojourn = now - IWA_SCHED_TSTAMP(m);
+	iwa_sched_sojourn_record(s, tid, sojourn);
+
+	/* Below target, or not enough queued to matter */
+	if (sojourn < s->s_codel_target || tq->tq_bytes <= ETHERMTU) {
+		cd->cd_first_above = 0;
+		return (m);
+	}
+
+	if (cd->cd_first_above == 0) {
+		/* 0 is "unset", so nudge it if we land on it */
+		cd->cd_first_above = (now + s->s_codel_interval) | 1;
+		return (m);
+	}
+
+	*okp = IWA_TIME_AFTER_EQ(now, cd->cd_first_above);
+	return (m);
+}
+
+/*
+ * CoDel dequeue for a single TID (RFC 8289 section 5.)
+ */
+static struct mbuf *
+iwa_sched_tidq_dequeue(struct iwa_sched *s, struct iwa_sched_sta *ss,
+    int tid)
+{
+	struct iwa_sched_tidq *tq = &ss->ss_tidq[tid];
+	struct iwa_codel *cd = &tq->tq_codel;
+	struct mbuf *m;
+	uint32_t now;
+	bool ok;
+
+	now = iwa_sched_now();
+	m = iwa_codel_pop(s, ss, tq, tid, now, &ok);
+	if (m == NULL) {
+		cd->cd_dropping = false;
+		return (NULL);
+	}
+
+	if (cd->cd_dropping) {
+		if (! ok) {
+			cd->cd_dropping = false;
+			return (m);
+		}
+		while (IWA_TIME_AFTER_EQ(now, cd->cd_drop_next)) {
+			tq->tq_codel_drops++;
+			iwa_sched_free_frames(m);
+			cd->cd_count++;
+			m = iwa_codel_pop(s, ss, tq, tid, now, &ok);
+			if (m == NULL || ! ok) {
+				cd->cd_dropping = false;
+				break;
+			}
+			cd->cd_drop_next = iwa_codel_control_law(s,
+			    cd->cd_drop_next, cd->cd_count);
+		}
+		return (m);
+	}
+
+	if (ok) {
+		tq->tq_codel_drops++;
+		iwa_sched_free_frames(m);
+		m = iwa_codel_pop(s, ss, tq, tid, now, &ok);
+		cd->cd_dropping = true;
+
+		/*
+		 * If we were dropping recently, pick up close to
+		 * where we left off rather than starting over.
+		 */
+		if (cd->cd_count > 2 &&
+		    (int32_t)(now - cd->cd_drop_next) <
+		    16 * s->s_codel_interval)
+			cd->cd_count -= 2;
+		else
+			cd->cd_count = 1;
+		cd->cd_drop_next = iwa_codel_control_law(s, now,
+		    cd->cd_count);
+	}
+	return (m);
+}
+
+/*
+ * Pick the next frame from a station's TID queues, round robin.
+ *
+ * TIDs whose hardware queue is full or at the airtime queue limit
+ * are skipped, as are TIDs with no hardware queue yet (one is
+ * requested.)  Returns NULL if everything is empty or blocked.
+ */
+static struct mbuf *
+iwa_sched_sta_dequeue(struct iwa_softc *sc, struct iwa_sched_sta *ss,
+    int sta_id, int *tidp)
+{
+	struct iwa_sched *s = &sc->sc_sched;
+	struct mbuf *m;
+	int i, qid, tid;
+
+	for (i = 0; i < IWA_TXQ_NUM_TIDS && ss->ss_qlen > 0; i++) {
+		tid = ss->ss_nexttid;
+		ss->ss_nexttid = (ss->ss_nexttid + 1) % IWA_TXQ_NUM_TIDS;
+
+		if (ss->ss_tidq[tid].tq_qlen == 0)
+			continue;
+
+		qid = iwa_txq_lookup(sc, sta_id, tid);
+		if (qid == IWA_TXQ_INVALID) {
+			iwa_txq_request(sc, sta_id, tid);
+			continue;
+		}
+
+		/* AQL: don't pile more onto a queue that's got plenty */
+		if (sc->txq[qid].bytes >= s->s_aql_limit ||
+		    (sc->qfullmsk & (1 << qid)))
+			continue;
+
+		m = iwa_sched_tidq_dequeue(s, ss, tid);
+		if (m != NULL) {
+			*tidp = tid;
+			return (m);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Return the next frame to transmit, or NULL if nothing is queued
+ * (or everything queued is held back; see iwa_sched_sta_dequeue().)
+ *
+ * The station at the head of the active list sends while it has
+ * a positive deficit; once it's used up its airtime it gets another
+ * quantum and goes to the back of the list.  The deficit is only
+ * charged when the TX response comes back.
+ */
+struct mbuf *
+iwa_sched_dequeue(struct iwa_softc *sc, int *sta_idp, int *tidp)
+{
+	struct iwa_sched *s = &sc->sc_sched;
+	struct iwa_sched_sta *ss;
+	struct mbuf *m;
+	int nblocked = 0, sta_id;
+
+	IWA_LOCK_ASSERT(sc);
+
+	while ((ss = TAILQ_FIRST(&s->s_active)) != NULL) {
+		if (ss->ss_deficit <= 0) {
+			ss->ss_deficit += s->s_quantum;
+			TAILQ_REMOVE(&s->s_active, ss, ss_list);
+			TAILQ_INSERT_TAIL(&s->s_active, ss, ss_list);
+			continue;
+		}
+
+		sta_id = ss - s->s_sta;
+		m = iwa_sched_sta_dequeue(sc, ss, sta_id, tidp);
+
+		/*
+		 * Idle stations don't get to bank airtime; drop
+		 * them off the list (keeping any debt) until they
+		 * have traffic again.
+		 */
+		if (ss->ss_qlen == 0) {
+			iwa_sched_deactivate(s, ss);
+			if (ss->ss_deficit > 0)
+				ss->ss_deficit = 0;
+		}
+
+		if (m != NULL) {
+			*sta_idp = sta_id;
+			return (m);
+		}
+
+		/* Everything this station has is held back */
+		if (ss->ss_active) {
+			if (++nblocked >= s->s_nactive)
+				break;
+			TAILQ_REMOVE(&s->s_active, ss, ss_list);
+			TAILQ_INSERT_TAIL(&s->s_active, ss, ss_list);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Charge a station for airtime used.
+ */
+void
+iwa_sched_charge(struct iwa_softc *sc, int sta_id, uint32_t airtime,
+    int nframes)
+{
+	struct iwa_sched_sta *ss;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (sta_id >= IWL_MVM_STATION_COUNT)
+		return;
+	ss = &sc->sc_sched.s_sta[sta_id];
+
+	ss->ss_deficit -= airtime;
+	ss->ss_airtime += airtime;
+	ss->ss_frames += nframes;
+}
+
+/*
+ * Charge the station a TX response is for.
+ */
+void
+iwa_sched_tx_resp(struct iwa_softc *sc, const struct iwl_mvm_tx_resp *tx_resp)
+{
+	uint32_t airtime;
+
+	airtime = iwa_sched_tx_airtime(tx_resp);
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: sta %d: %d frames, %d retries, rate 0x%08x -> %u usec\n",
+	    __func__,
+	    IWL_MVM_TX_RES_GET_RA(tx_resp->ra_tid),
+	    tx_resp->frame_count,
+	    tx_resp->failure_frame,
+	    le32toh(tx_resp->initial_rate),
+	    airtime);
+
+	iwa_sched_charge(sc, IWL_MVM_TX_RES_GET_RA(tx_resp->ra_tid), airtime,
+	    MAX(tx_resp->frame_count, 1));
+}
+
+/*
+ * A scheduler tunable which has to stay positive: a zero quantum
+ * would leave iwa_sched_dequeue() going round the station list
+ * forever, and CoDel divides by its interval.
+ *
+ * arg2 is the offset of the int in struct iwa_sched.
+ */
+static int
+iwa_sched_sysctl_posint(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	int *p, error, val;
+
+	p = (int *)((char *)&sc->sc_sched + arg2);
+	val = *p;
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (val <= 0)
+		return (EINVAL);
+
+	IWA_LOCK(sc);
+	*p = val;
+	IWA_UNLOCK(sc);
+	return (0);
+}
+
+static int
+iwa_sched_sysctl_stations(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct iwa_sched_sta *ss;
+	struct iwa_sched_tidq *tq;
+	struct sbuf sb;
+	int error, sta_id, tid;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+	sbuf_new_for_sysctl(&sb, NULL, 128, req);
+
+	IWA_LOCK(sc);
+	for (sta_id = 0; sta_id < IWL_MVM_STATION_COUNT; sta_id++) {
+		ss = &sc->sc_sched.s_sta[sta_id];
+		if (ss->ss_frames == 0 && ss->ss_qlen == 0)
+			continue;
+		sbuf_printf(&sb, "\nsta %d: qlen %d deficit %d airtime %ju"
+		    " frames %ju",
+		    sta_id, ss->ss_qlen, ss->ss_deficit,
+		    (uintmax_t) ss->ss_airtime, (uintmax_t) ss->ss_frames);
+		for (tid = 0; tid < IWA_TXQ_NUM_TIDS; tid++) {
+			tq = &ss->ss_tidq[tid];
+			if (tq->tq_qlen == 0 && tq->tq_drops == 0 &&
+			    tq->tq_codel_drops == 0)
+				continue;
+			sbuf_printf(&sb, "\n  tid %d: qlen %d bytes %d"
+			    " drops %u codel_drops %u%s",
+			    tid, tq->tq_qlen, tq->tq_bytes, tq->tq_drops,
+			    tq->tq_codel_drops,
+			    tq->tq_codel.cd_dropping ? " (dropping)" : "");
+		}
+	}
+	IWA_UNLOCK(sc);
+
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+/*
+ * Sojourn time histogram; one line per TID with traffic, one column
+ * per power-of-two bucket starting at 256us.
+ */
+static int
+iwa_sched_sysctl_sojourn(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct sbuf sb;
+	uint64_t *h;
+	int b, error, tid;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+	sbuf_new_for_sysctl(&sb, NULL, 256, req);
+
+	sbuf_printf(&sb, "\nusec:");
+	for (b = 0; b < IWA_SCHED_HIST_BUCKETS - 1; b++)
+		sbuf_printf(&sb, " <%d", 1 << (IWA_SCHED_HIST_MIN_SHIFT + b));
+	sbuf_printf(&sb, " >=%d",
+	    1 << (IWA_SCHED_HIST_MIN_SHIFT + IWA_SCHED_HIST_BUCKETS - 2));
+
+	IWA_LOCK(sc);
+	for (tid = 0; tid < IWA_TXQ_NUM_TIDS; tid++) {
+		h = sc->sc_sched.s_sojourn[tid];
+		for (b = 0; b < IWA_SCHED_HIST_BUCKETS; b++)
+			if (h[b] != 0)
+				break;
+		if (b == IWA_SCHED_HIST_BUCKETS)
+			continue;
+		sbuf_printf(&sb, "\ntid %d:", tid);
+		for (b = 0; b < IWA_SCHED_HIST_BUCKETS; b++)
+			sbuf_printf(&sb, " %ju", (uintmax_t) h[b]);
+	}
+	IWA_UNLOCK(sc);
+
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+void
+iwa_sched_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "sched", CTLFLAG_RD,
+	    NULL, "airtime fair TX scheduler");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "quantum",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, __offsetof(struct iwa_sched, s_quantum),
+	    iwa_sched_sysctl_posint, "I", "airtime quantum (usec)");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "maxqlen",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, __offsetof(struct iwa_sched, s_maxqlen),
+	    iwa_sched_sysctl_posint, "I", "per-TID queue limit (frames)");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "aql_limit",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, __offsetof(struct iwa_sched, s_aql_limit),
+	    iwa_sched_sysctl_posint, "I",
+	    "airtime queue limit per hardware queue (bytes)");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "codel_target",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, __offsetof(struct iwa_sched, s_codel_target),
+	    iwa_sched_sysctl_posint, "I", "CoDel target (usec)");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "codel_interval",
+	    CTLTYPE_INT | CTLFLAG_RW, sc, __offsetof(struct iwa_sched, s_codel_interval),
+	    iwa_sched_sysctl_posint, "I", "CoDel interval (usec)");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "stations",
+	    CTLTYPE_STRING | CTLFLAG_RD, sc, 0, iwa_sched_sysctl_stations,
+	    "A", "per-station airtime and queue accounting");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "sojourn",
+	    CTLTYPE_STRING | CTLFLAG_RD, sc, 0, iwa_sched_sysctl_sojourn,
+	    "A", "per-TID queue sojourn time histogram");
+}
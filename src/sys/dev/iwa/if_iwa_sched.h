@@ -0,0 +1,115 @@
+#ifndef	__IF_IWA_SCHED_H__
+#define	__IF_IWA_SCHED_H__
+
+/*
+ * Airtime fair TX scheduler.
+ *
+ * Frames are held per-station/TID in front of the hardware queues and
+ * stations are handed out by deficit round robin, where the deficit
+ * is airtime (in microseconds) rather than bytes.  TIDs within a
+ * station are served round robin.  Each station is charged the
+ * airtime the firmware reports in the TX response (or an estimate
+ * from the rate, frame count and retries if it doesn't) so a slow
+ * station can't monopolise the medium.
+ *
+ * To keep latency down the hardware queues are only fed while they
+ * hold less than the airtime queue limit (in bytes); the rest waits
+ * in the per-TID queues where CoDel can manage it.
+ */
+
+/* Airtime added to a station's deficit each round, in usec */
+#define	IWA_SCHED_QUANTUM	300
+
+/* Per-TID software queue limit, in frames; a backstop for CoDel */
+#define	IWA_SCHED_MAXQLEN	256
+
+/* Per-frame overhead for the airtime estimate (preamble, SIFS, ACK) */
+#define	IWA_SCHED_OVERHEAD	100
+
+/*
+ * Airtime queue limit: bytes allowed on a hardware queue before
+ * we stop feeding it.  Enough for a 64 frame A-MPDU of 1KB frames;
+ * anything more just adds latency that CoDel can't see.
+ */
+#define	IWA_SCHED_AQL_LIMIT	(64 * 1024)
+
+/*
+ * CoDel (RFC 8289) parameters, in usec.
+ *
+ * Frames are timestamped on enqueue; if the sojourn time stays
+ * above the target for an interval, frames are dropped at the head
+ * at an increasing rate until it comes back down.
+ */
+#define	IWA_CODEL_TARGET	5000
+#define	IWA_CODEL_INTERVAL	100000
+
+/* Sojourn time histogram buckets: < 256us, < 512us, ... , >= 256ms */
+#define	IWA_SCHED_HIST_MIN_SHIFT	8
+#define	IWA_SCHED_HIST_BUCKETS		12
+
+struct iwa_codel {
+	bool		cd_dropping;
+	uint32_t	cd_count;		/* drops this dropping state */
+	uint32_t	cd_first_above;		/* usec; 0 if below target */
+	uint32_t	cd_drop_next;		/* usec */
+};
+
+struct iwa_sched_tidq {
+	struct mbuf		*tq_head;	/* m_nextpkt linked frames */
+	struct mbuf		*tq_tail;
+	int			tq_qlen;
+	int			tq_bytes;
+	struct iwa_codel	tq_codel;
+
+	/* Statistics */
+	uint32_t		tq_drops;	/* queue full drops */
+	uint32_t		tq_codel_drops;	/* CoDel drops */
+};
+
+struct iwa_sched_sta {
+	TAILQ_ENTRY(iwa_sched_sta)	ss_list;
+	bool			ss_active;	/* on the active list */
+	int			ss_deficit;	/* usec */
+	int			ss_qlen;	/* frames over all TIDs */
+	int			ss_nexttid;	/* TID round robin */
+	struct iwa_sched_tidq	ss_tidq[IWA_TXQ_NUM_TIDS];
+
+	/* Statistics */
+	uint64_t		ss_airtime;	/* usec charged */
+	uint64_t		ss_frames;	/* frames completed */
+};
+
+struct iwa_sched {
+	TAILQ_HEAD(, iwa_sched_sta)	s_active;
+	int			s_nactive;
+	struct iwa_sched_sta	s_sta[IWL_MVM_STATION_COUNT];
+	int			s_quantum;
+	int			s_maxqlen;
+	int			s_aql_limit;
+	int			s_codel_target;
+	int			s_codel_interval;
+
+	/* Sojourn time histogram, per TID */
+	uint64_t		s_sojourn[IWA_TXQ_NUM_TIDS][IWA_SCHED_HIST_BUCKETS];
+};
+
+struct iwa_softc;
+struct iwl_mvm_tx_resp;
+struct sysctl_ctx_list;
+struct sysctl_oid_list;
+
+extern	void iwa_sched_init(struct iwa_softc *sc);
+extern	void iwa_sched_flush(struct iwa_softc *sc);
+extern	void iwa_sched_flush_sta(struct iwa_softc *sc, int sta_id);
+extern	int iwa_sched_enqueue(struct iwa_softc *sc, int sta_id, int tid,
+	    struct mbuf *m);
+extern	struct mbuf *iwa_sched_dequeue(struct iwa_softc *sc, int *sta_idp,
+	    int *tidp);
+extern	void iwa_sched_charge(struct iwa_softc *sc, int sta_id,
+	    uint32_t airtime, int nframes);
+extern	void iwa_sched_tx_resp(struct iwa_softc *sc,
+	    const struct iwl_mvm_tx_resp *tx_resp);
+extern	void iwa_sched_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
+
+#endif	/* __IF_IWA_SCHED_H__ */
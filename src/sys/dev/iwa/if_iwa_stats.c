@@ -0,0 +1,306 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+#include <machine/atomic.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+
+/*
+ * Counter delta; the firmware clears its counters on channel change
+ * and when asked to, so a counter going backwards has restarted.
+ */
+static uint32_t
+iwa_stats_delta(uint32_t new, uint32_t old)
+{
+
+	return (new >= old ? new - old : new);
+}
+
+#define	DELTA(field)							\
+	iwa_stats_delta(le32toh(cur->field), le32toh(prev->field))
+
+static void
+iwa_stats_compute(const struct iwl_notif_statistics *cur,
+    const struct iwl_notif_statistics *prev, int interval,
+    struct iwa_stats_rates *sr)
+{
+	uint32_t total;
+
+	memset(sr, 0, sizeof(*sr));
+	sr->sr_interval = interval;
+
+	sr->sr_crc_good = DELTA(rx.ofdm.crc32_good) +
+	    DELTA(rx.cck.crc32_good) + DELTA(rx.ofdm_ht.crc32_good);
+	sr->sr_crc_err = DELTA(rx.ofdm.crc32_err) +
+	    DELTA(rx.cck.crc32_err) + DELTA(rx.ofdm_ht.crc32_err);
+	sr->sr_plcp_err = DELTA(rx.ofdm.plcp_err) +
+	    DELTA(rx.cck.plcp_err) + DELTA(rx.ofdm_ht.plcp_err);
+	sr->sr_false_alarm = DELTA(rx.ofdm.false_alarm_cnt) +
+	    DELTA(rx.cck.false_alarm_cnt);
+
+	total = sr->sr_crc_good + sr->sr_crc_err;
+	if (total != 0)
+		sr->sr_crc_err_ratio =
+		    (uint64_t) sr->sr_crc_err * 1000 / total;
+	if (interval != 0)
+		sr->sr_false_alarm_rate =
+		    (uint64_t) sr->sr_false_alarm * 1000 / interval;
+
+	sr->sr_agg_cnt = DELTA(rx.ofdm_ht.agg_cnt);
+	sr->sr_agg_mpdu = DELTA(rx.ofdm_ht.agg_mpdu_cnt);
+	sr->sr_agg_crc_good = DELTA(rx.ofdm_ht.agg_crc32_good);
+	if (sr->sr_agg_cnt != 0)
+		sr->sr_agg_density =
+		    (uint64_t) sr->sr_agg_mpdu * 100 / sr->sr_agg_cnt;
+	if (sr->sr_agg_mpdu != 0)
+		sr->sr_agg_efficiency =
+		    (uint64_t) sr->sr_agg_crc_good * 1000 / sr->sr_agg_mpdu;
+
+	sr->sr_expected_ack = DELTA(tx.expected_ack_cnt);
+	sr->sr_actual_ack = DELTA(tx.actual_ack_cnt);
+	if (sr->sr_expected_ack != 0)
+		sr->sr_ack_ratio =
+		    (uint64_t) sr->sr_actual_ack * 1000 / sr->sr_expected_ack;
+	sr->sr_ba_timeout = DELTA(tx.agg.ba_timeout);
+}
+
+#undef	DELTA
+
+void
+iwa_stats_init(struct iwa_softc *sc)
+{
+
+	memset(&sc->sc_stats, 0, sizeof(sc->sc_stats));
+}
+
+/*
+ * Ingest a STATISTICS_NOTIFICATION.
+ *
+ * This requires the IWA lock to be held; it's the only writer.
+ */
+void
+iwa_stats_notif(struct iwa_softc *sc, const struct iwl_notif_statistics *stats)
+{
+	struct iwa_stats *st = &sc->sc_stats;
+	struct iwa_stats_snap *prev, *next;
+	int interval;
+
+	IWA_LOCK_ASSERT(sc);
+
+	prev = &st->st_buf[st->st_gen & 1];
+	next = &st->st_buf[(st->st_gen + 1) & 1];
+
+	/* The first notification has nothing to diff against */
+	if (st->st_notifs == 0)
+		interval = 0;
+	else
+		interval = ((uint64_t) (ticks - prev->ss_ticks) * 1000) / hz;
+
+	next->ss_ticks = ticks;
+	memcpy(&next->ss_fw, stats, sizeof(next->ss_fw));
+	if (st->st_notifs == 0)
+		memset(&next->ss_rates, 0, sizeof(next->ss_rates));
+	else
+		iwa_stats_compute(&next->ss_fw, &prev->ss_fw, interval,
+		    &next->ss_rates);
+
+	/* Publish */
+	atomic_store_rel_int(&st->st_gen, st->st_gen + 1);
+	st->st_notifs++;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_RX,
+	    "%s: crc_err %u/1000, false alarms %u/s, agg density %u\n",
+	    __func__, next->ss_rates.sr_crc_err_ratio,
+	    next->ss_rates.sr_false_alarm_rate,
+	    next->ss_rates.sr_agg_density);
+}
+
+/*
+ * Copy out the current snapshot without taking the driver lock.
+ */
+void
+iwa_stats_snapshot(struct iwa_softc *sc, struct iwa_stats_snap *ss)
+{
+	struct iwa_stats *st = &sc->sc_stats;
+	u_int gen;
+
+	do {
+		gen = atomic_load_acq_int(&st->st_gen);
+		memcpy(ss, &st->st_buf[gen & 1], sizeof(*ss));
+		atomic_thread_fence_acq();
+		/*
+		 * An update writes the other buffer, but the one after it
+		 * writes this one again - and that starts as soon as the
+		 * first is published.  So any change means a retry.
+		 */
+	} while (st->st_gen != gen);
+}
+
+static int
+iwa_stats_sysctl_rates(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct iwa_stats_snap *ss;
+	struct iwa_stats_rates *sr;
+	struct sbuf sb;
+	int error;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+
+	ss = malloc(sizeof(*ss), M_TEMP, M_WAITOK);
+	iwa_stats_snapshot(sc, ss);
+	sr = &ss->ss_rates;
+
+	sbuf_new_for_sysctl(&sb, NULL, 256, req);
+	sbuf_printf(&sb, "\ninterval %u ms", sr->sr_interval);
+	sbuf_printf(&sb, "\nrx: crc_good %u crc_err %u plcp_err %u"
+	    " false_alarm %u",
+	    sr->sr_crc_good, sr->sr_crc_err, sr->sr_plcp_err,
+	    sr->sr_false_alarm);
+	sbuf_printf(&sb, "\nrx: crc_err_ratio %u.%u%% false_alarms %u/s",
+	    sr->sr_crc_err_ratio / 10, sr->sr_crc_err_ratio % 10,
+	    sr->sr_false_alarm_rate);
+	sbuf_printf(&sb, "\nrx agg: ampdu %u mpdu %u good %u"
+	    " density %u.%02u efficiency %u.%u%%",
+	    sr->sr_agg_cnt, sr->sr_agg_mpdu, sr->sr_agg_crc_good,
+	    sr->sr_agg_density / 100, sr->sr_agg_density % 100,
+	    sr->sr_agg_efficiency / 10, sr->sr_agg_efficiency % 10);
+	sbuf_printf(&sb, "\ntx: expected_ack %u actual_ack %u"
+	    " ack_ratio %u.%u%% ba_timeout %u",
+	    sr->sr_expected_ack, sr->sr_actual_ack,
+	    sr->sr_ack_ratio / 10, sr->sr_ack_ratio % 10,
+	    sr->sr_ba_timeout);
+	free(ss, M_TEMP);
+
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+/*
+ * The raw firmware counters, as struct iwl_notif_statistics.
+ */
+static int
+iwa_stats_sysctl_raw(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct iwa_stats_snap *ss;
+	int error;
+
+	ss = malloc(sizeof(*ss), M_TEMP, M_WAITOK);
+	iwa_stats_snapshot(sc, ss);
+	error = SYSCTL_OUT(req, &ss->ss_fw, sizeof(ss->ss_fw));
+	free(ss, M_TEMP);
+	return (error);
+}
+
+void
+iwa_stats_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+	struct sysctl_oid *node;
+
+	node = SYSCTL_ADD_NODE(ctx, child, OID_AUTO, "fwstats", CTLFLAG_RD,
+	    NULL, "firmware statistics");
+	child = SYSCTL_CHILDREN(node);
+
+	SYSCTL_ADD_UINT(ctx, child, OID_AUTO, "notifications", CTLFLAG_RD,
+	    &sc->sc_stats.st_notifs, 0, "statistics notifications received");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "rates",
+	    CTLTYPE_STRING | CTLFLAG_RD, sc, 0, iwa_stats_sysctl_rates,
+	    "A", "deltas and rates over the last interval");
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "raw",
+	    CTLTYPE_OPAQUE | CTLFLAG_RD, sc, 0, iwa_stats_sysctl_raw,
+	    "S,iwl_notif_statistics", "last firmware statistics");
+}
@@ -0,0 +1,63 @@
+#ifndef	__IF_IWA_STATS_H__
+#define	__IF_IWA_STATS_H__
+
+/*
+ * Firmware statistics.
+ *
+ * Each STATISTICS_NOTIFICATION is turned into a snapshot holding the
+ * raw firmware counters plus the deltas/rates over the interval since
+ * the previous notification.  Snapshots are double buffered: the RX
+ * path fills in the spare buffer and then bumps the generation count,
+ * so readers can copy out the current one without taking the driver
+ * lock; they retry if the writer has lapped them.
+ */
+
+/* Deltas and rates over one notification interval */
+struct iwa_stats_rates {
+	uint32_t	sr_interval;	/* msec */
+
+	/* RX; OFDM + CCK + HT */
+	uint32_t	sr_crc_good;
+	uint32_t	sr_crc_err;
+	uint32_t	sr_plcp_err;
+	uint32_t	sr_false_alarm;
+	uint32_t	sr_crc_err_ratio;	/* errors per 1000 frames */
+	uint32_t	sr_false_alarm_rate;	/* per second */
+
+	/* RX aggregation */
+	uint32_t	sr_agg_cnt;		/* A-MPDUs */
+	uint32_t	sr_agg_mpdu;		/* MPDUs in them */
+	uint32_t	sr_agg_crc_good;
+	uint32_t	sr_agg_density;		/* MPDUs per A-MPDU x 100 */
+	uint32_t	sr_agg_efficiency;	/* good MPDUs per 1000 */
+
+	/* TX */
+	uint32_t	sr_expected_ack;
+	uint32_t	sr_actual_ack;
+	uint32_t	sr_ack_ratio;		/* ACKs per 1000 expected */
+	uint32_t	sr_ba_timeout;
+};
+
+struct iwa_stats_snap {
+	int				ss_ticks;	/* when received */
+	struct iwl_notif_statistics	ss_fw;		/* raw, little endian */
+	struct iwa_stats_rates		ss_rates;
+};
+
+struct iwa_stats {
+	volatile u_int		st_gen;		/* st_buf[st_gen & 1] is current */
+	uint32_t		st_notifs;	/* notifications received */
+	struct iwa_stats_snap	st_buf[2];
+};
+
+struct iwa_softc;
+
+extern	void iwa_stats_init(struct iwa_softc *sc);
+extern	void iwa_stats_notif(struct iwa_softc *sc,
+	    const struct iwl_notif_statistics *stats);
+extern	void iwa_stats_snapshot(struct iwa_softc *sc,
+	    struct iwa_stats_snap *ss);
+extern	void iwa_stats_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
+
+#endif	/* __IF_IWA_STATS_H__ */
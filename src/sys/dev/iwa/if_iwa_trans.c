@@ -27,10 +27,12 @@ __FBSDID("$FreeBSD$");
 #include <sys/param.h>
 #include <sys/sockio.h>
 #include <sys/sysctl.h>
+#include <sys/sbuf.h>
 #include <sys/mbuf.h>
 #include <sys/kernel.h>
 #include <sys/socket.h>
 #include <sys/systm.h>
+#include <sys/proc.h>
 #include <sys/malloc.h>
 #include <sys/bus.h>
 #include <sys/rman.h>
@@ -89,6 +91,12 @@ __FBSDID("$FreeBSD$");
 #include <dev/iwa/if_iwa_firmware.h>
 #include <dev/iwa/if_iwa_trans.h>
 #include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
 #include <dev/iwa/if_iwavar.h>
 #include <dev/iwa/if_iwareg.h>
 
@@ -132,7 +140,7 @@ iwa_write_prph(struct iwa_softc *sc, uint32_t addr, uint32_t val)
 }
 
 /* iwlwifi: pcie/trans.c */
-static int
+int
 iwa_read_mem(struct iwa_softc *sc, uint32_t addr, void *buf, int dwords)
 {
 	int offs, ret = 0;
@@ -221,21 +229,188 @@ iwa_clear_bit(struct iwa_softc *sc, int reg, uint32_t bit)
 	iwa_set_bits_mask(sc, reg, bit, 0);
 }
 
+/*
+ * Hardware waits.
+ */
+
+/* Spin this long before sleeping; most waits are done by then */
+#define	IWA_WAIT_SPIN_USEC	50
+#define	IWA_WAIT_SPIN_STEP	5
+
+/* Sleep between polls, backing off */
+#define	IWA_WAIT_NAP_MIN	(50 * SBT_1US)
+#define	IWA_WAIT_NAP_MAX	(1 * SBT_1MS)
+
+static const char *iwa_wait_site_names[IWA_WAIT_NSITES] = {
+	"poll_bit", "mac_access", "hw_ready", "clock_ready",
+	"master_disable", "tx_idle", "rx_idle", "fw_chunk",
+};
+
+/*
+ * Can this thread sleep?  Not during early boot, and not from the
+ * interrupt handler, which also stops the device.
+ */
+static bool
+iwa_wait_can_sleep(void)
+{
+
+	if (cold || SCHEDULER_STOPPED())
+		return (false);
+	return ((curthread->td_pflags & TDP_ITHREAD) == 0);
+}
+
+/*
+ * Sleep for roughly sbt.  If the IWA lock is held it's dropped for the
+ * duration, as with any other msleep() on it.
+ */
+static void
+iwa_wait_nap(struct iwa_softc *sc, sbintime_t sbt)
+{
+
+	if (mtx_owned(&sc->sc_mtx))
+		(void) msleep_sbt(&sc->sc_wait_stats, &sc->sc_mtx, 0,
+		    "iwawait", sbt, 0, 0);
+	else
+		pause_sbt("iwawait", sbt, 0, 0);
+}
+
+static void
+iwa_wait_account(struct iwa_softc *sc, int site, sbintime_t start,
+    bool ok, bool slept)
+{
+	struct iwa_wait_stats *ws = &sc->sc_wait_stats;
+	uint32_t usec, lim;
+	int b;
+
+	usec = (sbinuptime() - start) / SBT_1US;
+	for (b = 0, lim = 10; b < IWA_WAIT_NBUCKETS - 1 && usec >= lim; b++)
+		lim *= 10;
+	ws->ws_hist[site][b]++;
+	if (usec > ws->ws_max_usec[site])
+		ws->ws_max_usec[site] = usec;
+	if (! ok)
+		ws->ws_timeouts[site]++;
+	if (slept)
+		ws->ws_slept[site]++;
+}
+
+/*
+ * Wait up to timo microseconds for (reg & mask) == (bits & mask), or
+ * with IWA_WAIT_ANY, for any bit in mask to be set.
+ *
+ * This spins for the first IWA_WAIT_SPIN_USEC; after that, with
+ * IWA_WAIT_SLEEP and a context that can sleep, it sleeps between
+ * polls rather than burning the CPU.
+ *
+ * Sleeping drops the IWA lock, so IWA_WAIT_SLEEP is only for the
+ * bring-up path, which already sleeps on the lock waiting for the
+ * firmware.  Teardown (iwa_stop_device() and friends) spins: its
+ * callers expect the device to stop without anyone else getting in.
+ */
 bool
-iwa_poll_bit(struct iwa_softc *sc, int reg,
-	uint32_t bits, uint32_t mask, int timo)
+iwa_wait_bit(struct iwa_softc *sc, int site, int reg, uint32_t bits,
+    uint32_t mask, int timo, int flags)
 {
+	sbintime_t start, nap;
+	uint32_t r;
+	bool ok, slept;
+	int usec;
 
+	if (! iwa_wait_can_sleep())
+		flags &= ~IWA_WAIT_SLEEP;
+
+	start = sbinuptime();
+	nap = IWA_WAIT_NAP_MIN;
+	slept = false;
 	for (;;) {
-		if ((IWA_REG_READ(sc, reg) & mask) == (bits & mask)) {
-			return true;
+		r = IWA_REG_READ(sc, reg) & mask;
+		if ((flags & IWA_WAIT_ANY) ? r != 0 : r == (bits & mask)) {
+			ok = true;
+			break;
+		}
+		usec = (sbinuptime() - start) / SBT_1US;
+		if (usec >= timo) {
+			ok = false;
+			break;
 		}
-		if (timo < 10) {
-			return false;
+		if (usec < IWA_WAIT_SPIN_USEC || !(flags & IWA_WAIT_SLEEP)) {
+			DELAY(IWA_WAIT_SPIN_STEP);
+			continue;
 		}
-		timo -= 10;
-		DELAY(10);
+		iwa_wait_nap(sc, MIN(nap, (timo - usec) * SBT_1US));
+		nap = MIN(nap * 2, IWA_WAIT_NAP_MAX);
+		slept = true;
+	}
+
+	iwa_wait_account(sc, site, start, ok, slept);
+	return (ok);
+}
+
+/*
+ * A plain delay, which sleeps instead if it's allowed and worth it.
+ */
+void
+iwa_wait_usec(struct iwa_softc *sc, int usec, int flags)
+{
+
+	if ((flags & IWA_WAIT_SLEEP) && usec >= IWA_WAIT_SPIN_USEC &&
+	    iwa_wait_can_sleep())
+		iwa_wait_nap(sc, usec * SBT_1US);
+	else
+		DELAY(usec);
+}
+
+static int
+iwa_wait_sysctl_hist(SYSCTL_HANDLER_ARGS)
+{
+	struct iwa_softc *sc = arg1;
+	struct iwa_wait_stats ws;
+	struct sbuf sb;
+	int error, i, b;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+
+	IWA_LOCK(sc);
+	ws = sc->sc_wait_stats;
+	IWA_UNLOCK(sc);
+
+	sbuf_new_for_sysctl(&sb, NULL, 512, req);
+	sbuf_printf(&sb, "\n%-15s %8s %8s %8s %8s %8s %8s %7s %7s %8s",
+	    "site", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "more",
+	    "slept", "timeout", "max_us");
+	for (i = 0; i < IWA_WAIT_NSITES; i++) {
+		sbuf_printf(&sb, "\n%-15s", iwa_wait_site_names[i]);
+		for (b = 0; b < IWA_WAIT_NBUCKETS; b++)
+			sbuf_printf(&sb, " %8u", ws.ws_hist[i][b]);
+		sbuf_printf(&sb, " %7u %7u %8u", ws.ws_slept[i],
+		    ws.ws_timeouts[i], ws.ws_max_usec[i]);
 	}
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+void
+iwa_wait_sysctl_attach(struct iwa_softc *sc, struct sysctl_ctx_list *ctx,
+    struct sysctl_oid_list *child)
+{
+
+	SYSCTL_ADD_PROC(ctx, child, OID_AUTO, "wait_hist",
+	    CTLTYPE_STRING | CTLFLAG_RD, sc, 0, iwa_wait_sysctl_hist,
+	    "A", "hardware wait times by step");
+}
+
+/*
+ * Busy-wait up to timo microseconds; safe anywhere.
+ */
+bool
+iwa_poll_bit(struct iwa_softc *sc, int reg,
+	uint32_t bits, uint32_t mask, int timo)
+{
+
+	return (iwa_wait_bit(sc, IWA_WAIT_POLL, reg, bits, mask, timo, 0));
 }
 
 bool
@@ -245,9 +420,10 @@ iwa_grab_nic_access(struct iwa_softc *sc)
 
 	iwa_set_bit(sc, CSR_GP_CNTRL, CSR_GP_CNTRL_REG_FLAG_MAC_ACCESS_REQ);
 
-	if (iwa_poll_bit(sc, CSR_GP_CNTRL, CSR_GP_CNTRL_REG_VAL_MAC_ACCESS_EN,
+	if (iwa_wait_bit(sc, IWA_WAIT_MAC_ACCESS, CSR_GP_CNTRL,
+	    CSR_GP_CNTRL_REG_VAL_MAC_ACCESS_EN,
 	    CSR_GP_CNTRL_REG_FLAG_MAC_CLOCK_READY
-	     | CSR_GP_CNTRL_REG_FLAG_GOING_TO_SLEEP, 15000)) {
+	     | CSR_GP_CNTRL_REG_FLAG_GOING_TO_SLEEP, 15000, 0)) {
 	    	rv = true;
 	} else {
 		/* jolt */
@@ -439,6 +615,20 @@ iwa_free_ict(struct iwa_softc *sc)
 }
 
 
+/*
+ * Return the mbuf cluster size to use for an RX buffer of the given
+ * size.  The 9k jumbo clusters are physically contiguous so the
+ * buffer is still a single DMA segment.
+ */
+static int
+iwa_rbuf_clsize(size_t rbuf_size)
+{
+
+	if (rbuf_size <= MJUMPAGESIZE)
+		return (MJUMPAGESIZE);
+	return (MJUM9BYTES);
+}
+
 /*
  * Allocate an RX buffer for the given RX ring slot.
  *
@@ -450,22 +640,28 @@ int
 iwa_rx_addbuf(struct iwa_softc *sc, struct iwa_rx_ring *ring,
     size_t mbuf_size, int idx)
 {
+	struct iwa_rx_data *data = &ring->data[idx];
 	struct mbuf *m = NULL;
+	bus_dmamap_t map;
 	bus_addr_t paddr;
 	int error;
 
-	m = m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR, mbuf_size);
+	m = m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR, iwa_rbuf_clsize(mbuf_size));
 	if (m == NULL) {
 		device_printf(sc->sc_dev,
 		    "%s: could not allocate RX mbuf\n", __func__);
-		ring->data[idx].m = NULL;
 		error = ENOBUFS;
 		goto fail;
 	}
 	m->m_pkthdr.len = m->m_len = m->m_ext.ext_size;
 
-	error = bus_dmamap_load(ring->data_dmat, ring->data[idx].map,
-	    mtod(m, void *), IWA_RBUF_SIZE, iwa_dma_map_addr,
+	/*
+	 * Map the new buffer into the spare map first; if that
+	 * fails the old buffer is left in the slot untouched and
+	 * the caller can't give it away.
+	 */
+	error = bus_dmamap_load(ring->data_dmat, ring->spare_map,
+	    mtod(m, void *), mbuf_size, iwa_dma_map_addr,
 	    &paddr, BUS_DMA_NOWAIT);
 	if (error != 0 && error != EFBIG) {
 		device_printf(sc->sc_dev,
@@ -474,8 +670,21 @@ iwa_rx_addbuf(struct iwa_softc *sc, struct iwa_rx_ring *ring,
 		goto fail;
 	}
 
+	/* Unload the old buffer and swap the maps over */
+	if (data->m != NULL) {
+		bus_dmamap_sync(ring->data_dmat, data->map,
+		    BUS_DMASYNC_POSTREAD);
+		bus_dmamap_unload(ring->data_dmat, data->map);
+	}
+	map = data->map;
+	data->map = ring->spare_map;
+	ring->spare_map = map;
+
+	bus_dmamap_sync(ring->data_dmat, data->map, BUS_DMASYNC_PREREAD);
+
 	/* Set mbuf */
-	ring->data[idx].m = m;
+	data->m = m;
+	data->paddr = paddr;
 	/* Set physical address of RX buffer (256-byte aligned). */
 	ring->desc[idx] = htole32(paddr >> 8);
 
@@ -487,6 +696,129 @@ fail:
 }
 
 /* and finally, the rx/tx ring alloc/reset/free routines */
+/*
+ * Top up the RX buffer reserve.
+ *
+ * Returns 0 if the reserve is full, ENOBUFS if it couldn't be filled.
+ */
+static int
+iwa_rx_reserve_fill(struct iwa_softc *sc, struct iwa_rx_ring *ring)
+{
+	struct iwa_rx_data *r;
+	struct mbuf *m;
+	bus_addr_t paddr;
+	int error;
+
+	while (ring->nreserve < IWA_RX_RESERVE_COUNT) {
+		r = &ring->reserve[ring->nreserve];
+		m = m_getjcl(M_NOWAIT, MT_DATA, M_PKTHDR,
+		    iwa_rbuf_clsize(sc->sc_rbuf_size));
+		if (m == NULL) {
+			sc->sc_rx_stats.rx_reserve_fail++;
+			return (ENOBUFS);
+		}
+		m->m_pkthdr.len = m->m_len = m->m_ext.ext_size;
+
+		error = bus_dmamap_load(ring->data_dmat, r->map,
+		    mtod(m, void *), sc->sc_rbuf_size, iwa_dma_map_addr,
+		    &paddr, BUS_DMA_NOWAIT);
+		if (error != 0) {
+			m_freem(m);
+			sc->sc_rx_stats.rx_reserve_fail++;
+			return (ENOBUFS);
+		}
+		bus_dmamap_sync(ring->data_dmat, r->map, BUS_DMASYNC_PREREAD);
+
+		r->m = m;
+		r->paddr = paddr;
+		ring->nreserve++;
+	}
+	return (0);
+}
+
+/*
+ * Take the buffer out of the given RX ring slot so it can be handed
+ * up; the slot is refilled by iwa_rx_restock().
+ *
+ * Returns NULL if the reserve can't cover another empty slot; the
+ * caller should copy the frame out instead.
+ */
+struct mbuf *
+iwa_rx_take(struct iwa_softc *sc, struct iwa_rx_ring *ring, int idx)
+{
+	struct iwa_rx_data *data = &ring->data[idx];
+	struct mbuf *m;
+
+	if (ring->nempty >= ring->nreserve || data->m == NULL)
+		return (NULL);
+
+	m = data->m;
+	bus_dmamap_sync(ring->data_dmat, data->map, BUS_DMASYNC_POSTREAD);
+	bus_dmamap_unload(ring->data_dmat, data->map);
+	data->m = NULL;
+	ring->nempty++;
+
+	return (m);
+}
+
+/*
+ * Refill a single empty slot from the reserve.
+ */
+static void
+iwa_rx_restock_slot(struct iwa_rx_ring *ring, int idx)
+{
+	struct iwa_rx_data *data = &ring->data[idx];
+	struct iwa_rx_data *r;
+	bus_dmamap_t map;
+
+	KASSERT(ring->nreserve > 0, ("%s: reserve empty", __func__));
+
+	r = &ring->reserve[--ring->nreserve];
+	map = data->map;
+	data->map = r->map;
+	r->map = map;
+	data->m = r->m;
+	data->paddr = r->paddr;
+	r->m = NULL;
+	ring->desc[idx] = htole32(data->paddr >> 8);
+	ring->nempty--;
+}
+
+/*
+ * Restock the slots processed since the last call, publish the new
+ * write pointer if it has moved on by a group, and top up the reserve.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_rx_restock(struct iwa_softc *sc, struct iwa_rx_ring *ring)
+{
+	int wptr;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (; ring->restock != ring->cur;
+	    ring->restock = (ring->restock + 1) % IWA_RX_RING_COUNT) {
+		if (ring->data[ring->restock].m == NULL)
+			iwa_rx_restock_slot(ring, ring->restock);
+	}
+
+	/*
+	 * Tell the firmware what we have processed.
+	 * Seems like the hardware gets upset unless we align
+	 * the write by 8??
+	 */
+	wptr = (ring->cur == 0) ? IWA_RX_RING_COUNT - 1 : ring->cur - 1;
+	wptr &= ~(IWA_RX_RESTOCK_GROUP - 1);
+	if (wptr != ring->wptr) {
+		IWA_REG_WRITE(sc, FH_RSCSR_CHNL0_WPTR, wptr);
+		ring->wptr = wptr;
+		sc->sc_rx_stats.rx_wptr_writes++;
+	}
+
+	(void) iwa_rx_reserve_fill(sc, ring);
+}
+
 int
 iwa_alloc_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring)
 {
@@ -518,7 +850,7 @@ iwa_alloc_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring)
         /* Create RX buffer DMA tag. */
         error = bus_dma_tag_create(sc->sc_dmat, 1, 0,
             BUS_SPACE_MAXADDR_32BIT, BUS_SPACE_MAXADDR, NULL, NULL,
-            IWA_RBUF_SIZE, 1, IWA_RBUF_SIZE, BUS_DMA_NOWAIT, NULL, NULL,
+            sc->sc_rbuf_size, 1, sc->sc_rbuf_size, BUS_DMA_NOWAIT, NULL, NULL,
             &ring->data_dmat);
         if (error != 0) {
                 device_printf(sc->sc_dev,
@@ -527,6 +859,15 @@ iwa_alloc_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring)
                 goto fail;
         }
 
+	error = bus_dmamap_create(ring->data_dmat, 0, &ring->spare_map);
+	if (error != 0) {
+		device_printf(sc->sc_dev,
+		    "%s: could not create RX spare DMA map, error %d\n",
+		    __func__,
+		    error);
+		goto fail;
+	}
+
 	/*
 	 * Allocate and map RX buffers.
 	 */
@@ -544,12 +885,32 @@ iwa_alloc_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring)
 			goto fail;
 		}
 
-		if ((error = iwa_rx_addbuf(sc, ring, IWA_RBUF_SIZE, i)) != 0) {
+		if ((error = iwa_rx_addbuf(sc, ring, sc->sc_rbuf_size,
+		    i)) != 0) {
 			device_printf(sc->sc_dev,
 			    "could not add mbuf to ring");
 			goto fail;
 		}
 	}
+
+	/* And the restock reserve */
+	for (i = 0; i < IWA_RX_RESERVE_COUNT; i++) {
+		error = bus_dmamap_create(ring->data_dmat, 0,
+		    &ring->reserve[i].map);
+		if (error != 0) {
+			device_printf(sc->sc_dev,
+			    "%s: could not create RX reserve DMA map, error %d\n",
+			    __func__,
+			    error);
+			goto fail;
+		}
+	}
+	ring->nreserve = ring->nempty = ring->restock = 0;
+	if ((error = iwa_rx_reserve_fill(sc, ring)) != 0) {
+		device_printf(sc->sc_dev,
+		    "%s: could not fill RX reserve\n", __func__);
+		goto fail;
+	}
 	return 0;
 
 fail:	iwa_free_rx_ring(sc, ring);
@@ -559,23 +920,27 @@ fail:	iwa_free_rx_ring(sc, ring);
 void
 iwa_reset_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring)
 {
-	int ntries;
 
 	if (iwa_grab_nic_access(sc)) {
 		IWA_REG_WRITE(sc, FH_MEM_RCSR_CHNL0_CONFIG_REG, 0);
-		for (ntries = 0; ntries < 1000; ntries++) {
-			if (IWA_REG_READ(sc, FH_MEM_RSSR_RX_STATUS_REG) &
-			    FH_RSSR_CHNL0_RX_STATUS_CHNL_IDLE)
-				break;
-			DELAY(10);
-		}
-		if (ntries == 1000) {
+		if (!iwa_wait_bit(sc, IWA_WAIT_RX_IDLE,
+		    FH_MEM_RSSR_RX_STATUS_REG,
+		    FH_RSSR_CHNL0_RX_STATUS_CHNL_IDLE,
+		    FH_RSSR_CHNL0_RX_STATUS_CHNL_IDLE, 10000, 0)) {
 			device_printf(sc->sc_dev,
 			    "unable to detect idle rx chan after reset\n");
 		}
 		iwa_release_nic_access(sc);
 	}
+
+	/* Fill in any slots still waiting for a buffer */
+	for (ring->restock = 0; ring->restock < IWA_RX_RING_COUNT;
+	    ring->restock++) {
+		if (ring->data[ring->restock].m == NULL)
+			iwa_rx_restock_slot(ring, ring->restock);
+	}
 	ring->cur = 0;
+	ring->restock = 0;
 }
 
 void
@@ -590,15 +955,41 @@ iwa_free_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring)
 		struct iwa_rx_data *data = &ring->data[i];
 
 		if (data->m != NULL) {
-			bus_dmamap_sync(sc->sc_dmat, data->map,
+			bus_dmamap_sync(ring->data_dmat, data->map,
 			    BUS_DMASYNC_POSTREAD);
-			bus_dmamap_unload(sc->sc_dmat, data->map);
+			bus_dmamap_unload(ring->data_dmat, data->map);
 			m_freem(data->m);
+			data->m = NULL;
+		}
+		if (data->map != NULL) {
+			bus_dmamap_destroy(ring->data_dmat, data->map);
+			data->map = NULL;
 		}
-		if (data->map != NULL)
-			bus_dmamap_destroy(sc->sc_dmat, data->map);
 	}
-	bus_dma_tag_destroy(ring->data_dmat);
+	if (ring->spare_map != NULL) {
+		bus_dmamap_destroy(ring->data_dmat, ring->spare_map);
+		ring->spare_map = NULL;
+	}
+	for (i = 0; i < IWA_RX_RESERVE_COUNT; i++) {
+		struct iwa_rx_data *r = &ring->reserve[i];
+
+		if (r->m != NULL) {
+			bus_dmamap_sync(ring->data_dmat, r->map,
+			    BUS_DMASYNC_POSTREAD);
+			bus_dmamap_unload(ring->data_dmat, r->map);
+			m_freem(r->m);
+			r->m = NULL;
+		}
+		if (r->map != NULL) {
+			bus_dmamap_destroy(ring->data_dmat, r->map);
+			r->map = NULL;
+		}
+	}
+	ring->nreserve = 0;
+	if (ring->data_dmat != NULL) {
+		bus_dma_tag_destroy(ring->data_dmat);
+		ring->data_dmat = NULL;
+	}
 }
 
 int
@@ -640,12 +1031,17 @@ iwa_alloc_tx_ring(struct iwa_softc *sc, struct iwa_tx_ring *ring, int qid)
 	}
 	ring->cmd = (void *) ring->cmd_dma.vaddr;
 
-	/* Allocate tag for the TX ring */
-	/* XXX why are we limiting maxsegs to num(bufs) - 1 here? */
+	/*
+	 * Allocate tag for the TX ring.
+	 *
+	 * TB0/TB1 hold the TX command and 802.11 header; the rest
+	 * of the TBs map the payload.  An A-MSDU is a chain of
+	 * subframe mbufs so allow for a full TFD worth of segments.
+	 */
 	error = bus_dma_tag_create(sc->sc_dmat, 1, 0,
-	    BUS_SPACE_MAXADDR_32BIT, BUS_SPACE_MAXADDR, NULL, NULL, MCLBYTES,
-	    IWL_NUM_OF_TBS - 1, MCLBYTES, BUS_DMA_NOWAIT, NULL, NULL,
-	    &ring->data_dmat);
+	    BUS_SPACE_MAXADDR_32BIT, BUS_SPACE_MAXADDR, NULL, NULL,
+	    IWA_TX_MAX_SIZE, IWA_TX_MAX_DATA_SEGS, IWA_TX_MAX_SEGSIZE,
+	    BUS_DMA_NOWAIT, NULL, NULL, &ring->data_dmat);
 	if (error != 0) {
 		device_printf(sc->sc_dev,
 		    "%s: could not create TX buf DMA tag, error %d\n",
@@ -686,11 +1082,17 @@ iwa_reset_tx_ring(struct iwa_softc *sc, struct iwa_tx_ring *ring)
 		struct iwa_tx_data *data = &ring->data[i];
 
 		if (data->m != NULL) {
+			struct ieee80211_node *ni;
+
 			bus_dmamap_sync(sc->sc_dmat, data->map,
 			    BUS_DMASYNC_POSTWRITE);
 			bus_dmamap_unload(sc->sc_dmat, data->map);
+			/* Data frames hold a node reference */
+			ni = (struct ieee80211_node *) data->m->m_pkthdr.rcvif;
 			m_freem(data->m);
 			data->m = NULL;
+			if (ni != NULL)
+				ieee80211_free_node(ni);
 		}
 	}
 	/* Clear TX descriptors. */
@@ -700,6 +1102,9 @@ iwa_reset_tx_ring(struct iwa_softc *sc, struct iwa_tx_ring *ring)
 	sc->qfullmsk &= ~(1 << ring->qid);
 	ring->queued = 0;
 	ring->cur = 0;
+	ring->bytes = 0;
+	ring->wd_ticks = 0;
+	ring->wd_stage = 0;
 }
 
 void
@@ -841,10 +1246,12 @@ iwa_set_hw_ready(struct iwa_softc *sc)
 int
 iwa_prepare_card_hw(struct iwa_softc *sc)
 {
+	sbintime_t start;
+	bool slept = false;
 	int rv = 0;
-	int t = 0;
 
-	if (!iwa_set_hw_ready(sc))
+	start = sbinuptime();
+	if (iwa_set_hw_ready(sc))
 		goto out;
 
 	/* If HW is not ready, prepare the conditions to check again */
@@ -853,13 +1260,14 @@ iwa_prepare_card_hw(struct iwa_softc *sc)
 	do {
 		if (iwa_set_hw_ready(sc))
 			goto out;
-		DELAY(200);
-		t += 200;
-	} while (t < 150000);
+		iwa_wait_usec(sc, 200, IWA_WAIT_SLEEP);
+		slept = true;
+	} while ((sbinuptime() - start) / SBT_1US < 150000);
 
 	rv = ETIMEDOUT;
 
  out:
+	iwa_wait_account(sc, IWA_WAIT_HW_READY, start, rv == 0, slept);
 	return rv;
 }
 
@@ -946,9 +1354,9 @@ iwa_apm_init(struct iwa_softc *sc)
 	 * device-internal resources is supported, e.g. iwl_write_prph()
 	 * and accesses to uCode SRAM.
 	 */
-	if (!iwa_poll_bit(sc, CSR_GP_CNTRL,
+	if (!iwa_wait_bit(sc, IWA_WAIT_CLOCK_READY, CSR_GP_CNTRL,
 	    CSR_GP_CNTRL_REG_FLAG_MAC_CLOCK_READY,
-	    CSR_GP_CNTRL_REG_FLAG_MAC_CLOCK_READY, 25000)) {
+	    CSR_GP_CNTRL_REG_FLAG_MAC_CLOCK_READY, 25000, IWA_WAIT_SLEEP)) {
 		device_printf(sc->sc_dev, "Failed to init the card\n");
 		goto out;
 	}
@@ -1005,9 +1413,9 @@ iwa_apm_stop(struct iwa_softc *sc)
 	/* stop device's busmaster DMA activity */
 	iwa_set_bit(sc, CSR_RESET, CSR_RESET_REG_FLAG_STOP_MASTER);
 
-	if (!iwa_poll_bit(sc, CSR_RESET,
+	if (!iwa_wait_bit(sc, IWA_WAIT_MASTER_DIS, CSR_RESET,
 	    CSR_RESET_REG_FLAG_MASTER_DISABLED,
-	    CSR_RESET_REG_FLAG_MASTER_DISABLED, 100))
+	    CSR_RESET_REG_FLAG_MASTER_DISABLED, 100, 0))
 		device_printf(sc->sc_dev,
 		    "Master Disable Timed Out, 100 usec\n");
 	IWA_DPRINTF(sc, IWA_DEBUG_TRACE, "%s: iwa apm stop\n", __func__);
@@ -1042,7 +1450,7 @@ iwa_start_hw(struct iwa_softc *sc)
 void
 iwa_stop_device(struct iwa_softc *sc)
 {
-	int chnl, ntries;
+	int chnl;
 	int qid;
 
 	/* tell the device to stop sending interrupts */
@@ -1055,20 +1463,23 @@ iwa_stop_device(struct iwa_softc *sc)
 
 	iwa_write_prph(sc, SCD_TXFACT, 0);
 
-	/* Stop all DMA channels. */
+	/*
+	 * Stop all DMA channels.
+	 *
+	 * These idle waits still busy-wait (up to 4ms a channel), as
+	 * does the RX one in iwa_reset_rx_ring(): they're under the IWA
+	 * lock and NIC access, which sleeping would give up part way
+	 * through the stop.  They're only timed, in wait_stats.
+	 */
 	if (iwa_grab_nic_access(sc)) {
 		for (chnl = 0; chnl < FH_TCSR_CHNL_NUM; chnl++) {
 			IWA_REG_WRITE(sc,
 			    FH_TCSR_CHNL_TX_CONFIG_REG(chnl), 0);
-			for (ntries = 0; ntries < 200; ntries++) {
-				uint32_t r;
-
-				r = IWA_REG_READ(sc, FH_TSSR_TX_STATUS_REG);
-				if (r & FH_TSSR_TX_STATUS_REG_MSK_CHNL_IDLE(chnl))
-					break;
-				DELAY(20);
-			}
-			if (ntries == 200) {
+			if (!iwa_wait_bit(sc, IWA_WAIT_TX_IDLE,
+			    FH_TSSR_TX_STATUS_REG,
+			    FH_TSSR_TX_STATUS_REG_MSK_CHNL_IDLE(chnl),
+			    FH_TSSR_TX_STATUS_REG_MSK_CHNL_IDLE(chnl), 4000,
+			    0)) {
 				device_printf(sc->sc_dev,
 				    "unable to detect idle tx "
 				    "chan after reset\n");
@@ -1228,9 +1639,31 @@ iwa_enable_txq(struct iwa_softc *sc, int qid, int fifo)
 	    fifo);
 }
 
+/*
+ * Reset the driver side read/write pointers of a TX queue to the
+ * given SSN.  The scheduler side is configured by the firmware
+ * (SCD_QUEUE_CFG) for everything but the command queue.
+ */
+int
+iwa_txq_set_ptrs(struct iwa_softc *sc, int qid, int ssn)
+{
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (!iwa_grab_nic_access(sc))
+		return EBUSY;
+
+	IWA_REG_WRITE(sc, HBUS_TARG_WRPTR, qid << 8 | (ssn & 0xff));
+	iwa_write_prph(sc, SCD_QUEUE_RDPTR(qid), ssn);
+
+	iwa_release_nic_access(sc);
+	return 0;
+}
+
 int
 iwa_nic_rx_init(struct iwa_softc *sc)
 {
+	uint32_t rb_size;
 
 	IWA_LOCK_ASSERT(sc);
 
@@ -1264,11 +1697,20 @@ iwa_nic_rx_init(struct iwa_softc *sc)
 	 *
 	 * It causes weird behavior.  YMMV.
 	 */
+	switch (sc->sc_rbuf_size) {
+	case IWA_RBUF_SIZE_8K:
+		rb_size = FH_RCSR_RX_CONFIG_REG_VAL_RB_SIZE_8K;
+		break;
+	default:
+		rb_size = FH_RCSR_RX_CONFIG_REG_VAL_RB_SIZE_4K;
+		break;
+	}
+
 	IWA_REG_WRITE(sc, FH_MEM_RCSR_CHNL0_CONFIG_REG,
 	    FH_RCSR_RX_CONFIG_CHNL_EN_ENABLE_VAL		  |
 	    FH_RCSR_CHNL0_RX_IGNORE_RXF_EMPTY			  |  /* HW bug */
 	    FH_RCSR_CHNL0_RX_CONFIG_IRQ_DEST_INT_HOST_VAL	  |
-	    FH_RCSR_RX_CONFIG_REG_VAL_RB_SIZE_4K		  |	/* 4096 byte frames */
+	    rb_size						  |
 	    RX_QUEUE_SIZE_LOG << FH_RCSR_RX_CONFIG_RBDCB_SIZE_POS);
 
 	IWA_REG_WRITE_1(sc, CSR_INT_COALESCING, IWL_HOST_INT_TIMEOUT_DEF);
@@ -1281,6 +1723,7 @@ iwa_nic_rx_init(struct iwa_softc *sc)
 	 * RBs), should be 8 after preparing the first 8 RBs (for example)
 	 */
 	IWA_REG_WRITE(sc, FH_RSCSR_CHNL0_WPTR, 8);
+	sc->rxq.wptr = 8;
 
 	iwa_release_nic_access(sc);
 
@@ -71,6 +71,9 @@ struct iwa_tx_ring {
         int                     qid;
         int                     queued;
         int                     cur;
+        int                     bytes;          /* data bytes queued (AQL) */
+        int                     wd_ticks;       /* last TX progress */
+        int                     wd_stage;       /* see iwa_tx_watchdog() */
 };
 
 /*
@@ -104,8 +107,29 @@ struct iwa_tx_ring_meta {
 
 #define IWA_RX_RING_COUNT       256
 #define IWA_RBUF_COUNT          (IWA_RX_RING_COUNT + 32)
-/* Linux driver optionally uses 8k buffer */
+
+/*
+ * RX buffer size.  The default is 4k; like the Linux driver an
+ * 8k buffer can be selected at attach time (hint.iwa.N.rbuf_size)
+ * so peers can send us 7935 byte A-MSDUs.  (Linux's 12k buffers are
+ * only of use with VHT, which we don't do.)
+ */
 #define IWA_RBUF_SIZE           4096
+#define IWA_RBUF_SIZE_8K        8192
+
+/*
+ * RX restock.
+ *
+ * Buffers handed up to net80211 leave their ring slot empty; the
+ * slots are refilled after each pass over the ring from a reserve of
+ * already mapped buffers, and the write pointer is only published to
+ * the hardware in whole groups of IWA_RX_RESTOCK_GROUP slots.  A
+ * buffer is only handed up if the reserve can cover it, so the ring
+ * never runs dry; the reserve itself is topped up (allocated and
+ * mapped) after the restock.
+ */
+#define IWA_RX_RESERVE_COUNT    32
+#define IWA_RX_RESTOCK_GROUP    8
 
 struct iwa_softc;
 struct iwa_rbuf {
@@ -117,6 +141,7 @@ struct iwa_rbuf {
 struct iwa_rx_data {
         struct mbuf     *m;
         bus_dmamap_t    map;
+        bus_addr_t      paddr;
         int             wantresp;
 };
 
@@ -128,7 +153,51 @@ struct iwa_rx_ring {
         struct iwl_rb_status    *stat;
         struct iwa_rx_data      data[IWA_RX_RING_COUNT];
 	bus_dma_tag_t           data_dmat;
+        bus_dmamap_t            spare_map;      /* for iwa_rx_addbuf() */
         int                     cur;
+
+        /* Restock state */
+        struct iwa_rx_data      reserve[IWA_RX_RESERVE_COUNT];
+        int                     nreserve;       /* loaded reserve buffers */
+        int                     nempty;         /* slots awaiting restock */
+        int                     restock;        /* next slot to restock */
+        int                     wptr;           /* published write pointer */
+};
+
+/*
+ * Hardware waits.
+ *
+ * Bring-up and teardown poll a handful of registers for the hardware
+ * to get somewhere.  iwa_wait_bit() spins for the first few
+ * microseconds, which covers the common case, then sleeps between
+ * polls if the caller allows it and the thread can sleep.  Only
+ * bring-up allows it, since sleeping drops the IWA lock.  How long
+ * each wait took is kept per step so the slow ones show up.
+ */
+enum iwa_wait_site {
+	IWA_WAIT_POLL = 0,		/* iwa_poll_bit() */
+	IWA_WAIT_MAC_ACCESS,
+	IWA_WAIT_HW_READY,
+	IWA_WAIT_CLOCK_READY,
+	IWA_WAIT_MASTER_DIS,
+	IWA_WAIT_TX_IDLE,
+	IWA_WAIT_RX_IDLE,
+	IWA_WAIT_FW_CHUNK,		/* polled firmware load */
+	IWA_WAIT_NSITES
+};
+
+/* <10us, <100us, <1ms, <10ms, <100ms, longer */
+#define	IWA_WAIT_NBUCKETS	6
+
+/* iwa_wait_bit() flags */
+#define	IWA_WAIT_SLEEP		0x01	/* may sleep (and drop the lock) */
+#define	IWA_WAIT_ANY		0x02	/* any of the bits will do */
+
+struct iwa_wait_stats {
+	uint32_t	ws_hist[IWA_WAIT_NSITES][IWA_WAIT_NBUCKETS];
+	uint32_t	ws_slept[IWA_WAIT_NSITES];
+	uint32_t	ws_timeouts[IWA_WAIT_NSITES];
+	uint32_t	ws_max_usec[IWA_WAIT_NSITES];
 };
 
 /* Bus method */
@@ -148,10 +217,13 @@ extern	void iwa_restore_interrupts(struct iwa_softc *sc);
 extern	void iwa_disable_interrupts(struct iwa_softc *sc);
 extern	bool iwa_grab_nic_access(struct iwa_softc *sc);
 extern	void iwa_release_nic_access(struct iwa_softc *sc);
+extern	int iwa_read_mem(struct iwa_softc *sc, uint32_t addr, void *buf,
+	    int dwords);
 extern	int iwa_nic_rx_init(struct iwa_softc *sc);
 extern	int iwa_nic_tx_init(struct iwa_softc *sc);
 extern	int iwa_nic_init(struct iwa_softc *sc);
 extern	int iwa_post_alive(struct iwa_softc *sc);
+extern	int iwa_txq_set_ptrs(struct iwa_softc *sc, int qid, int ssn);
 
 /* bus things that should go into if_iwareg.h */
 extern	void iwa_set_bit(struct iwa_softc *sc, int reg, uint32_t bit);
@@ -160,6 +232,11 @@ extern	void iwa_set_bits_mask(struct iwa_softc *sc, int reg, uint32_t mask,
 	    uint32_t bits);
 extern	bool iwa_poll_bit(struct iwa_softc *sc, int reg,
 	    uint32_t bits, uint32_t mask, int timo);
+extern	bool iwa_wait_bit(struct iwa_softc *sc, int site, int reg,
+	    uint32_t bits, uint32_t mask, int timo, int flags);
+extern	void iwa_wait_usec(struct iwa_softc *sc, int usec, int flags);
+extern	void iwa_wait_sysctl_attach(struct iwa_softc *sc,
+	    struct sysctl_ctx_list *ctx, struct sysctl_oid_list *child);
 
 extern	int iwa_alloc_fwmem(struct iwa_softc *sc);
 extern	void iwa_free_fwmem(struct iwa_softc *sc);
@@ -172,6 +249,9 @@ extern	void iwa_free_ict(struct iwa_softc *sc);
 extern	int iwa_rx_addbuf(struct iwa_softc *sc, struct iwa_rx_ring *ring,
 	    size_t mbuf_size, int idx);
 extern	int iwa_alloc_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring);
+extern	struct mbuf *iwa_rx_take(struct iwa_softc *sc, struct iwa_rx_ring *ring,
+	    int idx);
+extern	void iwa_rx_restock(struct iwa_softc *sc, struct iwa_rx_ring *ring);
 extern	void iwa_reset_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring);
 extern	void iwa_free_rx_ring(struct iwa_softc *sc, struct iwa_rx_ring *ring);
 extern	int iwa_alloc_tx_ring(struct iwa_softc *sc, struct iwa_tx_ring *ring,
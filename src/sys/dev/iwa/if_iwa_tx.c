@@ -0,0 +1,1162 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+
+
+
+/*
+ * Fill in a single TFD transfer buffer entry.
+ */
+static void
+iwa_tx_set_tb(struct iwl_tfd *desc, int idx, bus_addr_t paddr, int len)
+{
+	uint32_t addr_lo;
+
+	/* lo field is not aligned */
+	addr_lo = htole32((uint32_t)paddr);
+	memcpy(&desc->tbs[idx].lo, &addr_lo, sizeof(uint32_t));
+	desc->tbs[idx].hi_n_len = htole16(iwl_get_dma_hi_addr(paddr)
+	    | (len << 4));
+}
+
+/*
+ * Tell the scheduler how long the frame in the current slot is.
+ *
+ * The scheduler uses this to build A-MPDUs, so it has to cover the
+ * whole MPDU as transmitted - with an A-MSDU that is every subframe,
+ * not just the first TB.
+ *
+ * iwlwifi: iwl_pcie_txq_update_byte_cnt_tbl()
+ */
+static void
+iwa_update_sched(struct iwa_softc *sc, struct iwa_tx_ring *ring)
+{
+	struct iwlagn_scd_bc_tbl *scd_bc_tbl;
+	struct iwl_tx_cmd *tx;
+	uint16_t len, ent;
+	int idx = ring->cur;
+
+	scd_bc_tbl = (struct iwlagn_scd_bc_tbl *)sc->sched_dma.vaddr;
+	tx = (struct iwl_tx_cmd *)ring->cmd[idx].payload;
+
+	len = le16toh(tx->len) + IWA_TX_CRC_SIZE + IWA_TX_DELIMITER_SIZE;
+	switch (tx->sec_ctl & TX_CMD_SEC_MSK) {
+	case TX_CMD_SEC_CCM:
+		len += IEEE80211_WEP_MICLEN;
+		break;
+	case TX_CMD_SEC_TKIP:
+		len += IEEE80211_WEP_CRCLEN;
+		break;
+	case TX_CMD_SEC_WEP:
+		len += IEEE80211_WEP_IVLEN + IEEE80211_WEP_KIDLEN +
+		    IEEE80211_WEP_CRCLEN;
+		break;
+	}
+
+	ent = htole16(len | (tx->sta_id << 12));
+	scd_bc_tbl[ring->qid].tfd_offset[idx] = ent;
+
+	/* The first entries are duplicated past the end of the table */
+	if (idx < TFD_QUEUE_SIZE_BC_DUP)
+		scd_bc_tbl[ring->qid].tfd_offset[TFD_QUEUE_SIZE_MAX + idx] = ent;
+
+	bus_dmamap_sync(sc->sc_dmat, sc->sched_dma.map, BUS_DMASYNC_PREWRITE);
+}
+
+/*
+ * Map a data frame into the current TX ring slot and kick the ring.
+ *
+ * The caller has already built the TX command (and copied the 802.11
+ * header in after it) in ring->cmd[ring->cur]; cmdlen is the length of
+ * that, including the command header.  The 802.11 header has been
+ * stripped from the mbuf.
+ *
+ * TB0 is the first IWA_TX_TB0_SIZE bytes of the command, TB1 is the
+ * rest of the command plus the 802.11 header.  Each payload DMA segment
+ * (ie, each A-MSDU subframe) gets a TB of its own after that.
+ *
+ * The mbuf may be replaced (collapsed) so it's passed by reference.
+ * On error the mbuf is freed and *mp is set to NULL; the caller still
+ * owns the node reference.
+ *
+ * This requires the IWA lock to be held.
+ */
+int
+iwa_tx_ring_submit(struct iwa_softc *sc, struct iwa_tx_ring *ring,
+    struct mbuf **mp, int cmdlen)
+{
+	bus_dma_segment_t segs[IWA_TX_MAX_DATA_SEGS];
+	struct iwa_tx_data *data;
+	struct iwl_tfd *desc;
+	struct mbuf *m, *m1;
+	int error, i, nsegs;
+
+	IWA_LOCK_ASSERT(sc);
+
+	KASSERT(cmdlen > IWA_TX_TB0_SIZE &&
+	    cmdlen <= sizeof(struct iwl_device_cmd),
+	    ("%s: bad cmdlen %d", __func__, cmdlen));
+
+	m = *mp;
+	data = &ring->data[ring->cur];
+	desc = &ring->desc[ring->cur];
+
+	error = bus_dmamap_load_mbuf_sg(ring->data_dmat, data->map, m,
+	    segs, &nsegs, BUS_DMA_NOWAIT);
+	if (error == EFBIG) {
+		/* Too many subframes/fragments; squash the chain */
+		m1 = m_collapse(m, M_NOWAIT, IWA_TX_MAX_DATA_SEGS);
+		if (m1 == NULL) {
+			device_printf(sc->sc_dev,
+			    "%s: could not defrag mbuf\n", __func__);
+			error = ENOBUFS;
+			goto fail;
+		}
+		m = *mp = m1;
+		error = bus_dmamap_load_mbuf_sg(ring->data_dmat, data->map,
+		    m, segs, &nsegs, BUS_DMA_NOWAIT);
+	}
+	if (error != 0) {
+		device_printf(sc->sc_dev,
+		    "%s: can't map mbuf (error %d)\n", __func__, error);
+		goto fail;
+	}
+
+	data->m = m;
+	data->done = 0;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: qid=%d idx=%d len=%d nsegs=%d\n",
+	    __func__, ring->qid, ring->cur, m->m_pkthdr.len, nsegs);
+
+	/* TX command + 802.11 header */
+	iwa_tx_set_tb(desc, 0, data->cmd_paddr, IWA_TX_TB0_SIZE);
+	iwa_tx_set_tb(desc, 1, data->cmd_paddr + IWA_TX_TB0_SIZE,
+	    cmdlen - IWA_TX_TB0_SIZE);
+
+	/* Payload */
+	for (i = 0; i < nsegs; i++)
+		iwa_tx_set_tb(desc, i + 2, segs[i].ds_addr, segs[i].ds_len);
+	desc->num_tbs = 2 + nsegs;
+
+	bus_dmamap_sync(ring->data_dmat, data->map, BUS_DMASYNC_PREWRITE);
+	bus_dmamap_sync(sc->sc_dmat, ring->cmd_dma.map, BUS_DMASYNC_PREWRITE);
+	bus_dmamap_sync(sc->sc_dmat, ring->desc_dma.map, BUS_DMASYNC_PREWRITE);
+
+	iwa_update_sched(sc, ring);
+
+	/* Kick TX ring. */
+	ring->cur = (ring->cur + 1) % IWA_TX_RING_COUNT;
+	IWA_REG_WRITE(sc, HBUS_TARG_WRPTR, ring->qid << 8 | ring->cur);
+
+	/* Start the watchdog clock if the queue was idle */
+	if (ring->queued == 0) {
+		ring->wd_ticks = ticks;
+		ring->wd_stage = IWA_TXQ_WD_IDLE;
+	}
+
+	/* Airtime queue limit accounting; see iwa_sched_dequeue() */
+	ring->bytes += m->m_pkthdr.len;
+
+	/* Mark TX ring as full if we reach a certain threshold. */
+	if (++ring->queued > IWA_TX_RING_HIMARK)
+		sc->qfullmsk |= 1 << ring->qid;
+
+	return (0);
+
+fail:
+	m_freem(m);
+	*mp = NULL;
+	return (error);
+}
+
+/*
+ * Reclaim a completed TX ring slot.
+ *
+ * The node reference is held in m_pkthdr.rcvif (as net80211 passes
+ * it to us) and is released here.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_tx_reclaim(struct iwa_softc *sc, struct iwa_tx_ring *ring, int idx,
+    int status)
+{
+	struct iwa_tx_data *data = &ring->data[idx];
+	struct ieee80211_node *ni;
+	struct mbuf *m;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (data->m == NULL)
+		return;
+
+	bus_dmamap_sync(ring->data_dmat, data->map, BUS_DMASYNC_POSTWRITE);
+	bus_dmamap_unload(ring->data_dmat, data->map);
+
+	m = data->m;
+	data->m = NULL;
+	data->done = 1;
+	ring->bytes -= m->m_pkthdr.len;
+	ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+
+	if (m->m_flags & M_TXCB)
+		ieee80211_process_callback(ni, m, status);
+	m_freem(m);
+	if (ni != NULL)
+		ieee80211_free_node(ni);
+
+	KASSERT(ring->queued > 0, ("%s: qid %d: queued is 0", __func__,
+	    ring->qid));
+	ring->queued--;
+	if (ring->queued < IWA_TX_RING_LOMARK)
+		sc->qfullmsk &= ~(1 << ring->qid);
+
+	/* The queue is moving; reset the watchdog */
+	ring->wd_ticks = ticks;
+	ring->wd_stage = IWA_TXQ_WD_IDLE;
+}
+
+/*
+ * Handle a TX response (TX_CMD) notification.
+ *
+ * The station is charged for the airtime used and, for a single
+ * (non-aggregate) frame, the ring slot is reclaimed.  Aggregates
+ * are reclaimed from the block-ack notification; see iwa_tx_ba_notif().
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_tx_resp(struct iwa_softc *sc, struct iwl_rx_packet *pkt)
+{
+	struct iwl_mvm_tx_resp *tx_resp = (void *)(pkt + 1);
+	int qid, idx, status;
+
+	IWA_LOCK_ASSERT(sc);
+
+	qid = IWA_SEQ_TO_QID(le16toh(pkt->hdr.sequence));
+	idx = IWA_SEQ_TO_IDX(le16toh(pkt->hdr.sequence));
+	status = le16toh(tx_resp->status.status) & TX_STATUS_MSK;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: qid=%d idx=%d frames=%d status=0x%02x\n",
+	    __func__, qid, idx, tx_resp->frame_count, status);
+
+	if (qid >= sc->sc_cfg->base_params->num_of_queues ||
+	    qid == IWL_MVM_CMD_QUEUE) {
+		device_printf(sc->sc_dev, "%s: bogus qid %d\n",
+		    __func__, qid);
+		return;
+	}
+
+	iwa_sched_tx_resp(sc, tx_resp);
+
+	if (tx_resp->frame_count == 1)
+		iwa_tx_reclaim(sc, &sc->txq[qid], idx,
+		    (status == TX_STATUS_SUCCESS ||
+		     status == TX_STATUS_DIRECT_DONE) ? 0 : 1);
+
+	/* There's room (and airtime) again; push out anything waiting */
+	iwa_start_locked(sc);
+}
+
+/*
+ * Handle a block-ack (BA_NOTIF) notification: reclaim every slot of
+ * the aggregation queue up to (but not including) scd_ssn.
+ *
+ * The frames before scd_ssn are the ones the firmware is done with,
+ * acked or not; per-frame status isn't tracked, so they're all
+ * completed as sent.  The airtime was charged from the aggregate's
+ * TX response.
+ *
+ * iwlwifi: iwl_mvm_rx_ba_notif(), iwl_trans_reclaim()
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_tx_ba_notif(struct iwa_softc *sc, struct iwl_rx_packet *pkt)
+{
+	struct iwl_mvm_ba_notif *ba_notif = (void *)(pkt + 1);
+	struct iwa_tx_ring *ring;
+	int idx, n, qid, ssn;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (iwl_rx_packet_payload_len(pkt) < sizeof(*ba_notif)) {
+		device_printf(sc->sc_dev, "%s: short BA notification\n",
+		    __func__);
+		return;
+	}
+
+	qid = le16toh(ba_notif->scd_flow);
+	ssn = le16toh(ba_notif->scd_ssn) & (IWA_TX_RING_COUNT - 1);
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: sta=%d tid=%d qid=%d ssn=%d txed=%d acked=%d\n",
+	    __func__, ba_notif->sta_id, ba_notif->tid, qid, ssn,
+	    ba_notif->txed, ba_notif->txed_2_done);
+
+	if (qid >= sc->sc_cfg->base_params->num_of_queues ||
+	    qid == IWL_MVM_CMD_QUEUE) {
+		device_printf(sc->sc_dev, "%s: bogus qid %d\n",
+		    __func__, qid);
+		return;
+	}
+	ring = &sc->txq[qid];
+
+	/*
+	 * There's no read pointer; the frames still outstanding before
+	 * ssn are the unbroken run of occupied slots leading up to it.
+	 */
+	for (n = 0; n < ring->queued; n++) {
+		idx = (ssn - n - 1) & (IWA_TX_RING_COUNT - 1);
+		if (ring->data[idx].m == NULL)
+			break;
+	}
+
+	/* Oldest first, so the completions go up in order */
+	for (; n > 0; n--)
+		iwa_tx_reclaim(sc, ring, (ssn - n) & (IWA_TX_RING_COUNT - 1),
+		    0);
+
+	iwa_start_locked(sc);
+}
+
+/*
+ * Ask the firmware to flush the given TX queue.
+ *
+ * This is called from the watchdog callout so it can't sleep
+ * waiting for the response.
+ */
+static int
+iwa_txq_flush(struct iwa_softc *sc, int qid)
+{
+	struct iwl_tx_path_flush_cmd flush_cmd = {
+		.queues_ctl = htole32(1 << qid),
+		.flush_ctl = htole16(DUMP_TX_FIFO_FLUSH),
+	};
+
+	IWA_LOCK_ASSERT(sc);
+
+	return (iwa_mvm_send_cmd_pdu(sc, TXPATH_FLUSH, CMD_ASYNC,
+	    sizeof(flush_cmd), &flush_cmd));
+}
+
+/*
+ * TX queue watchdog callout.
+ *
+ * For each queue with frames pending, check how long it's been since
+ * anything completed.  The first time a queue times out it's flushed;
+ * if it's still stuck a timeout later (or the flush couldn't be sent)
+ * a firmware restart is scheduled.
+ *
+ * The callout runs with the IWA lock held.
+ */
+static void
+iwa_tx_watchdog(void *arg)
+{
+	struct iwa_softc *sc = arg;
+	struct iwa_tx_ring *ring;
+	int qid, timeout;
+	bool restart = false;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (sc->sc_inactive)
+		return;
+
+	timeout = (sc->sc_cfg->base_params->wd_timeout * hz) / 1000;
+
+	for (qid = 0; qid < sc->sc_cfg->base_params->num_of_queues; qid++) {
+		ring = &sc->txq[qid];
+
+		/* The command queue has its own timeout */
+		if (qid == IWL_MVM_CMD_QUEUE)
+			continue;
+		if (ring->queued == 0)
+			continue;
+		if (ticks - ring->wd_ticks < timeout)
+			continue;
+
+		sc->sc_txq_wd.wd_timeouts++;
+
+		if (ring->wd_stage == IWA_TXQ_WD_IDLE) {
+			device_printf(sc->sc_dev,
+			    "%s: qid %d stuck (%d queued); flushing\n",
+			    __func__, qid, ring->queued);
+			if (iwa_txq_flush(sc, qid) == 0) {
+				sc->sc_txq_wd.wd_flushes++;
+				ring->wd_stage = IWA_TXQ_WD_FLUSHED;
+				ring->wd_ticks = ticks;
+				continue;
+			}
+			sc->sc_txq_wd.wd_flush_fail++;
+		}
+
+		device_printf(sc->sc_dev,
+		    "%s: qid %d still stuck; restarting firmware\n",
+		    __func__, qid);
+		restart = true;
+		break;
+	}
+
+	if (restart) {
+		/* The restart task restarts the watchdog */
+		sc->sc_txq_wd.wd_restarts++;
+		taskqueue_enqueue(sc->sc_tq, &sc->sc_restart_task);
+		return;
+	}
+
+	/* Retry queue requests that couldn't be satisfied last time */
+	if (iwa_txq_pending(sc))
+		taskqueue_enqueue(sc->sc_tq, &sc->sc_tx_task);
+
+	callout_reset(&sc->sc_watchdog_to, IWA_TXQ_WD_INTERVAL,
+	    iwa_tx_watchdog, sc);
+}
+
+void
+iwa_tx_watchdog_start(struct iwa_softc *sc)
+{
+	int qid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (qid = 0; qid < sc->sc_cfg->base_params->num_of_queues; qid++) {
+		sc->txq[qid].wd_ticks = ticks;
+		sc->txq[qid].wd_stage = IWA_TXQ_WD_IDLE;
+	}
+	callout_reset(&sc->sc_watchdog_to, IWA_TXQ_WD_INTERVAL,
+	    iwa_tx_watchdog, sc);
+}
+
+void
+iwa_tx_watchdog_stop(struct iwa_softc *sc)
+{
+
+	IWA_LOCK_ASSERT(sc);
+
+	callout_stop(&sc->sc_watchdog_to);
+}
+
+/*
+ * A-MSDU aggregation.
+ */
+
+/*
+ * Return the maximum A-MSDU length the peer will accept for the
+ * given TID.
+ *
+ * An A-MSDU inside an A-MPDU is limited to a 4095 byte MPDU.
+ */
+static int
+iwa_amsdu_maxlen(struct ieee80211_node *ni, int tid)
+{
+	struct ieee80211_tx_ampdu *tap;
+	int maxlen;
+
+	if (ni->ni_htcap & IEEE80211_HTCAP_MAXAMSDU_7935)
+		maxlen = 7935;
+	else
+		maxlen = 3839;
+
+	tap = &ni->ni_tx_ampdu[TID_TO_WME_AC(tid)];
+	if (IEEE80211_AMPDU_RUNNING(tap))
+		maxlen = MIN(maxlen, IWA_AMSDU_MAX_AMPDU_LEN);
+
+	return (maxlen);
+}
+
+/*
+ * Pull the DA/SA out of the 802.11 header for the A-MSDU
+ * subframe header.
+ */
+static void
+iwa_amsdu_addrs(const struct ieee80211_frame *wh, const uint8_t **da,
+    const uint8_t **sa)
+{
+
+	switch (wh->i_fc[1] & IEEE80211_FC1_DIR_MASK) {
+	case IEEE80211_FC1_DIR_TODS:
+		*da = wh->i_addr3;
+		*sa = wh->i_addr2;
+		break;
+	case IEEE80211_FC1_DIR_FROMDS:
+		*da = wh->i_addr1;
+		*sa = wh->i_addr3;
+		break;
+	case IEEE80211_FC1_DIR_NODS:
+	default:
+		*da = wh->i_addr1;
+		*sa = wh->i_addr2;
+		break;
+	}
+}
+
+/*
+ * Return whether this (already 802.11 encapsulated, but not yet
+ * encrypted) frame can be part of an A-MSDU.
+ */
+bool
+iwa_amsdu_eligible(struct iwa_softc *sc, struct ieee80211_node *ni,
+    struct mbuf *m)
+{
+	const struct ieee80211_frame *wh;
+
+	if ((ni->ni_flags & IEEE80211_NODE_AMSDU_TX) == 0)
+		return (false);
+	if (m->m_flags & M_EAPOL)
+		return (false);
+	if (m->m_pkthdr.len > IWA_AMSDU_MAX_FRAMELEN)
+		return (false);
+
+	wh = mtod(m, const struct ieee80211_frame *);
+	if ((wh->i_fc[0] & IEEE80211_FC0_TYPE_MASK) != IEEE80211_FC0_TYPE_DATA)
+		return (false);
+	if ((wh->i_fc[0] & IEEE80211_FC0_SUBTYPE_QOS) == 0)
+		return (false);
+	if ((wh->i_fc[1] & IEEE80211_FC1_DIR_MASK) == IEEE80211_FC1_DIR_DSTODS)
+		return (false);
+	if (IEEE80211_IS_MULTICAST(wh->i_addr1))
+		return (false);
+
+	return (true);
+}
+
+/*
+ * Add a frame to the pending A-MSDU.
+ *
+ * If the frame doesn't fit in the pending A-MSDU (different RA/TID,
+ * too long, or out of subframes) then the pending A-MSDU is built
+ * and returned so the caller can transmit it; the new frame then
+ * starts a new A-MSDU.  Otherwise NULL is returned.
+ *
+ * The frame must have passed iwa_amsdu_eligible().
+ *
+ * This requires the IWA lock to be held.
+ */
+struct mbuf *
+iwa_amsdu_enqueue(struct iwa_softc *sc, struct ieee80211_node *ni,
+    struct mbuf *m)
+{
+	struct iwa_amsdu *am = &sc->sc_amsdu;
+	struct ieee80211_frame *wh;
+	struct mbuf *out = NULL;
+	int tid, sublen;
+
+	IWA_LOCK_ASSERT(sc);
+
+	wh = mtod(m, struct ieee80211_frame *);
+	tid = ieee80211_gettid(wh);
+	sublen = IWA_AMSDU_SUBHDR_LEN + m->m_pkthdr.len -
+	    ieee80211_hdrsize(wh);
+
+	if (am->am_ni != NULL &&
+	    (am->am_ni != ni || am->am_tid != tid ||
+	     am->am_nframes >= IWA_AMSDU_MAX_SUBFRAMES ||
+	     roundup2(am->am_len, 4) + sublen > am->am_maxlen))
+		out = iwa_amsdu_flush(sc);
+
+	m->m_nextpkt = NULL;
+	if (am->am_ni == NULL) {
+		am->am_ni = ni;
+		am->am_tid = tid;
+		am->am_maxlen = iwa_amsdu_maxlen(ni, tid);
+		am->am_head = am->am_tail = m;
+		am->am_nframes = 1;
+		am->am_len = sublen;
+	} else {
+		am->am_tail->m_nextpkt = m;
+		am->am_tail = m;
+		am->am_nframes++;
+		am->am_len = roundup2(am->am_len, 4) + sublen;
+	}
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: tid=%d nframes=%d len=%d maxlen=%d\n",
+	    __func__, tid, am->am_nframes, am->am_len, am->am_maxlen);
+
+	return (out);
+}
+
+/*
+ * Turn a single queued frame into an A-MSDU subframe:
+ * replace the 802.11 header with the DA/SA/length subframe header
+ * and pad it out to a 4 byte boundary if it isn't the last one.
+ * The amount of padding added is returned in *padp.
+ *
+ * The frame has already been demoted (no pkthdr.)
+ *
+ * Returns the subframe or NULL (and frees the frame) on error.
+ */
+static struct mbuf *
+iwa_amsdu_subframe(struct mbuf *m, int last, int *padp)
+{
+	static const uint8_t pad[4] = { 0, 0, 0, 0 };
+	const struct ieee80211_frame *wh;
+	const uint8_t *da, *sa;
+	uint8_t subhdr[IWA_AMSDU_SUBHDR_LEN];
+	uint16_t len;
+	int hdrlen, sublen;
+
+	wh = mtod(m, const struct ieee80211_frame *);
+	hdrlen = ieee80211_hdrsize(wh);
+	len = m_length(m, NULL) - hdrlen;
+
+	iwa_amsdu_addrs(wh, &da, &sa);
+	IEEE80211_ADDR_COPY(&subhdr[0], da);
+	IEEE80211_ADDR_COPY(&subhdr[IEEE80211_ADDR_LEN], sa);
+	be16enc(&subhdr[2 * IEEE80211_ADDR_LEN], len);
+
+	m_adj(m, hdrlen);
+	M_PREPEND(m, IWA_AMSDU_SUBHDR_LEN, M_NOWAIT);
+	if (m == NULL)
+		return (NULL);
+	memcpy(mtod(m, uint8_t *), subhdr, IWA_AMSDU_SUBHDR_LEN);
+
+	sublen = IWA_AMSDU_SUBHDR_LEN + len;
+	*padp = last ? 0 : roundup2(sublen, 4) - sublen;
+	if (*padp != 0 && m_append(m, *padp, pad) == 0) {
+		m_freem(m);
+		return (NULL);
+	}
+
+	return (m);
+}
+
+/*
+ * Build and return the pending A-MSDU, or NULL if nothing is pending.
+ *
+ * A single pending frame is returned as-is.  Otherwise the first
+ * frame's 802.11 header (with the A-MSDU present bit set in the QoS
+ * control field) is followed by a chain of subframes, one mbuf chain
+ * per subframe.  The returned frame holds a single node reference.
+ *
+ * Crypto encapsulation is done by the caller afterwards.
+ *
+ * This requires the IWA lock to be held.
+ */
+struct mbuf *
+iwa_amsdu_flush(struct iwa_softc *sc)
+{
+	struct iwa_amsdu *am = &sc->sc_amsdu;
+	struct ieee80211_frame *wh;
+	struct ieee80211_node *ni;
+	struct mbuf *m, *mh, *next;
+	int hdrlen, nframes, nsub, pad, subpad;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (am->am_ni == NULL)
+		return (NULL);
+
+	m = am->am_head;
+	nframes = am->am_nframes;
+	memset(am, 0, sizeof(*am));
+
+	if (nframes == 1)
+		return (m);
+
+	/* The A-MSDU header; this inherits the first frame's pkthdr */
+	mh = m_gethdr(M_NOWAIT, MT_DATA);
+	if (mh == NULL) {
+		device_printf(sc->sc_dev,
+		    "%s: couldn't allocate A-MSDU header; dropping %d frames\n",
+		    __func__, nframes);
+		for (; m != NULL; m = next) {
+			next = m->m_nextpkt;
+			m->m_nextpkt = NULL;
+			ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+			m_freem(m);
+			ieee80211_free_node(ni);
+		}
+		return (NULL);
+	}
+	wh = mtod(m, struct ieee80211_frame *);
+	hdrlen = ieee80211_hdrsize(wh);
+	m_copydata(m, 0, hdrlen, mtod(mh, caddr_t));
+	mh->m_len = hdrlen;
+	ieee80211_getqos(mtod(mh, struct ieee80211_frame *))[0] |=
+	    IEEE80211_QOS_AMSDU;
+	m_move_pkthdr(mh, m);
+
+	nsub = pad = 0;
+	for (; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+
+		/* Only the A-MSDU header keeps a node reference */
+		if (m->m_flags & M_PKTHDR) {
+			ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+			ieee80211_free_node(ni);
+			m_demote(m, 1);
+		}
+
+		m = iwa_amsdu_subframe(m, next == NULL, &subpad);
+		if (m == NULL) {
+			sc->sc_amsdu_drops++;
+			continue;
+		}
+		m_cat(mh, m);
+		pad = subpad;
+		nsub++;
+	}
+
+	/* Every subframe was dropped; there's nothing to send */
+	if (nsub == 0) {
+		ni = (struct ieee80211_node *) mh->m_pkthdr.rcvif;
+		m_freem(mh);
+		ieee80211_free_node(ni);
+		return (NULL);
+	}
+
+	m_fixhdr(mh);
+
+	/* If the last subframe was dropped, the new last one is padded */
+	if (pad != 0)
+		m_adj(mh, -pad);
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: A-MSDU: %d frames, len=%d\n",
+	    __func__, nframes, mh->m_pkthdr.len);
+
+	return (mh);
+}
+
+/*
+ * Free any pending A-MSDU frames (eg on stop.)
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_amsdu_drain(struct iwa_softc *sc)
+{
+	struct iwa_amsdu *am = &sc->sc_amsdu;
+	struct ieee80211_node *ni;
+	struct mbuf *m, *next;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (m = am->am_head; m != NULL; m = next) {
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+		m_freem(m);
+		if (ni != NULL)
+			ieee80211_free_node(ni);
+	}
+	memset(am, 0, sizeof(*am));
+}
+
+/*
+ * Data path.
+ *
+ * Frames from net80211 are queued per station/TID in the airtime
+ * scheduler (if_iwa_sched.c); iwa_start_locked() then pulls them out
+ * in airtime fair order, aggregates what it can into A-MSDUs and puts
+ * the result on the station/TID's hardware queue (if_iwa_txq.c.)
+ * It's run whenever frames are queued and whenever TX completions
+ * free up ring slots or airtime.
+ */
+
+/*
+ * Return the firmware station a frame for the given node goes to.
+ */
+static int
+iwa_tx_sta_id(struct ieee80211_node *ni)
+{
+	struct ieee80211vap *vap = ni->ni_vap;
+
+	if (ni == vap->iv_bss && vap->iv_state >= IEEE80211_S_AUTH)
+		return (IWA_STA_ID_AP);
+	return (IWA_STA_ID_AUX);
+}
+
+static int
+iwa_tx_tid(const struct ieee80211_frame *wh)
+{
+
+	if (IEEE80211_QOS_HAS_SEQ(wh))
+		return (ieee80211_gettid(wh));
+	return (IWA_TXQ_TID_NONQOS);
+}
+
+/*
+ * Return the rate_n_flags for a frame: the lowest mandatory rate for
+ * the band, on the first valid TX antenna.
+ *
+ * Nothing sets up a firmware rate scaling (LQ) table yet, so this is
+ * used for every frame rather than just management/multicast ones.
+ *
+ * iwlwifi: iwl_mvm_set_tx_cmd_rate()
+ */
+static uint32_t
+iwa_tx_rate(struct iwa_softc *sc, struct ieee80211_node *ni)
+{
+	uint32_t ant, rate;
+
+	if (IEEE80211_IS_CHAN_2GHZ(ni->ni_ic->ic_curchan))
+		rate = IWL_RATE_1M_PLCP | RATE_MCS_CCK_MSK;
+	else
+		rate = IWL_RATE_6M_PLCP;
+
+	ant = sc->sc_nvm.valid_tx_ant & -sc->sc_nvm.valid_tx_ant;
+	return (rate | (ant << RATE_MCS_ANT_POS));
+}
+
+/*
+ * Queue a frame in the scheduler for its station/TID.
+ *
+ * The frame and the node reference are consumed either way.
+ *
+ * This requires the IWA lock to be held.
+ */
+static int
+iwa_tx_enqueue(struct iwa_softc *sc, struct ieee80211_node *ni,
+    struct mbuf *m)
+{
+	const struct ieee80211_frame *wh;
+
+	IWA_LOCK_ASSERT(sc);
+
+	wh = mtod(m, const struct ieee80211_frame *);
+	m->m_pkthdr.rcvif = (void *) ni;
+	return (iwa_sched_enqueue(sc, iwa_tx_sta_id(ni), iwa_tx_tid(wh), m));
+}
+
+/*
+ * Build the TX command for a frame (or A-MSDU) and put it on the
+ * station/TID's queue.
+ *
+ * The frame and its node reference (m_pkthdr.rcvif) are consumed
+ * either way.
+ *
+ * iwlwifi: iwl_mvm_tx_mpdu(), iwl_mvm_set_tx_params()
+ *
+ * This requires the IWA lock to be held.
+ */
+static int
+iwa_tx_data(struct iwa_softc *sc, struct mbuf *m, int sta_id, int tid)
+{
+	struct ieee80211_node *ni;
+	struct ieee80211_frame *wh;
+	struct iwa_tx_ring *ring;
+	struct iwa_tx_data *data;
+	struct iwl_device_cmd *cmd;
+	struct iwl_tx_cmd *tx;
+	uint32_t flags;
+	int cmdlen, error, hdrlen, qid, type;
+
+	IWA_LOCK_ASSERT(sc);
+
+	ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+	wh = mtod(m, struct ieee80211_frame *);
+
+	/* The scheduler only hands out frames for TIDs with a queue */
+	qid = iwa_txq_lookup(sc, sta_id, tid);
+	if (qid == IWA_TXQ_INVALID) {
+		device_printf(sc->sc_dev,
+		    "%s: no queue for sta %d tid %d\n",
+		    __func__, sta_id, tid);
+		error = ENXIO;
+		goto fail;
+	}
+	ring = &sc->txq[qid];
+	data = &ring->data[ring->cur];
+
+	/* Software crypto; the firmware isn't given any keys */
+	if (wh->i_fc[1] & IEEE80211_FC1_WEP) {
+		if (ieee80211_crypto_encap(ni, m) == NULL) {
+			error = EIO;
+			goto fail;
+		}
+		wh = mtod(m, struct ieee80211_frame *);
+	}
+	type = wh->i_fc[0] & IEEE80211_FC0_TYPE_MASK;
+	hdrlen = ieee80211_anyhdrsize(wh);
+
+	cmd = &ring->cmd[ring->cur];
+	memset(cmd, 0, sizeof(cmd->hdr) + sizeof(*tx));
+	cmd->hdr.cmd = TX_CMD;
+	cmd->hdr.flags = 0;
+	cmd->hdr.sequence = htole16(IWA_IDX_QID_TO_SEQ(ring->cur, ring->qid));
+	tx = (struct iwl_tx_cmd *) cmd->payload;
+
+	/* net80211 has already assigned the sequence number */
+	flags = 0;
+	if (! IEEE80211_IS_MULTICAST(wh->i_addr1))
+		flags |= TX_CMD_FLG_ACK;
+
+	/* The 802.11 header follows the command, padded to 4 bytes */
+	memcpy(tx->payload, wh, hdrlen);
+	cmdlen = sizeof(cmd->hdr) + sizeof(*tx) + hdrlen;
+	if (hdrlen & 3) {
+		flags |= TX_CMD_FLG_MH_PAD;
+		cmdlen = roundup2(cmdlen, 4);
+	}
+
+	tx->len = htole16(m->m_pkthdr.len);
+	tx->tx_flags = htole32(flags);
+	tx->rate_n_flags = htole32(iwa_tx_rate(sc, ni));
+	tx->sta_id = sta_id;
+	tx->tid_tspec = (tid == IWA_TXQ_TID_NONQOS) ? IWL_TID_NON_QOS : tid;
+	tx->life_time = htole32(TX_CMD_LIFE_TIME_INFINITE);
+	tx->dram_lsb_ptr = htole32(data->scratch_paddr);
+	tx->dram_msb_ptr = iwl_get_dma_hi_addr(data->scratch_paddr);
+	tx->rts_retry_limit = IWL_RTS_DFAULT_RETRY_LIMIT;
+	tx->data_retry_limit = (type == IEEE80211_FC0_TYPE_DATA) ?
+	    IWL_DEFAULT_TX_RETRY : IWL_MGMT_DFAULT_RETRY_LIMIT;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: sta=%d tid=%d qid=%d len=%d hdrlen=%d\n",
+	    __func__, sta_id, tid, qid, m->m_pkthdr.len, hdrlen);
+
+	m_adj(m, hdrlen);
+	error = iwa_tx_ring_submit(sc, ring, &m, cmdlen);
+	if (error != 0) {
+		/* The mbuf is gone; the node reference isn't */
+		ieee80211_free_node(ni);
+		return (error);
+	}
+	return (0);
+
+fail:
+	m_freem(m);
+	ieee80211_free_node(ni);
+	return (error);
+}
+
+/*
+ * Hand frames from the scheduler to the hardware.
+ *
+ * This doesn't sleep: TIDs without a hardware queue are skipped by
+ * the scheduler and set up from iwa_tx_task(), which calls back
+ * in here once they're ready.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_start_locked(struct iwa_softc *sc)
+{
+	struct ieee80211_node *ni;
+	struct mbuf *m, *am;
+	int am_sta_id = 0, am_tid = 0, sta_id, tid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (sc->sc_inactive)
+		return;
+
+	while ((m = iwa_sched_dequeue(sc, &sta_id, &tid)) != NULL) {
+		ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+
+		if (! iwa_amsdu_eligible(sc, ni, m)) {
+			/* Keep the pending A-MSDU ahead of this frame */
+			if ((am = iwa_amsdu_flush(sc)) != NULL)
+				(void) iwa_tx_data(sc, am, am_sta_id, am_tid);
+			(void) iwa_tx_data(sc, m, sta_id, tid);
+			continue;
+		}
+
+		/*
+		 * This returns the pending A-MSDU if the frame didn't
+		 * fit; either way the frame is now (part of) the
+		 * pending one.
+		 */
+		am = iwa_amsdu_enqueue(sc, ni, m);
+		if (am != NULL)
+			(void) iwa_tx_data(sc, am, am_sta_id, am_tid);
+		am_sta_id = sta_id;
+		am_tid = tid;
+	}
+
+	if ((am = iwa_amsdu_flush(sc)) != NULL)
+		(void) iwa_tx_data(sc, am, am_sta_id, am_tid);
+}
+
+/*
+ * Deferred TX work: tear down and set up hardware queues (which
+ * sleeps waiting for the firmware), then send whatever was waiting
+ * for them.
+ */
+void
+iwa_tx_task(void *arg, int npending)
+{
+	struct iwa_softc *sc = arg;
+
+	IWA_LOCK(sc);
+	if (! sc->sc_inactive) {
+		iwa_txq_service(sc);
+		iwa_start_locked(sc);
+	}
+	IWA_UNLOCK(sc);
+}
+
+/*
+ * ifnet start method.  net80211 has already encapsulated the frames
+ * and stashed the node reference in m_pkthdr.rcvif.
+ */
+void
+iwa_start(struct ifnet *ifp)
+{
+	struct iwa_softc *sc = ifp->if_softc;
+	struct ieee80211_node *ni;
+	struct mbuf *m;
+
+	IWA_LOCK(sc);
+	for (;;) {
+		IFQ_DRV_DEQUEUE(&ifp->if_snd, m);
+		if (m == NULL)
+			break;
+		ni = (struct ieee80211_node *) m->m_pkthdr.rcvif;
+		if (sc->sc_inactive) {
+			m_freem(m);
+			ieee80211_free_node(ni);
+			ifp->if_oerrors++;
+			continue;
+		}
+		if (iwa_tx_enqueue(sc, ni, m) != 0)
+			ifp->if_oerrors++;
+	}
+	iwa_start_locked(sc);
+	IWA_UNLOCK(sc);
+}
+
+/*
+ * net80211 raw_xmit method (management frames, and frames injected
+ * via bpf.)
+ *
+ * The bpf TX parameters aren't supported yet; the frame is sent the
+ * same way as everything else.
+ */
+int
+iwa_raw_xmit(struct ieee80211_node *ni, struct mbuf *m,
+    const struct ieee80211_bpf_params *params)
+{
+	struct iwa_softc *sc = ni->ni_ic->ic_ifp->if_softc;
+	int error;
+
+	IWA_LOCK(sc);
+	if (sc->sc_inactive) {
+		IWA_UNLOCK(sc);
+		m_freem(m);
+		ieee80211_free_node(ni);
+		return (ENETDOWN);
+	}
+	error = iwa_tx_enqueue(sc, ni, m);
+	iwa_start_locked(sc);
+	IWA_UNLOCK(sc);
+	return (error);
+}
+
+/*
+ * net80211 newassoc method.
+ *
+ * The AP always goes in the same firmware station slot, so whatever
+ * a previous association left there (frames in the scheduler, its
+ * hardware queues) is thrown out.  Queue teardown sleeps so it's
+ * left to iwa_tx_task(); new frames wait for fresh queues.
+ */
+void
+iwa_newassoc(struct ieee80211_node *ni, int isnew)
+{
+	struct iwa_softc *sc = ni->ni_ic->ic_ifp->if_softc;
+
+	if (! isnew)
+		return;
+
+	IWA_LOCK(sc);
+	iwa_sched_flush_sta(sc, IWA_STA_ID_AP);
+	iwa_txq_remove_sta(sc, IWA_STA_ID_AP);
+	IWA_UNLOCK(sc);
+}
@@ -0,0 +1,122 @@
+#ifndef	__IF_IWA_TX_H__
+#define	__IF_IWA_TX_H__
+
+/*
+ * Data transmit path.
+ *
+ * The hardware TX command and 802.11 header live in the per-slot
+ * iwl_device_cmd buffer and are handed to the NIC in TB0/TB1.
+ * The frame payload is DMA mapped straight out of the mbuf chain;
+ * each mbuf in the chain becomes its own TB in the TFD.
+ */
+
+/* TB0 carries the first part of the TX command; see iwlwifi pcie/tx.c */
+#define	IWA_TX_TB0_SIZE		16
+
+/* TB0 + TB1 are used for the TX command and 802.11 header */
+#define	IWA_TX_MAX_DATA_SEGS	(IWL_NUM_OF_TBS - 2)
+
+/* The TFD can describe at most an 8KB frame (see iwl-fh.h) */
+#define	IWA_TX_MAX_SIZE		(8 * 1024)
+
+/* Each TB has a 12 bit length field */
+#define	IWA_TX_MAX_SEGSIZE	(4 * 1024 - 4)
+
+/* Added by the hardware; counted in the scheduler byte count table */
+#define	IWA_TX_CRC_SIZE		4
+#define	IWA_TX_DELIMITER_SIZE	4
+
+/*
+ * Firmware station ids.
+ *
+ * Only station mode is handled: the AP always gets station 0, and
+ * frames that don't go to it (probe requests, anything before
+ * authentication) go via the auxiliary station.
+ */
+#define	IWA_STA_ID_AP		0
+#define	IWA_STA_ID_AUX		(IWL_MVM_STATION_COUNT - 1)
+
+/*
+ * A-MSDU aggregation.
+ *
+ * Consecutive QoS data frames for the same RA/TID are held here
+ * until the next frame doesn't fit (different RA/TID, the peer's
+ * A-MSDU length limit, or out of TBs) or the TX path flushes at the
+ * end of a dequeue pass.
+ *
+ * The 802.11 header of the first frame becomes the A-MSDU header;
+ * every frame is turned into a subframe and the subframes are linked
+ * via m_next so the whole A-MSDU is loaded into a single DMA map.
+ * Each subframe then ends up as a separate TB in the TFD.
+ */
+#define	IWA_AMSDU_MAX_SUBFRAMES	IWA_TX_MAX_DATA_SEGS
+
+/* Subframe header: DA, SA, length */
+#define	IWA_AMSDU_SUBHDR_LEN	(2 * IEEE80211_ADDR_LEN + sizeof(uint16_t))
+
+/* Only bother aggregating small frames; big frames gain nothing */
+#define	IWA_AMSDU_MAX_FRAMELEN	1024
+
+/* Max MPDU length inside an HT A-MPDU */
+#define	IWA_AMSDU_MAX_AMPDU_LEN	4095
+
+struct iwa_amsdu {
+	struct ieee80211_node	*am_ni;		/* NULL if nothing pending */
+	int			am_tid;
+	struct mbuf		*am_head;	/* m_nextpkt linked frames */
+	struct mbuf		*am_tail;
+	int			am_nframes;
+	int			am_len;		/* A-MSDU payload length */
+	int			am_maxlen;	/* peer max A-MSDU length */
+};
+
+/*
+ * TX queue watchdog.
+ *
+ * A queue with frames pending that hasn't completed anything in
+ * wd_timeout milliseconds is first flushed with TXPATH_FLUSH; if
+ * that doesn't get it going again the firmware is restarted.
+ */
+#define	IWA_TXQ_WD_IDLE		0	/* queue is making progress */
+#define	IWA_TXQ_WD_FLUSHED	1	/* TXPATH_FLUSH sent */
+
+#define	IWA_TXQ_WD_INTERVAL	hz	/* callout period */
+
+struct iwa_txq_wd_stats {
+	uint32_t	wd_timeouts;	/* queue found stuck */
+	uint32_t	wd_flushes;	/* TXPATH_FLUSH sent */
+	uint32_t	wd_flush_fail;	/* TXPATH_FLUSH couldn't be sent */
+	uint32_t	wd_restarts;	/* firmware restart scheduled */
+};
+
+struct iwa_softc;
+struct iwa_tx_ring;
+struct iwl_rx_packet;
+struct ifnet;
+struct ieee80211_bpf_params;
+
+extern	void iwa_start(struct ifnet *ifp);
+extern	int iwa_raw_xmit(struct ieee80211_node *ni, struct mbuf *m,
+	    const struct ieee80211_bpf_params *params);
+extern	void iwa_start_locked(struct iwa_softc *sc);
+extern	void iwa_newassoc(struct ieee80211_node *ni, int isnew);
+extern	void iwa_tx_task(void *arg, int npending);
+
+extern	int iwa_tx_ring_submit(struct iwa_softc *sc, struct iwa_tx_ring *ring,
+	    struct mbuf **mp, int cmdlen);
+extern	void iwa_tx_reclaim(struct iwa_softc *sc, struct iwa_tx_ring *ring,
+	    int idx, int status);
+extern	void iwa_tx_resp(struct iwa_softc *sc, struct iwl_rx_packet *pkt);
+extern	void iwa_tx_ba_notif(struct iwa_softc *sc, struct iwl_rx_packet *pkt);
+
+extern	bool iwa_amsdu_eligible(struct iwa_softc *sc,
+	    struct ieee80211_node *ni, struct mbuf *m);
+extern	struct mbuf *iwa_amsdu_enqueue(struct iwa_softc *sc,
+	    struct ieee80211_node *ni, struct mbuf *m);
+extern	struct mbuf *iwa_amsdu_flush(struct iwa_softc *sc);
+extern	void iwa_amsdu_drain(struct iwa_softc *sc);
+
+extern	void iwa_tx_watchdog_start(struct iwa_softc *sc);
+extern	void iwa_tx_watchdog_stop(struct iwa_softc *sc);
+
+#endif	/* __IF_IWA_TX_H__ */
@@ -0,0 +1,458 @@
+/*-
+ * Copyright (c) 2014 Adrian Chadd <adrian@FreeBSD.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "opt_wlan.h"
+//#include "opt_iwa.h"
+
+#include <sys/param.h>
+#include <sys/sockio.h>
+#include <sys/sysctl.h>
+#include <sys/mbuf.h>
+#include <sys/kernel.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/bus.h>
+#include <sys/rman.h>
+#include <sys/endian.h>
+#include <sys/firmware.h>
+#include <sys/limits.h>
+#include <sys/module.h>
+#include <sys/queue.h>
+#include <sys/taskqueue.h>
+
+#include <machine/bus.h>
+#include <machine/resource.h>
+#include <machine/clock.h>
+
+#include <dev/pci/pcireg.h>
+#include <dev/pci/pcivar.h>
+
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <net/if_dl.h>
+#include <net/if_media.h>
+#include <net/if_types.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/in_var.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+
+#include <net80211/ieee80211_var.h>
+#include <net80211/ieee80211_radiotap.h>
+#include <net80211/ieee80211_regdomain.h>
+#include <net80211/ieee80211_ratectl.h>
+
+#include <dev/iwa/if_iwa_debug.h>
+
+#include <dev/iwa/drv-compat.h>
+
+#include <dev/iwa/iwl/iwl-config.h>
+
+#include <dev/iwa/iwl/iwl-csr.h>
+#include <dev/iwa/iwl/iwl-fw.h>
+#include <dev/iwa/iwl/iwl-fh.h>
+#include <dev/iwa/iwl/iwl-trans.h>
+
+#include <dev/iwa/iwl/mvm/fw-api.h>
+
+#include <dev/iwa/if_iwa_firmware.h>
+#include <dev/iwa/if_iwa_trans.h>
+#include <dev/iwa/if_iwa_nvm.h>
+#include <dev/iwa/if_iwa_tx.h>
+#include <dev/iwa/if_iwa_txq.h>
+#include <dev/iwa/if_iwa_sched.h>
+#include <dev/iwa/if_iwa_rxreorder.h>
+#include <dev/iwa/if_iwa_stats.h>
+#include <dev/iwa/if_iwa_phy_db.h>
+#include <dev/iwa/if_iwavar.h>
+#include <dev/iwa/if_iwareg.h>
+
+#include <dev/iwa/if_iwa_fw_util.h>
+
+/*
+ * Reset the queue allocator.  This is called after each firmware
+ * load; the firmware forgets any queue configuration it had.
+ *
+ * The command queue and the off-channel queue are never handed out.
+ */
+void
+iwa_txq_init(struct iwa_softc *sc)
+{
+	int sta, tid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	memset(sc->sc_txq_map, 0, sizeof(sc->sc_txq_map));
+	for (sta = 0; sta < IWL_MVM_STATION_COUNT; sta++)
+		for (tid = 0; tid < IWA_TXQ_NUM_TIDS; tid++)
+			sc->sc_txq_bytid[sta][tid] = IWA_TXQ_INVALID;
+	memset(sc->sc_txq_want, 0, sizeof(sc->sc_txq_want));
+	sc->sc_txq_stagone = 0;
+
+	sc->sc_txq_inuse = (1 << IWL_MVM_CMD_QUEUE) |
+	    (1 << IWL_MVM_OFFCHANNEL_QUEUE);
+}
+
+/*
+ * Return the queue assigned to the given station/TID, or
+ * IWA_TXQ_INVALID if there isn't one.
+ *
+ * A station waiting to be torn down has no queues as far as the
+ * TX path is concerned; see iwa_txq_remove_sta().
+ */
+int
+iwa_txq_lookup(struct iwa_softc *sc, int sta_id, int tid)
+{
+	int qid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	KASSERT(sta_id < IWL_MVM_STATION_COUNT && tid < IWA_TXQ_NUM_TIDS,
+	    ("%s: bad sta_id %d / tid %d", __func__, sta_id, tid));
+
+	if (sc->sc_txq_stagone & (1 << sta_id))
+		return (IWA_TXQ_INVALID);
+
+	qid = sc->sc_txq_bytid[sta_id][tid];
+	if (qid != IWA_TXQ_INVALID)
+		sc->sc_txq_map[qid].tm_lastuse = ticks;
+	return (qid);
+}
+
+/*
+ * Find a free queue in the bitmap; returns IWA_TXQ_INVALID if
+ * they're all in use.
+ */
+static int
+iwa_txq_find_free(struct iwa_softc *sc)
+{
+	uint32_t avail;
+
+	avail = ~sc->sc_txq_inuse;
+	avail &= (1U << sc->sc_cfg->base_params->num_of_queues) - 1;
+	if (avail == 0)
+		return (IWA_TXQ_INVALID);
+	return (ffs(avail) - 1);
+}
+
+/*
+ * Tell the firmware about a queue mapping.
+ */
+static int
+iwa_txq_send_cfg(struct iwa_softc *sc, int qid, int sta_id, int tid,
+    int fifo, bool enable)
+{
+	struct iwl_scd_txq_cfg_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.scd_queue = qid;
+	cmd.enable = enable;
+	if (enable) {
+		cmd.sta_id = sta_id;
+		cmd.tid = tid;
+		cmd.tx_fifo = fifo;
+		cmd.window = IWL_FRAME_LIMIT;
+		cmd.aggregate = 0;
+		cmd.ssn = htole16(0);
+		cmd.control = IWL_SCD_CONTROL_SET_SSN;
+	} else {
+		cmd.sta_id = IWL_SCDQ_INVALID_STA;
+	}
+
+	/*
+	 * iwlwifi: the reply is an iwl_scd_txq_cfg_rsp echoing the
+	 * queue/sta/tid rather than a status word, so just send it
+	 * synchronously.
+	 */
+	return (iwa_mvm_send_cmd_pdu(sc, SCD_QUEUE_CFG, 0, sizeof(cmd), &cmd));
+}
+
+/*
+ * Allocate a hardware queue for the given station/TID and enable it.
+ *
+ * If the station/TID already has a queue then that's returned.
+ * If we're out of queues then idle queues are reclaimed first.
+ *
+ * This sleeps waiting for the firmware; it requires the IWA lock
+ * to be held.
+ */
+int
+iwa_txq_alloc(struct iwa_softc *sc, int sta_id, int tid, int fifo,
+    int *qidp)
+{
+	struct iwa_txq_map *tm;
+	int error, qid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if ((qid = iwa_txq_lookup(sc, sta_id, tid)) != IWA_TXQ_INVALID) {
+		*qidp = qid;
+		return (0);
+	}
+
+	qid = iwa_txq_find_free(sc);
+	if (qid == IWA_TXQ_INVALID && iwa_txq_free_idle(sc) > 0)
+		qid = iwa_txq_find_free(sc);
+	if (qid == IWA_TXQ_INVALID) {
+		device_printf(sc->sc_dev,
+		    "%s: no free TX queue for sta %d tid %d\n",
+		    __func__, sta_id, tid);
+		return (ENOSPC);
+	}
+
+	/* Grab it now; the firmware command below may sleep */
+	sc->sc_txq_inuse |= (1 << qid);
+
+	iwa_reset_tx_ring(sc, &sc->txq[qid]);
+	if ((error = iwa_txq_set_ptrs(sc, qid, 0)) != 0 ||
+	    (error = iwa_txq_send_cfg(sc, qid, sta_id, tid, fifo,
+	    true)) != 0) {
+		device_printf(sc->sc_dev,
+		    "%s: failed to enable qid %d: %d\n",
+		    __func__, qid, error);
+		sc->sc_txq_inuse &= ~(1 << qid);
+		return (error);
+	}
+
+	tm = &sc->sc_txq_map[qid];
+	tm->tm_active = true;
+	tm->tm_sta_id = sta_id;
+	tm->tm_tid = tid;
+	tm->tm_fifo = fifo;
+	tm->tm_lastuse = ticks;
+	sc->sc_txq_bytid[sta_id][tid] = qid;
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: sta %d tid %d -> qid %d (fifo %d)\n",
+	    __func__, sta_id, tid, qid, fifo);
+
+	*qidp = qid;
+	return (0);
+}
+
+/*
+ * Disable a queue and return it to the pool.
+ *
+ * Anything still on the ring is freed.
+ *
+ * This sleeps waiting for the firmware; it requires the IWA lock
+ * to be held.
+ */
+int
+iwa_txq_free(struct iwa_softc *sc, int qid)
+{
+	struct iwa_txq_map *tm = &sc->sc_txq_map[qid];
+	int error;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (! tm->tm_active)
+		return (0);
+
+	IWA_DPRINTF(sc, IWA_DEBUG_TX,
+	    "%s: qid %d (sta %d tid %d)\n",
+	    __func__, qid, tm->tm_sta_id, tm->tm_tid);
+
+	/* Unhook it first so nothing new gets queued while we sleep */
+	sc->sc_txq_bytid[tm->tm_sta_id][tm->tm_tid] = IWA_TXQ_INVALID;
+	tm->tm_active = false;
+
+	error = iwa_txq_send_cfg(sc, qid, 0, 0, 0, false);
+	if (error != 0)
+		device_printf(sc->sc_dev,
+		    "%s: failed to disable qid %d: %d\n",
+		    __func__, qid, error);
+
+	iwa_reset_tx_ring(sc, &sc->txq[qid]);
+	sc->sc_txq_inuse &= ~(1 << qid);
+
+	return (error);
+}
+
+/*
+ * Free all queues belonging to the given station (eg on disassociation.)
+ */
+void
+iwa_txq_free_sta(struct iwa_softc *sc, int sta_id)
+{
+	int qid, tid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (tid = 0; tid < IWA_TXQ_NUM_TIDS; tid++) {
+		qid = sc->sc_txq_bytid[sta_id][tid];
+		if (qid != IWA_TXQ_INVALID)
+			(void) iwa_txq_free(sc, qid);
+	}
+}
+
+/*
+ * Free queues that are empty and haven't been used for
+ * IWA_TXQ_IDLE_TIMEOUT.  Returns how many were freed.
+ */
+int
+iwa_txq_free_idle(struct iwa_softc *sc)
+{
+	struct iwa_txq_map *tm;
+	int nfreed = 0, qid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (qid = 0; qid < sc->sc_cfg->base_params->num_of_queues; qid++) {
+		tm = &sc->sc_txq_map[qid];
+		if (! tm->tm_active)
+			continue;
+		if (sc->txq[qid].queued != 0)
+			continue;
+		if (ticks - tm->tm_lastuse < IWA_TXQ_IDLE_TIMEOUT)
+			continue;
+		if (iwa_txq_free(sc, qid) == 0)
+			nfreed++;
+	}
+	return (nfreed);
+}
+
+/*
+ * Map a TID to the TX FIFO for its access category.
+ * Non-QoS frames go out as best effort.
+ *
+ * iwlwifi: iwl_mvm_ac_to_tx_fifo[]
+ */
+static int
+iwa_txq_tid_to_fifo(int tid)
+{
+	static const uint8_t ac_to_fifo[WME_NUM_AC] = {
+		[WME_AC_BE] = IWL_MVM_TX_FIFO_BE,
+		[WME_AC_BK] = IWL_MVM_TX_FIFO_BK,
+		[WME_AC_VI] = IWL_MVM_TX_FIFO_VI,
+		[WME_AC_VO] = IWL_MVM_TX_FIFO_VO,
+	};
+
+	if (tid == IWA_TXQ_TID_NONQOS)
+		return (IWL_MVM_TX_FIFO_BE);
+	return (ac_to_fifo[TID_TO_WME_AC(tid)]);
+}
+
+/*
+ * Ask for a queue to be set up for the given station/TID.
+ *
+ * Enabling a queue sleeps waiting for the firmware, which the TX path
+ * can't do, so it's left to iwa_tx_task(); until then the scheduler
+ * holds on to the frames.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_txq_request(struct iwa_softc *sc, int sta_id, int tid)
+{
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (sc->sc_txq_want[sta_id] & (1 << tid))
+		return;
+	sc->sc_txq_want[sta_id] |= (1 << tid);
+	taskqueue_enqueue(sc->sc_tq, &sc->sc_tx_task);
+}
+
+/*
+ * Schedule the given station's queues to be torn down (eg when its
+ * station id is reused for a new association.)
+ *
+ * Until iwa_tx_task() has done so the station has no queues, so
+ * anything queued for it from now on waits for fresh ones.
+ *
+ * This requires the IWA lock to be held.
+ */
+void
+iwa_txq_remove_sta(struct iwa_softc *sc, int sta_id)
+{
+
+	IWA_LOCK_ASSERT(sc);
+
+	sc->sc_txq_stagone |= (1 << sta_id);
+	taskqueue_enqueue(sc->sc_tq, &sc->sc_tx_task);
+}
+
+/*
+ * Tear down the queues of removed stations, then set up the queues
+ * the TX path has asked for.
+ *
+ * A request that can't be satisfied (every queue busy) is kept and
+ * retried from the TX watchdog; see iwa_txq_pending().
+ *
+ * This sleeps waiting for the firmware; it requires the IWA lock
+ * to be held.
+ */
+void
+iwa_txq_service(struct iwa_softc *sc)
+{
+	uint16_t want;
+	int qid, sta_id, tid;
+
+	IWA_LOCK_ASSERT(sc);
+
+	for (sta_id = 0; sta_id < IWL_MVM_STATION_COUNT; sta_id++) {
+		if ((sc->sc_txq_stagone & (1 << sta_id)) == 0)
+			continue;
+		iwa_txq_free_sta(sc, sta_id);
+		sc->sc_txq_stagone &= ~(1 << sta_id);
+	}
+
+	for (sta_id = 0; sta_id < IWL_MVM_STATION_COUNT; sta_id++) {
+		/*
+		 * Take the requests up front; the lock is dropped
+		 * while the firmware is busy and new ones may come in.
+		 */
+		want = sc->sc_txq_want[sta_id];
+		sc->sc_txq_want[sta_id] = 0;
+		for (tid = 0; want != 0; tid++, want >>= 1) {
+			if ((want & 1) == 0)
+				continue;
+			if (sc->sc_inactive)
+				return;
+			if (iwa_txq_alloc(sc, sta_id, tid,
+			    iwa_txq_tid_to_fifo(tid), &qid) != 0)
+				sc->sc_txq_want[sta_id] |= (1 << tid);
+		}
+	}
+}
+
+/*
+ * Return whether there are queue requests still outstanding.
+ */
+bool
+iwa_txq_pending(struct iwa_softc *sc)
+{
+	int sta_id;
+
+	IWA_LOCK_ASSERT(sc);
+
+	if (sc->sc_txq_stagone != 0)
+		return (true);
+	for (sta_id = 0; sta_id < IWL_MVM_STATION_COUNT; sta_id++)
+		if (sc->sc_txq_want[sta_id] != 0)
+			return (true);
+	return (false);
+}
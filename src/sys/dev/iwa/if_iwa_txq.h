@@ -0,0 +1,47 @@
+#ifndef	__IF_IWA_TXQ_H__
+#define	__IF_IWA_TXQ_H__
+
+/*
+ * TX queue manager.
+ *
+ * The command queue (and the off-channel queue) are fixed; the rest
+ * of the hardware queues are handed out on demand to (station, TID)
+ * pairs via SCD_QUEUE_CFG.  Each (station, TID) gets its own queue
+ * so a slow/stalled flow doesn't block anyone else.
+ *
+ * Queues which have been idle for IWA_TXQ_IDLE_TIMEOUT are taken back
+ * when we run out.
+ */
+
+/* TIDs 0..7 (IWL_MAX_TID_COUNT) plus one for non-QoS frames */
+#define	IWA_TXQ_TID_NONQOS	8
+#define	IWA_TXQ_NUM_TIDS	9
+
+#define	IWA_TXQ_INVALID		(-1)
+
+/* How long a queue has to be empty before it's reclaimable */
+#define	IWA_TXQ_IDLE_TIMEOUT	(5 * hz)
+
+struct iwa_txq_map {
+	bool		tm_active;
+	uint8_t		tm_sta_id;
+	uint8_t		tm_tid;
+	uint8_t		tm_fifo;
+	int		tm_lastuse;	/* ticks */
+};
+
+struct iwa_softc;
+
+extern	void iwa_txq_init(struct iwa_softc *sc);
+extern	int iwa_txq_lookup(struct iwa_softc *sc, int sta_id, int tid);
+extern	int iwa_txq_alloc(struct iwa_softc *sc, int sta_id, int tid,
+	    int fifo, int *qidp);
+extern	int iwa_txq_free(struct iwa_softc *sc, int qid);
+extern	void iwa_txq_free_sta(struct iwa_softc *sc, int sta_id);
+extern	int iwa_txq_free_idle(struct iwa_softc *sc);
+extern	void iwa_txq_request(struct iwa_softc *sc, int sta_id, int tid);
+extern	void iwa_txq_remove_sta(struct iwa_softc *sc, int sta_id);
+extern	void iwa_txq_service(struct iwa_softc *sc);
+extern	bool iwa_txq_pending(struct iwa_softc *sc);
+
+#endif	/* __IF_IWA_TXQ_H__ */
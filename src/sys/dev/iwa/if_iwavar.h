@@ -27,11 +27,28 @@
 #define	IWM_FLAG_STOPPED	0x04
 #define	IWM_FLAG_RFKILL		0x08
 
+struct iwa_rx_stats {
+	uint32_t	rx_crc_err;	/* bad CRC / RXE overrun */
+	uint32_t	rx_runt;	/* too short / bad length */
+	uint32_t	rx_nobuf;	/* couldn't replace/copy buffer */
+	uint32_t	rx_noif;	/* no net80211 attached */
+	uint32_t	rx_copied;	/* copied out of the RX buffer */
+	uint32_t	rx_zerocopy;	/* passed up in the RX buffer */
+	uint32_t	rx_batches;	/* batches handed to net80211 */
+	uint32_t	rx_wptr_writes;	/* RX write pointer updates */
+	uint32_t	rx_reserve_fail; /* couldn't top up the RX reserve */
+};
+
 struct iwa_vap {
 	struct ieee80211vap	iv_vap;
 };
 #define	IWA_VAP(_vap)	((struct iwa_vap *)(_vap))
 
+/* sc_attach_state */
+#define	IWA_ATTACH_PENDING	0	/* firmware bring-up not done yet */
+#define	IWA_ATTACH_DONE		1
+#define	IWA_ATTACH_FAILED	2
+
 struct iwa_softc {
 	device_t		sc_dev;
 
@@ -60,10 +77,10 @@ struct iwa_softc {
 
 	/* Firmware */
 	struct iwa_fw_info	sc_fw;
-	int			sc_fw_chunk_done;
-	int			sc_init_complete;
+	struct iwa_phy_db	sc_phy_db;
 	enum iwl_ucode_type	sc_uc_current;
 	struct iwa_ucode_status sc_uc;
+	TAILQ_HEAD(, iwa_notif_wait) sc_notif_waits;
 	int			sc_fw_phy_config;
 	int			sc_fwver;
 	int			sc_capa_max_probe_len;
@@ -72,9 +89,11 @@ struct iwa_softc {
 	/* Firmware DMA transfer. */
 	struct iwa_dma_info	fw_dma;
 	bus_size_t		sc_fw_dmasegsz;
+	int			sc_fw_poll;	/* load without interrupts */
 
 	/* NVRAM */
 	struct iwa_nvm_data	sc_nvm;
+	struct iwa_nvm_cache	sc_nvm_cache;
 
 	/* TX scheduler rings. */
 	struct iwa_dma_info	sched_dma;
@@ -84,8 +103,47 @@ struct iwa_softc {
 	struct iwa_tx_ring txq[IWA_MVM_MAX_QUEUES];
 	struct iwa_tx_ring_meta txq_meta[IWA_MVM_MAX_QUEUES];
 	struct iwa_rx_ring rxq;
+
+	/* RX data path */
+	struct iwl_rx_phy_info	sc_last_phy_info;
+	int			sc_rx_copy_thresh;
+	int			sc_rbuf_size;	/* RX buffer size */
+	struct iwa_rx_stats	sc_rx_stats;
+
+	/* Firmware statistics */
+	struct iwa_stats	sc_stats;
+
+	/* Firmware log streaming */
+	struct iwa_fwlog	*sc_fwlog;
+
+	/* Last firmware crash capture */
+	struct iwa_crash_dump	*sc_crash;
+
+	/* Configuration command journal, for firmware restart */
+	struct iwa_journal	*sc_journal;
+
+	/* A-MPDU RX reorder buffer */
+	struct iwa_rxba		sc_rxba[IWL_MAX_RX_BA_SESSIONS];
+	int			sc_rxba_nactive;
+	struct iwa_rxba_stats	sc_rxba_stats;
+	struct mbuf		*sc_rxba_pend_head;	/* for sc_rxba_task */
+	struct mbuf		*sc_rxba_pend_tail;
 	int qfullmsk;
 
+	/* TX queue manager */
+	uint32_t		sc_txq_inuse;	/* bitmap of allocated queues */
+	struct iwa_txq_map	sc_txq_map[IWA_MVM_MAX_QUEUES];
+	int8_t			sc_txq_bytid[IWL_MVM_STATION_COUNT][IWA_TXQ_NUM_TIDS];
+	uint16_t		sc_txq_want[IWL_MVM_STATION_COUNT]; /* TIDs */
+	uint32_t		sc_txq_stagone;	/* stations to tear down */
+
+	/* Pending A-MSDU (TX) */
+	struct iwa_amsdu	sc_amsdu;
+	uint32_t		sc_amsdu_drops;	/* subframes lost building one */
+
+	/* Airtime fair TX scheduler */
+	struct iwa_sched	sc_sched;
+
 	/* ICT table. */
 	struct iwa_dma_info	ict_dma;
 	uint32_t		*ict;
@@ -100,8 +158,34 @@ struct iwa_softc {
 	/* ifnet layer resources */
 	struct ifnet		*sc_ifp;
 
+	/* net80211 methods we override */
+	int			(*sc_ampdu_rx_start)(struct ieee80211_node *,
+				    struct ieee80211_rx_ampdu *, int, int, int);
+	void			(*sc_ampdu_rx_stop)(struct ieee80211_node *,
+				    struct ieee80211_rx_ampdu *);
+
 	/* Taskqueue */
 	struct taskqueue	*sc_tq;
+	struct task		sc_restart_task;
+	struct task		sc_rxba_task;
+	struct task		sc_tx_task;
+	struct task		sc_attach_task;
+
+	/* Deferred attach */
+	struct intr_config_hook	sc_preinit_hook;
+	int			sc_attach_state;	/* IWA_ATTACH_* */
+
+	/* Suspend/resume */
+	int			sc_suspended;
+	int			sc_resuming;	/* polled firmware load */
+	uint32_t		sc_resume_usec;
+
+	/* TX queue watchdog */
+	struct callout		sc_watchdog_to;
+	struct iwa_txq_wd_stats	sc_txq_wd;
+
+	/* Hardware wait times */
+	struct iwa_wait_stats	sc_wait_stats;
 
 	/* Configuration */
 	const struct iwl_cfg	*sc_cfg;